@@ -0,0 +1,188 @@
+/*
+    block_stream.c
+    passing blocks read from the console to the threads that use them
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "block_stream.h"
+#include "thread.h"
+
+/*
+    published and each consumer's consumed count only ever increase; buffer
+    n of the stream lives in buffers[n % BLOCK_STREAM_BUFFERS]. Everything
+    is guarded by lock, and changed is broadcast whenever any of it changes.
+*/
+struct block_stream_consumer {
+    struct block_consumer consumer;
+    struct block_stream * stream;
+    aulon_thread thread;
+    uint32_t consumed;
+    int succeeded;
+};
+
+struct block_stream {
+    struct block_buffer * buffers;
+    struct block_stream_consumer consumers[BLOCK_STREAM_MAX_CONSUMERS];
+    unsigned int consumer_count;
+    unsigned int threads_started;
+    uint32_t published;
+    int ended;          // the producer has finished
+    int complete;       // ... having produced every block
+    int stopped;        // a consumer has failed
+    aulon_mutex lock;
+    aulon_cond changed;
+};
+
+
+struct block_stream * block_stream_create(void) {
+    struct block_stream * stream = calloc(1, sizeof(struct block_stream));
+    if (stream != NULL) {
+        stream->buffers = malloc(BLOCK_STREAM_BUFFERS * sizeof(struct block_buffer));
+    }
+    if (stream == NULL || stream->buffers == NULL) {
+        fprintf(stderr, "Could not allocate memory for block buffers.\n");
+        free(stream);
+        return NULL;
+    }
+    mutex_init(&stream->lock);
+    cond_init(&stream->changed);
+    return stream;
+}
+
+int block_stream_attach(struct block_stream * stream, const struct block_consumer * consumer) {
+    if (stream->consumer_count == BLOCK_STREAM_MAX_CONSUMERS || stream->threads_started) {
+        fprintf(stderr, "Could not attach another consumer to the block stream.\n");
+        return 0;
+    }
+    struct block_stream_consumer * state = &stream->consumers[stream->consumer_count++];
+    state->consumer = *consumer;
+    state->stream = stream;
+    return 1;
+}
+
+
+static void consumer_thread(void * argument) {
+    struct block_stream_consumer * state = argument;
+    struct block_stream * stream = state->stream;
+    int complete = 0;
+
+    mutex_lock(&stream->lock);
+    while (1) {
+        while (state->consumed == stream->published && !stream->ended && !stream->stopped) {
+            cond_wait(&stream->changed, &stream->lock);
+        }
+        if (stream->stopped || state->consumed == stream->published) {
+            complete = stream->complete && !stream->stopped;
+            break;
+        }
+        const struct block_buffer * buffer = &stream->buffers[state->consumed % BLOCK_STREAM_BUFFERS];
+        mutex_unlock(&stream->lock);
+
+        int consumed = state->consumer.consume(state->consumer.context, buffer);
+
+        mutex_lock(&stream->lock);
+        state->consumed++;
+        if (!consumed) {
+            stream->stopped = 1;
+        }
+        cond_broadcast(&stream->changed);
+    }
+    mutex_unlock(&stream->lock);
+
+    state->succeeded = complete;
+    if (state->consumer.finish && !state->consumer.finish(state->consumer.context, complete)) {
+        state->succeeded = 0;
+    }
+}
+
+int block_stream_start(struct block_stream * stream) {
+    unsigned int i;
+    for (i = 0; i < stream->consumer_count; ++i) {
+        if (!thread_create(&stream->consumers[i].thread, consumer_thread, &stream->consumers[i])) {
+            // Let the ones already running end
+            block_stream_finish(stream, 0);
+            return 0;
+        }
+        stream->threads_started++;
+    }
+    return 1;
+}
+
+
+static uint32_t slowest_consumed(struct block_stream * stream) {
+    uint32_t slowest = stream->published;
+    unsigned int i;
+    for (i = 0; i < stream->consumer_count; ++i) {
+        if (stream->consumers[i].consumed < slowest) {
+            slowest = stream->consumers[i].consumed;
+        }
+    }
+    return slowest;
+}
+
+struct block_buffer * block_stream_acquire(struct block_stream * stream) {
+    struct block_buffer * buffer = NULL;
+    mutex_lock(&stream->lock);
+    while (!stream->stopped && stream->published - slowest_consumed(stream) == BLOCK_STREAM_BUFFERS) {
+        cond_wait(&stream->changed, &stream->lock);
+    }
+    if (!stream->stopped) {
+        buffer = &stream->buffers[stream->published % BLOCK_STREAM_BUFFERS];
+    }
+    mutex_unlock(&stream->lock);
+    return buffer;
+}
+
+void block_stream_publish(struct block_stream * stream) {
+    mutex_lock(&stream->lock);
+    stream->published++;
+    cond_broadcast(&stream->changed);
+    mutex_unlock(&stream->lock);
+}
+
+int block_stream_finish(struct block_stream * stream, int complete) {
+    mutex_lock(&stream->lock);
+    stream->ended = 1;
+    stream->complete = complete;
+    cond_broadcast(&stream->changed);
+    mutex_unlock(&stream->lock);
+
+    int success = complete;
+    unsigned int i;
+    for (i = 0; i < stream->threads_started; ++i) {
+        thread_join(stream->consumers[i].thread);
+        if (!stream->consumers[i].succeeded) {
+            success = 0;
+        }
+    }
+    stream->threads_started = 0;
+    return success;
+}
+
+void block_stream_destroy(struct block_stream * stream) {
+    if (stream == NULL) {
+        return;
+    }
+    cond_destroy(&stream->changed);
+    mutex_destroy(&stream->lock);
+    free(stream->buffers);
+    free(stream);
+}
@@ -0,0 +1,78 @@
+/*
+    block_stream.h
+    passing blocks read from the console to the threads that use them
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_BLOCK_STREAM_H
+#define AULON_BLOCK_STREAM_H
+
+#include <stdint.h>
+
+#include "commands.h"
+
+/*
+    A pool of block and spare buffers, filled by one producer (the thread
+    reading from the console) and drained by any number of consumers, each
+    on its own thread: writing to disk, printing progress, hashing, and so
+    on. Every consumer sees every block, in the order they were published,
+    and a buffer is reused only once all of them are done with it, so the
+    producer only ever waits when the slowest consumer falls a whole pool
+    behind.
+*/
+#define BLOCK_STREAM_BUFFERS       32
+#define BLOCK_STREAM_MAX_CONSUMERS 4
+
+struct block_buffer {
+    uint32_t block_number;
+    unsigned char block[BLOCK_SIZE];
+    unsigned char spare[SPARE_SIZE];
+};
+
+/*
+    consume is called with each block, and returns 0 to stop the stream
+    (e.g. when a write fails). finish, if not NULL, is called once after the
+    last block, with complete set if every block was produced and consumed;
+    it returns 0 if it fails.
+*/
+struct block_consumer {
+    int (*consume)(void * context, const struct block_buffer * buffer);
+    int (*finish)(void * context, int complete);
+    void * context;
+};
+
+struct block_stream;
+
+/*
+    Consumers are attached before the stream is started. The producer then
+    repeatedly acquires a buffer, fills it, and publishes it, and finally
+    calls block_stream_finish, which waits for the consumers to finish.
+
+    block_stream_create returns NULL on failure, and block_stream_acquire
+    returns NULL once a consumer has stopped the stream. block_stream_finish
+    returns 1 if the stream was complete and every consumer succeeded. The
+    other functions return 1 for success and 0 for failure.
+*/
+struct block_stream * block_stream_create(void);
+int block_stream_attach(struct block_stream * stream, const struct block_consumer * consumer);
+int block_stream_start(struct block_stream * stream);
+struct block_buffer * block_stream_acquire(struct block_stream * stream);
+void block_stream_publish(struct block_stream * stream);
+int block_stream_finish(struct block_stream * stream, int complete);
+void block_stream_destroy(struct block_stream * stream);
+
+#endif
@@ -0,0 +1,634 @@
+/*
+    bridge.c
+    reaching a console plugged into another machine
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L // for getaddrinfo under -std=c99
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
+#include "bridge.h"
+#include "io.h"
+#include "session.h"
+#include "transport.h"
+#include "usb.h"
+
+/*
+    Framing
+    Every message in either direction starts with a 12-byte header, all
+    big-endian:
+
+        type    1 byte, and 3 bytes of padding
+        value   4 bytes: the timeout in ms to the bridge, or the status from it
+        length  4 bytes
+
+    To the bridge:
+        'S' send: length bytes of OUT data follow. Not answered; a failure is
+            reported by the next 'F' or 'R'.
+        'F' flush: answered with an 'F' holding the status.
+        'R' receive: length is the most to read. Answered with an 'R' holding
+            the status, followed by the length bytes actually received.
+        'C' reconnect to the console: answered with a 'C' holding the status.
+
+    From the bridge, as soon as a client connects:
+        'H' hello: the status of the bridge's connection to its console, with
+            the console's maximum packet size as the length.
+
+    The client holds on to 'S' messages until it next flushes or receives,
+    and then sends them all along with the 'F' or 'R' in one write. The
+    bridge answers once, so a command and the read of its reply cost one
+    round trip between the machines, not one per transfer.
+*/
+#define BRIDGE_HEADER_SIZE  12
+#define BRIDGE_MAX_LENGTH   0x100000
+#define BRIDGE_BATCH_SIZE   0x10000
+#define BRIDGE_POLL_MS      250
+
+enum {
+    BRIDGE_SEND      = 'S',
+    BRIDGE_FLUSH     = 'F',
+    BRIDGE_RECEIVE   = 'R',
+    BRIDGE_RECONNECT = 'C',
+    BRIDGE_HELLO     = 'H'
+};
+
+static const int32_t STATUS_NO_DEVICE = -19;    // ENODEV, as when a console is unplugged
+static const int32_t STATUS_PROTOCOL  = -71;    // EPROTO
+
+#ifdef _WIN32
+typedef SOCKET bridge_socket;
+#define BRIDGE_INVALID_SOCKET INVALID_SOCKET
+#define close_socket closesocket
+#else
+typedef int bridge_socket;
+#define BRIDGE_INVALID_SOCKET (-1)
+#define close_socket close
+#endif
+
+static char * bridge_address = NULL;
+static volatile sig_atomic_t stop_requested = 0;
+
+
+void bridge_set_address(char * address) {
+    bridge_address = address;
+}
+
+const char * bridge_get_address(void) {
+    return bridge_address;
+}
+
+
+/*
+    Sockets
+*/
+static int sockets_init(void) {
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "Could not initialize Winsock.\n");
+        return 0;
+    }
+#else
+    // A connection closed by the other end is reported by send instead
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    return 1;
+}
+
+static void set_no_delay(bridge_socket sock) {
+    // Fails harmlessly on a Unix domain socket
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+}
+
+#ifndef _WIN32
+static bridge_socket open_unix_socket(const char * path, int listening) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path %s is too long.\n", path);
+        return BRIDGE_INVALID_SOCKET;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    bridge_socket sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == BRIDGE_INVALID_SOCKET) {
+        perror("Error creating socket");
+        return BRIDGE_INVALID_SOCKET;
+    }
+    if (listening) {
+        unlink(path);
+        if (bind(sock, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(sock, 1) != 0) {
+            perror("Error listening on socket");
+            close_socket(sock);
+            return BRIDGE_INVALID_SOCKET;
+        }
+    }
+    else if (connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror("Error connecting to bridge");
+        close_socket(sock);
+        return BRIDGE_INVALID_SOCKET;
+    }
+    return sock;
+}
+#endif
+
+static bridge_socket open_tcp_socket(const char * address, int listening) {
+    char host[256] = { 0 };
+    const char * port = strrchr(address, ':');
+    if (port == NULL || (size_t)(port - address) >= sizeof(host)) {
+        fprintf(stderr, "Invalid bridge address %s; expected host:port or unix:path.\n", address);
+        return BRIDGE_INVALID_SOCKET;
+    }
+    memcpy(host, address, port - address);
+    port++;
+
+    struct addrinfo hints;
+    struct addrinfo * results = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    int r = getaddrinfo(host[0] ? host : NULL, port, &hints, &results);
+    if (r != 0) {
+        fprintf(stderr, "Could not resolve %s: %s\n", address, gai_strerror(r));
+        return BRIDGE_INVALID_SOCKET;
+    }
+
+    bridge_socket sock = BRIDGE_INVALID_SOCKET;
+    struct addrinfo * result;
+    for (result = results; result != NULL; result = result->ai_next) {
+        sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (sock == BRIDGE_INVALID_SOCKET) {
+            continue;
+        }
+        if (listening) {
+            int on = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+            if (bind(sock, result->ai_addr, (int)result->ai_addrlen) == 0 && listen(sock, 1) == 0) {
+                break;
+            }
+        }
+        else if (connect(sock, result->ai_addr, (int)result->ai_addrlen) == 0) {
+            set_no_delay(sock);
+            break;
+        }
+        close_socket(sock);
+        sock = BRIDGE_INVALID_SOCKET;
+    }
+    freeaddrinfo(results);
+
+    if (sock == BRIDGE_INVALID_SOCKET) {
+        fprintf(stderr, "Could not %s %s.\n", listening ? "listen on" : "connect to", address);
+    }
+    return sock;
+}
+
+static bridge_socket open_socket(const char * address, int listening) {
+#ifndef _WIN32
+    if (strncmp(address, "unix:", 5) == 0) {
+        return open_unix_socket(address + 5, listening);
+    }
+#endif
+    return open_tcp_socket(address, listening);
+}
+
+static int send_all(bridge_socket sock, const unsigned char * data, size_t length) {
+    while (length > 0) {
+        int chunk = (length > 0x40000000) ? 0x40000000 : (int)length;
+        int sent = (int)send(sock, (const char *)data, chunk, 0);
+        if (sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 1;
+}
+
+static int receive_all(bridge_socket sock, unsigned char * data, size_t length) {
+    while (length > 0) {
+        int chunk = (length > 0x40000000) ? 0x40000000 : (int)length;
+        int received = (int)recv(sock, (char *)data, chunk, 0);
+        if (received <= 0) {
+            return 0;
+        }
+        data += received;
+        length -= (size_t)received;
+    }
+    return 1;
+}
+
+/*
+    Wait until the socket can be read from, or a stop is requested.
+*/
+static int wait_readable(bridge_socket sock) {
+    while (!stop_requested) {
+        fd_set readable;
+        struct timeval timeout = { 0, BRIDGE_POLL_MS * 1000 };
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        int r = select((int)sock + 1, &readable, NULL, NULL, &timeout);
+        if (r > 0) {
+            return 1;
+        }
+        if (r < 0 && !stop_requested) {
+            perror("Error waiting on socket");
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+/*
+    Messages
+*/
+static void put_header(unsigned char * out, unsigned char type, uint32_t value, uint32_t length) {
+    memset(out, 0, BRIDGE_HEADER_SIZE);
+    out[0] = type;
+    out[4]  = (value >> 24) & 0xFF;
+    out[5]  = (value >> 16) & 0xFF;
+    out[6]  = (value >>  8) & 0xFF;
+    out[7]  = value & 0xFF;
+    out[8]  = (length >> 24) & 0xFF;
+    out[9]  = (length >> 16) & 0xFF;
+    out[10] = (length >>  8) & 0xFF;
+    out[11] = length & 0xFF;
+}
+
+static int receive_header(bridge_socket sock, unsigned char * type, uint32_t * value, uint32_t * length) {
+    unsigned char header[BRIDGE_HEADER_SIZE];
+    if (!receive_all(sock, header, BRIDGE_HEADER_SIZE)) {
+        return 0;
+    }
+    *type = header[0];
+    *value = uchars_to_uint32(&header[4]);
+    *length = uchars_to_uint32(&header[8]);
+    return 1;
+}
+
+static int send_reply(bridge_socket sock, unsigned char type, int32_t status, uint32_t length) {
+    unsigned char header[BRIDGE_HEADER_SIZE];
+    put_header(header, type, (uint32_t)status, length);
+    return send_all(sock, header, BRIDGE_HEADER_SIZE);
+}
+
+
+/*
+    The bridge
+    One client is served at a time, on the console the bridge connected to
+    when it started. Anything the client sends that doesn't follow the
+    framing ends its connection.
+*/
+static void handle_interrupt(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+static int32_t bridge_status(struct session * session, int success) {
+    int32_t status = usb_get_last_status(session);
+    return (!success && status == 0) ? STATUS_PROTOCOL : status;
+}
+
+static void serve_client(struct session * session, bridge_socket client, unsigned char * buffer) {
+    unsigned char * data = buffer + BRIDGE_HEADER_SIZE;
+    if (!send_reply(client, BRIDGE_HELLO, 0, (uint32_t)usb_get_max_packet_size(session))) {
+        return;
+    }
+
+    while (wait_readable(client)) {
+        unsigned char type;
+        uint32_t timeout;
+        uint32_t length;
+        if (!receive_header(client, &type, &timeout, &length) || length > BRIDGE_MAX_LENGTH) {
+            return;
+        }
+
+        int success;
+        int actual_length = 0;
+        switch (type) {
+            case BRIDGE_SEND:
+                if (!receive_all(client, data, length)) {
+                    return;
+                }
+                usb_bulk_transfer_send_async(session, data, (int)length, timeout);
+                break;
+            case BRIDGE_FLUSH:
+                success = usb_bulk_transfer_flush(session);
+                if (!send_reply(client, BRIDGE_FLUSH, bridge_status(session, success), 0)) {
+                    return;
+                }
+                break;
+            case BRIDGE_RECEIVE:
+                success = usb_bulk_transfer_receive(session, data, (int)length, &actual_length, timeout);
+                put_header(buffer, BRIDGE_RECEIVE, (uint32_t)bridge_status(session, success), (uint32_t)actual_length);
+                if (!send_all(client, buffer, BRIDGE_HEADER_SIZE + (size_t)actual_length)) {
+                    return;
+                }
+                break;
+            case BRIDGE_RECONNECT:
+                success = usb_reconnect(session);
+                if (!send_reply(client, BRIDGE_RECONNECT, success ? 0 : STATUS_NO_DEVICE, 0)) {
+                    return;
+                }
+                break;
+            default:
+                fprintf(stderr, "Unknown message type 0x%02x from the client.\n", type);
+                return;
+        }
+    }
+}
+
+int bridge_serve(const char * address) {
+    if (!sockets_init()) {
+        return 0;
+    }
+    unsigned char * buffer = malloc(BRIDGE_HEADER_SIZE + BRIDGE_MAX_LENGTH);
+    struct session * session = session_create();
+    if (buffer == NULL || session == NULL) {
+        fprintf(stderr, "Could not allocate memory for the bridge.\n");
+        free(buffer);
+        session_destroy(session);
+        return 0;
+    }
+    if (!usb_init_connection(session)) {
+        fprintf(stderr, "Could not connect to the console to be bridged.\n");
+        free(buffer);
+        session_destroy(session);
+        return 0;
+    }
+    bridge_socket listener = open_socket(address, 1);
+    if (listener == BRIDGE_INVALID_SOCKET) {
+        free(buffer);
+        session_destroy(session);
+        return 0;
+    }
+
+    stop_requested = 0;
+    void (*previous_handler)(int) = signal(SIGINT, handle_interrupt);
+    printf("Bridging the console on %s. Press Ctrl+C to stop.\n", address);
+
+    int success = 1;
+    while (wait_readable(listener)) {
+        bridge_socket client = accept(listener, NULL, NULL);
+        if (client == BRIDGE_INVALID_SOCKET) {
+            perror("Error accepting connection");
+            success = 0;
+            break;
+        }
+        set_no_delay(client);
+        printf("Client connected.\n");
+        serve_client(session, client, buffer);
+        close_socket(client);
+        usb_bulk_transfer_flush(session);
+        printf("Client disconnected.\n");
+    }
+    success = success && stop_requested;
+
+    signal(SIGINT, previous_handler == SIG_ERR ? SIG_DFL : previous_handler);
+    close_socket(listener);
+#ifndef _WIN32
+    if (strncmp(address, "unix:", 5) == 0) {
+        unlink(address + 5);
+    }
+#endif
+    session_destroy(session);
+    free(buffer);
+    return success;
+}
+
+
+/*
+    The client
+*/
+struct bridge_client {
+    bridge_socket sock;
+    int max_packet_size;
+    int unconfirmed;            // sends have gone out since the bridge last reported a status
+    uint32_t batch_length;
+    unsigned char batch[BRIDGE_BATCH_SIZE + BRIDGE_HEADER_SIZE];
+};
+
+static int client_connect(struct bridge_client * client) {
+    client->sock = open_socket(bridge_address, 0);
+    if (client->sock == BRIDGE_INVALID_SOCKET) {
+        return 0;
+    }
+
+    unsigned char type;
+    uint32_t status;
+    uint32_t max_packet_size;
+    if (!receive_header(client->sock, &type, &status, &max_packet_size) || type != BRIDGE_HELLO) {
+        fprintf(stderr, "%s is not an aulon bridge.\n", bridge_address);
+    }
+    else if (status != 0) {
+        fprintf(stderr, "The bridge at %s has no console.\n", bridge_address);
+    }
+    else {
+        client->max_packet_size = (int)max_packet_size;
+        client->batch_length = 0;
+        client->unconfirmed = 0;
+        return 1;
+    }
+    close_socket(client->sock);
+    client->sock = BRIDGE_INVALID_SOCKET;
+    return 0;
+}
+
+static void * bridge_transport_open(void) {
+    if (!sockets_init()) {
+        return NULL;
+    }
+    struct bridge_client * client = calloc(1, sizeof(struct bridge_client));
+    if (client == NULL) {
+        fprintf(stderr, "Could not allocate memory for the bridge connection.\n");
+        return NULL;
+    }
+    if (!client_connect(client)) {
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+static void client_disconnect(struct bridge_client * client) {
+    if (client->sock != BRIDGE_INVALID_SOCKET) {
+        close_socket(client->sock);
+        client->sock = BRIDGE_INVALID_SOCKET;
+    }
+}
+
+static void bridge_transport_close(void * state) {
+    client_disconnect(state);
+    free(state);
+}
+
+static int bridge_transport_max_packet_size(void * state) {
+    return ((struct bridge_client *)state)->max_packet_size;
+}
+
+/*
+    The bridge going away is reported as the console going away, so the
+    host reconnects.
+*/
+static int connection_lost(struct bridge_client * client, int32_t * status) {
+    fprintf(stderr, "The connection to the bridge was lost.\n");
+    client_disconnect(client);
+    *status = STATUS_NO_DEVICE;
+    return 0;
+}
+
+static int write_batch(struct bridge_client * client) {
+    if (client->batch_length == 0) {
+        return 1;
+    }
+    int success = send_all(client->sock, client->batch, client->batch_length);
+    client->batch_length = 0;
+    return success;
+}
+
+static int bridge_transport_send(void * state, const unsigned char * data, uint32_t length, unsigned int timeout, int32_t * status) {
+    struct bridge_client * client = state;
+    *status = 0;
+    if (client->sock == BRIDGE_INVALID_SOCKET) {
+        *status = STATUS_NO_DEVICE;
+        return 0;
+    }
+
+    if (client->batch_length + BRIDGE_HEADER_SIZE + length > BRIDGE_BATCH_SIZE) {
+        if (!write_batch(client)) {
+            return connection_lost(client, status);
+        }
+    }
+    client->unconfirmed = 1;
+    if (BRIDGE_HEADER_SIZE + length > BRIDGE_BATCH_SIZE) {
+        unsigned char header[BRIDGE_HEADER_SIZE];
+        put_header(header, BRIDGE_SEND, timeout, length);
+        if (!send_all(client->sock, header, BRIDGE_HEADER_SIZE) || !send_all(client->sock, data, length)) {
+            return connection_lost(client, status);
+        }
+        return 1;
+    }
+
+    put_header(client->batch + client->batch_length, BRIDGE_SEND, timeout, length);
+    memcpy(client->batch + client->batch_length + BRIDGE_HEADER_SIZE, data, length);
+    client->batch_length += BRIDGE_HEADER_SIZE + length;
+    return 1;
+}
+
+/*
+    Send whatever is batched, followed by a request, and wait for its answer.
+*/
+static int exchange(struct bridge_client * client, unsigned char type, uint32_t timeout, uint32_t length,
+                    int32_t * status, uint32_t * reply_length) {
+    if (client->sock == BRIDGE_INVALID_SOCKET) {
+        *status = STATUS_NO_DEVICE;
+        return 0;
+    }
+    put_header(client->batch + client->batch_length, type, timeout, length);
+    client->batch_length += BRIDGE_HEADER_SIZE;
+
+    unsigned char reply_type;
+    uint32_t reply_status;
+    if (!write_batch(client) || !receive_header(client->sock, &reply_type, &reply_status, reply_length)) {
+        return connection_lost(client, status);
+    }
+    if (reply_type != type) {
+        fprintf(stderr, "Unexpected reply 0x%02x from the bridge.\n", reply_type);
+        return connection_lost(client, status);
+    }
+    client->unconfirmed = 0;
+    *status = (int32_t)reply_status;
+    return 1;
+}
+
+static int bridge_transport_flush(void * state, int32_t * status) {
+    struct bridge_client * client = state;
+    *status = 0;
+    if (client->batch_length == 0 && !client->unconfirmed) {
+        return 1;
+    }
+    uint32_t reply_length = 0;
+    return exchange(client, BRIDGE_FLUSH, 0, 0, status, &reply_length) && *status == 0;
+}
+
+static int bridge_transport_receive(void * state, unsigned char * data, uint32_t length, unsigned int timeout,
+                                    uint32_t * actual_length, int32_t * status) {
+    struct bridge_client * client = state;
+    *actual_length = 0;
+    uint32_t reply_length = 0;
+    if (!exchange(client, BRIDGE_RECEIVE, timeout, length, status, &reply_length)) {
+        return 0;
+    }
+    if (reply_length > length) {
+        fprintf(stderr, "The bridge sent more than was asked for.\n");
+        return connection_lost(client, status);
+    }
+    if (!receive_all(client->sock, data, reply_length)) {
+        return connection_lost(client, status);
+    }
+    *actual_length = reply_length;
+    return 1;
+}
+
+/*
+    If the bridge itself went away, connect to it again before asking it to
+    reconnect to its console.
+*/
+static int bridge_transport_reconnect(void * state) {
+    struct bridge_client * client = state;
+    if (client->sock == BRIDGE_INVALID_SOCKET && !client_connect(client)) {
+        return 0;
+    }
+    client->batch_length = 0;
+    int32_t status = 0;
+    uint32_t reply_length = 0;
+    return exchange(client, BRIDGE_RECONNECT, 0, 0, &status, &reply_length) && status == 0;
+}
+
+const struct transport bridge_transport = {
+    "bridge",
+    bridge_transport_open,
+    bridge_transport_close,
+    bridge_transport_max_packet_size,
+    bridge_transport_send,
+    bridge_transport_flush,
+    bridge_transport_receive,
+    bridge_transport_reconnect
+};
@@ -0,0 +1,41 @@
+/*
+    bridge.h
+    reaching a console plugged into another machine
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_BRIDGE_H
+#define AULON_BRIDGE_H
+
+#include "transport.h"
+
+/*
+    A bridge serves the console plugged into its machine over a socket
+    (bridge_serve, run with -B), and bridge_transport is its client (used
+    in place of libusb with -c). An address is unix:path for a Unix domain
+    socket, or host:port for TCP; a bridge may leave out the host to listen
+    on every interface.
+
+    bridge_serve returns 1 when stopped with Ctrl+C, or 0 on failure.
+*/
+void bridge_set_address(char * address);
+const char * bridge_get_address(void);
+int bridge_serve(const char * address);
+
+extern const struct transport bridge_transport;
+
+#endif
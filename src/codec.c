@@ -0,0 +1,303 @@
+/*
+    codec.c
+    encoding and decoding of the tagged transfer units used by the iQue Player
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "codec.h"
+
+/*
+    Received data arrives in 4-byte transfer units: a tag of 0x1C + n followed
+    by n (1-3) bytes of data. Nearly every unit of a large reply is a full
+    0x1F unit, so runs of those are decoded in bulk by the fastest routine the
+    CPU supports; any other unit (and the tail of the stream) is handled one at
+    a time by decode_one_unit.
+
+    Each bulk routine returns the number of full units it decoded. It stops at
+    the first group of units containing anything other than 0x1F, or when the
+    input or output is too short for its next group, and never writes past
+    out_length.
+*/
+typedef size_t (*bulk_decoder)(const unsigned char * in, size_t in_length,
+                               unsigned char * out, size_t out_length);
+
+/*
+    Data sent to the console in the piecemeal format is the mirror image:
+    a tag of 0x40 + n followed by n bytes, but without padding. Every group of
+    3 bytes but the last becomes a 4-byte 0x43 unit, so the bulk encoders
+    expand 3 bytes to 4 with a shuffle and OR in the tags. Each returns the
+    number of 3-byte groups it encoded, and never reads past in_length.
+*/
+typedef size_t (*bulk_encoder)(const unsigned char * in, size_t in_length, unsigned char * out);
+
+static const unsigned char FULL_UNIT = 0x1F;
+static const unsigned char FULL_PIECEMEAL_TAG = 0x43;
+
+
+static size_t decode_full_units_scalar(const unsigned char * in, size_t in_length,
+                                       unsigned char * out, size_t out_length) {
+    size_t units = 0;
+    while ((units * 4) + 4 <= in_length && (units * 3) + 3 <= out_length) {
+        const unsigned char * unit = in + (units * 4);
+        if (unit[0] != FULL_UNIT) {
+            break;
+        }
+        out[(units * 3)]     = unit[1];
+        out[(units * 3) + 1] = unit[2];
+        out[(units * 3) + 2] = unit[3];
+        units++;
+    }
+    return units;
+}
+
+
+static size_t encode_full_groups_scalar(const unsigned char * in, size_t in_length, unsigned char * out) {
+    size_t groups = 0;
+    while ((groups * 3) + 3 <= in_length) {
+        out[(groups * 4)]     = FULL_PIECEMEAL_TAG;
+        out[(groups * 4) + 1] = in[(groups * 3)];
+        out[(groups * 4) + 2] = in[(groups * 3) + 1];
+        out[(groups * 4) + 3] = in[(groups * 3) + 2];
+        groups++;
+    }
+    return groups;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CODEC_HAS_SIMD 1
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CODEC_TARGET(isa)
+#else
+#define CODEC_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// 4 units (16 bytes) in, 12 bytes out; the last 4 bytes stored are garbage
+CODEC_TARGET("ssse3")
+static size_t decode_full_units_ssse3(const unsigned char * in, size_t in_length,
+                                      unsigned char * out, size_t out_length) {
+    const __m128i compact = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    const __m128i full_tag = _mm_set1_epi8((char)FULL_UNIT);
+    size_t units = 0;
+    while ((units * 4) + 16 <= in_length && (units * 3) + 16 <= out_length) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + (units * 4)));
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, full_tag)) & 0x1111) != 0x1111) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(out + (units * 3)), _mm_shuffle_epi8(v, compact));
+        units += 4;
+    }
+    return units;
+}
+
+// 8 units (32 bytes) in, 24 bytes out; the last 8 bytes stored are garbage
+CODEC_TARGET("avx2")
+static size_t decode_full_units_avx2(const unsigned char * in, size_t in_length,
+                                     unsigned char * out, size_t out_length) {
+    // vpshufb works within each 128-bit lane; vpermd then joins the two 12-byte halves
+    const __m256i compact = _mm256_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+                                             1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    const __m256i full_tag = _mm256_set1_epi8((char)FULL_UNIT);
+    size_t units = 0;
+    while ((units * 4) + 32 <= in_length && (units * 3) + 32 <= out_length) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + (units * 4)));
+        if (((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, full_tag)) & 0x11111111u) != 0x11111111u) {
+            break;
+        }
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, compact), join);
+        _mm256_storeu_si256((__m256i *)(out + (units * 3)), v);
+        units += 8;
+    }
+    // Finish off any remaining groups of 4 that don't fill a whole vector
+    return units + decode_full_units_ssse3(in + (units * 4), in_length - (units * 4),
+                                           out + (units * 3), out_length - (units * 3));
+}
+
+// 4 groups (12 bytes, but 16 are loaded) in, 16 bytes out
+CODEC_TARGET("ssse3")
+static size_t encode_full_groups_ssse3(const unsigned char * in, size_t in_length, unsigned char * out) {
+    const __m128i expand = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    const __m128i tags = _mm_set1_epi32(FULL_PIECEMEAL_TAG);
+    size_t groups = 0;
+    while ((groups * 3) + 16 <= in_length) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + (groups * 3)));
+        v = _mm_or_si128(_mm_shuffle_epi8(v, expand), tags);
+        _mm_storeu_si128((__m128i *)(out + (groups * 4)), v);
+        groups += 4;
+    }
+    return groups;
+}
+
+// 8 groups (24 bytes, but 32 are loaded) in, 32 bytes out
+CODEC_TARGET("avx2")
+static size_t encode_full_groups_avx2(const unsigned char * in, size_t in_length, unsigned char * out) {
+    // vpermd moves input bytes 12-27 into the upper lane, then each lane expands as above
+    const __m256i split = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i expand = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                            -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    const __m256i tags = _mm256_set1_epi32(FULL_PIECEMEAL_TAG);
+    size_t groups = 0;
+    while ((groups * 3) + 32 <= in_length) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + (groups * 3)));
+        v = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, split), expand);
+        _mm256_storeu_si256((__m256i *)(out + (groups * 4)), _mm256_or_si256(v, tags));
+        groups += 8;
+    }
+    return groups + encode_full_groups_ssse3(in + (groups * 3), in_length - (groups * 3), out + (groups * 4));
+}
+
+static int cpu_has_ssse3(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static int cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    int os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6);
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // x86
+
+
+static bulk_decoder select_bulk_decoder(void) {
+#if defined(CODEC_HAS_SIMD)
+    if (cpu_has_avx2()) {
+        return decode_full_units_avx2;
+    }
+    if (cpu_has_ssse3()) {
+        return decode_full_units_ssse3;
+    }
+#endif
+    return decode_full_units_scalar;
+}
+
+
+static bulk_encoder select_bulk_encoder(void) {
+#if defined(CODEC_HAS_SIMD)
+    if (cpu_has_avx2()) {
+        return encode_full_groups_avx2;
+    }
+    if (cpu_has_ssse3()) {
+        return encode_full_groups_ssse3;
+    }
+#endif
+    return encode_full_groups_scalar;
+}
+
+
+/*
+    The implementations are chosen once, by codec_init, before any other
+    thread exists; until then (or if it is never called) the scalar ones
+    are used, so the pointers are only ever read while threads run.
+*/
+static bulk_decoder decode_full_units = decode_full_units_scalar;
+static bulk_encoder encode_full_groups = encode_full_groups_scalar;
+
+void codec_init(void) {
+    decode_full_units = select_bulk_decoder();
+    encode_full_groups = select_bulk_encoder();
+}
+
+
+size_t piecemeal_encoded_length(size_t in_length) {
+    // in_length + space for tags every 3 bytes
+    return (in_length) + (in_length / 3) + (in_length % 3 != 0);
+}
+
+
+size_t encode_piecemeal_data(const unsigned char * in, size_t in_length, unsigned char * out) {
+    size_t groups = encode_full_groups(in, in_length, out);
+    groups += encode_full_groups_scalar(in + (groups * 3), in_length - (groups * 3), out + (groups * 4));
+
+    size_t in_offset = groups * 3;
+    size_t out_offset = groups * 4;
+    if (in_offset < in_length) {
+        unsigned char bytes_in_section = (unsigned char)(in_length - in_offset);
+        out[out_offset] = 0x40 + bytes_in_section;
+        memcpy(out + out_offset + 1, in + in_offset, bytes_in_section);
+        out_offset += bytes_in_section + 1;
+    }
+    return out_offset;
+}
+
+
+static int decode_one_unit(const unsigned char * in, size_t in_length, size_t * in_offset,
+                           unsigned char * out, size_t out_length, size_t * out_offset) {
+    unsigned char tu = in[*in_offset];
+    if (tu != 0x1F && tu != 0x1E && tu != 0x1D) {
+        fprintf(stderr, "Unknown transfer unit type encountered when parsing received data: %hhx\n", tu);
+        return 0;
+    }
+
+    // Never read past the end of the input or write past the end of the output
+    size_t tu_length = tu - 0x1C;
+    if (tu_length > in_length - *in_offset - 1) {
+        tu_length = in_length - *in_offset - 1;
+    }
+    if (tu_length > out_length - *out_offset) {
+        tu_length = out_length - *out_offset;
+    }
+
+    memcpy(out + *out_offset, in + *in_offset + 1, tu_length);
+    *out_offset += tu_length;
+    *in_offset += 4;
+    return 1;
+}
+
+
+int decode_transfer_units(const unsigned char * in, size_t in_length,
+                          unsigned char * out, size_t out_length, size_t * decoded_length) {
+    size_t in_offset = 0;
+    size_t out_offset = 0;
+    int success = 1;
+    while (out_offset < out_length && in_offset < in_length) {
+        size_t units = decode_full_units(in + in_offset, in_length - in_offset,
+                                         out + out_offset, out_length - out_offset);
+        in_offset += units * 4;
+        out_offset += units * 3;
+        if (out_offset >= out_length || in_offset >= in_length) {
+            break;
+        }
+        if (!decode_one_unit(in, in_length, &in_offset, out, out_length, &out_offset)) {
+            success = 0;
+            break;
+        }
+    }
+
+    *decoded_length = out_offset;
+    return success;
+}
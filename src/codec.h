@@ -0,0 +1,45 @@
+/*
+    codec.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_CODEC_H
+#define AULON_CODEC_H
+
+#include <stddef.h>
+
+/*
+    Picks the fastest encoder and decoder the CPU supports. Must be called
+    before any thread that encodes or decodes is started.
+*/
+void codec_init(void);
+
+/*
+    Writes the piecemeal encoding of in to out, which must have room for
+    piecemeal_encoded_length(in_length) bytes. Returns the encoded length.
+*/
+size_t piecemeal_encoded_length(size_t in_length);
+size_t encode_piecemeal_data(const unsigned char * in, size_t in_length, unsigned char * out);
+
+/*
+    Returns 1 for success and 0 for failure. *decoded_length is set to
+    the number of bytes written to out.
+*/
+int decode_transfer_units(const unsigned char * in, size_t in_length,
+                          unsigned char * out, size_t out_length, size_t * decoded_length);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+    codec_test.c
+    randomized tests and a microbenchmark for the transfer unit codec
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+
+// The bulk routines are static, so the codec is built into the test directly
+#include "codec.c"
+#include "timer.h"
+
+/*
+    Every implementation the CPU supports is run through the same random
+    inputs and must match a plain byte-at-a-time reference exactly: same
+    output, same length, same result, and nothing written past the end of
+    the output. The benchmark then times a 16 KiB block (the size of a NAND
+    block) through each one.
+
+    Run with "make codec-test" in build/linux/, or as
+    codec_test [iterations] [seed].
+*/
+struct codec_impl {
+    const char * name;
+    bulk_decoder decoder;
+    bulk_encoder encoder;
+};
+
+static const size_t GUARD_SIZE = 64;
+static const unsigned char GUARD_BYTE = 0xA5;
+static const size_t MAX_TEST_LENGTH = 20000;
+static const size_t BENCH_LENGTH = 16 * 1024;
+static const unsigned int BENCH_ROUNDS = 2000;
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static size_t rng_below(size_t limit) {
+    return (limit == 0) ? 0 : (size_t)(rng_next() % limit);
+}
+
+
+static size_t reference_encode(const unsigned char * in, size_t in_length, unsigned char * out) {
+    size_t in_offset = 0;
+    size_t out_offset = 0;
+    while (in_offset < in_length) {
+        size_t n = in_length - in_offset;
+        if (n > 3) {
+            n = 3;
+        }
+        out[out_offset++] = (unsigned char)(0x40 + n);
+        memcpy(out + out_offset, in + in_offset, n);
+        out_offset += n;
+        in_offset += n;
+    }
+    return out_offset;
+}
+
+static int reference_decode(const unsigned char * in, size_t in_length,
+                            unsigned char * out, size_t out_length, size_t * decoded_length) {
+    size_t in_offset = 0;
+    size_t out_offset = 0;
+    int success = 1;
+    while (out_offset < out_length && in_offset < in_length) {
+        unsigned char tu = in[in_offset];
+        if (tu < 0x1D || tu > 0x1F) {
+            success = 0;
+            break;
+        }
+        size_t n = tu - 0x1C;
+        if (n > in_length - in_offset - 1) {
+            n = in_length - in_offset - 1;
+        }
+        if (n > out_length - out_offset) {
+            n = out_length - out_offset;
+        }
+        memcpy(out + out_offset, in + in_offset + 1, n);
+        out_offset += n;
+        in_offset += 4;
+    }
+    *decoded_length = out_offset;
+    return success;
+}
+
+
+static size_t collect_impls(struct codec_impl * impls) {
+    size_t count = 0;
+    impls[count].name = "scalar";
+    impls[count].decoder = decode_full_units_scalar;
+    impls[count].encoder = encode_full_groups_scalar;
+    count++;
+#if defined(CODEC_HAS_SIMD)
+    if (cpu_has_ssse3()) {
+        impls[count].name = "ssse3";
+        impls[count].decoder = decode_full_units_ssse3;
+        impls[count].encoder = encode_full_groups_ssse3;
+        count++;
+    }
+    if (cpu_has_avx2()) {
+        impls[count].name = "avx2";
+        impls[count].decoder = decode_full_units_avx2;
+        impls[count].encoder = encode_full_groups_avx2;
+        count++;
+    }
+#endif
+    return count;
+}
+
+static void use_impl(const struct codec_impl * impl) {
+    decode_full_units = impl->decoder;
+    encode_full_groups = impl->encoder;
+}
+
+static int guard_intact(const unsigned char * guard) {
+    size_t i;
+    for (i = 0; i < GUARD_SIZE; ++i) {
+        if (guard[i] != GUARD_BYTE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+    Received data is mostly full units, with the odd short unit, a short
+    final unit, and occasionally a corrupt tag; the output is sometimes
+    shorter than the input holds.
+*/
+static size_t random_transfer_units(unsigned char * in, size_t max_length) {
+    size_t in_length = rng_below(max_length + 1);
+    unsigned int short_rate = 1 + (unsigned int)rng_below(200);
+    size_t i;
+    for (i = 0; i < in_length; ++i) {
+        in[i] = (unsigned char)rng_next();
+    }
+    for (i = 0; i < in_length; i += 4) {
+        unsigned char tag = FULL_UNIT;
+        if (rng_below(short_rate) == 0) {
+            tag = (unsigned char)(0x1D + rng_below(3));
+        }
+        if (rng_below(5000) == 0) {
+            tag = (unsigned char)rng_next();
+        }
+        in[i] = tag;
+    }
+    return in_length;
+}
+
+static int test_decode(const struct codec_impl * impl, unsigned char * in, unsigned char * expected, unsigned char * out) {
+    size_t in_length = random_transfer_units(in, MAX_TEST_LENGTH);
+    size_t out_length = rng_below(((in_length / 4) + 1) * 3 + 16);
+
+    size_t expected_length;
+    int expected_result = reference_decode(in, in_length, expected, out_length, &expected_length);
+
+    memset(out, GUARD_BYTE, out_length + GUARD_SIZE);
+    size_t decoded_length;
+    use_impl(impl);
+    int result = decode_transfer_units(in, in_length, out, out_length, &decoded_length);
+
+    if (result != expected_result || decoded_length != expected_length ||
+        memcmp(out, expected, decoded_length) != 0 || !guard_intact(out + out_length)) {
+        printf("%s decoder mismatch: in_length %llu, out_length %llu, result %d (expected %d), length %llu (expected %llu)\n",
+               impl->name, (unsigned long long)in_length, (unsigned long long)out_length,
+               result, expected_result, (unsigned long long)decoded_length, (unsigned long long)expected_length);
+        return 0;
+    }
+    return 1;
+}
+
+static int test_encode(const struct codec_impl * impl, unsigned char * in, unsigned char * expected, unsigned char * out) {
+    size_t in_length = rng_below(MAX_TEST_LENGTH + 1);
+    size_t i;
+    for (i = 0; i < in_length; ++i) {
+        in[i] = (unsigned char)rng_next();
+    }
+
+    size_t expected_length = reference_encode(in, in_length, expected);
+    size_t out_length = piecemeal_encoded_length(in_length);
+
+    memset(out, GUARD_BYTE, out_length + GUARD_SIZE);
+    use_impl(impl);
+    size_t encoded_length = encode_piecemeal_data(in, in_length, out);
+
+    if (encoded_length != expected_length || out_length != expected_length ||
+        memcmp(out, expected, encoded_length) != 0 || !guard_intact(out + out_length)) {
+        printf("%s encoder mismatch: in_length %llu, length %llu (expected %llu)\n",
+               impl->name, (unsigned long long)in_length,
+               (unsigned long long)encoded_length, (unsigned long long)expected_length);
+        return 0;
+    }
+    return 1;
+}
+
+
+static double megabytes_per_second(size_t bytes, uint64_t elapsed_us) {
+    if (elapsed_us == 0) {
+        elapsed_us = 1;
+    }
+    return ((double)bytes / (1024.0 * 1024.0)) / ((double)elapsed_us / 1000000.0);
+}
+
+static void benchmark(const struct codec_impl * impl, unsigned char * in, unsigned char * encoded, unsigned char * out) {
+    size_t units_length = (BENCH_LENGTH / 3 + 1) * 4;
+    size_t i;
+    for (i = 0; i < BENCH_LENGTH; ++i) {
+        in[i] = (unsigned char)rng_next();
+    }
+    for (i = 0; i < units_length; ++i) {
+        encoded[i] = (i % 4 == 0) ? FULL_UNIT : (unsigned char)rng_next();
+    }
+
+    use_impl(impl);
+    unsigned int round;
+    size_t decoded_length;
+    uint64_t start = timer_now_us();
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        decode_transfer_units(encoded, units_length, out, BENCH_LENGTH, &decoded_length);
+    }
+    uint64_t decode_us = timer_now_us() - start;
+
+    start = timer_now_us();
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        encode_piecemeal_data(in, BENCH_LENGTH, out);
+    }
+    uint64_t encode_us = timer_now_us() - start;
+
+    printf("  %-6s  decode %8.1f MB/s   encode %8.1f MB/s\n", impl->name,
+           megabytes_per_second(BENCH_LENGTH * BENCH_ROUNDS, decode_us),
+           megabytes_per_second(BENCH_LENGTH * BENCH_ROUNDS, encode_us));
+}
+
+
+int main(int argc, char * argv[]) {
+    unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : 2000;
+    rng_state = (argc > 2) ? strtoull(argv[2], NULL, 0) : (timer_now_us() | 1);
+    printf("codec test: %lu iterations, seed %llu\n", iterations, (unsigned long long)rng_state);
+
+    // The decoder reports the corrupt tags the tests feed it; results go to stdout
+#if defined(_WIN32)
+    freopen("NUL", "w", stderr);
+#else
+    freopen("/dev/null", "w", stderr);
+#endif
+
+    size_t buffer_size = ((MAX_TEST_LENGTH / 3) + 2) * 4 + GUARD_SIZE;
+    unsigned char * in = malloc(buffer_size);
+    unsigned char * expected = malloc(buffer_size);
+    unsigned char * out = malloc(buffer_size);
+    if (in == NULL || expected == NULL || out == NULL) {
+        printf("Could not allocate test buffers.\n");
+        return EXIT_FAILURE;
+    }
+
+    struct codec_impl impls[3];
+    size_t impl_count = collect_impls(impls);
+    int passed = 1;
+    size_t i;
+    for (i = 0; i < impl_count && passed; ++i) {
+        unsigned long n;
+        for (n = 0; n < iterations && passed; ++n) {
+            passed = test_decode(&impls[i], in, expected, out) && test_encode(&impls[i], in, expected, out);
+        }
+        printf("  %-6s  %s\n", impls[i].name, passed ? "ok" : "FAILED");
+    }
+
+    if (passed) {
+        printf("benchmark: %llu-byte block, %u rounds\n", (unsigned long long)BENCH_LENGTH, BENCH_ROUNDS);
+        for (i = 0; i < impl_count; ++i) {
+            benchmark(&impls[i], in, expected, out);
+        }
+    }
+
+    free(in);
+    free(expected);
+    free(out);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -23,24 +23,30 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "usb.h"
 #include "player_comms.h"
 #include "commands.h"
+#include "policy.h"
 #include "io.h"
+#include "session.h"
+#include "stats.h"
 
 
 static int command_error(unsigned char * buffer);
+static int receive_slow_reply(struct session * session, unsigned char * buffer, size_t length);
+static int retry_allowed(struct session * session, unsigned int * attempts);
 
-static int request_block_read(uint32_t command, uint32_t block_number);
-static int get_block(unsigned char * block_buffer);
-static int get_spare(unsigned char * spare_buffer);
+static int request_block_read(struct session * session, uint32_t command, uint32_t block_number);
+static int get_block(struct session * session, unsigned char * block_buffer);
+static int get_spare(struct session * session, unsigned char * spare_buffer);
 
-static int request_block_write(uint32_t command, uint32_t block_number);
-static int check_block_write(uint32_t block_number);
-static int send_block(unsigned char * block_buffer);
-static int send_spare(unsigned char * spare_buffer);
+static int request_block_write(struct session * session, uint32_t command, uint32_t block_number);
+static int check_block_write(struct session * session, uint32_t block_number);
+static int send_block(struct session * session, unsigned char * block_buffer);
+static int send_spare(struct session * session, unsigned char * spare_buffer);
 
-static int send_filename(const char * filename);
-static int send_params_and_receive_reply(uint32_t checksum, uint32_t size);
+static int send_filename(struct session * session, const char * filename);
+static int send_params_and_receive_reply(struct session * session, uint32_t checksum, uint32_t size);
 
 
 /*
@@ -52,21 +58,66 @@ static int command_error(unsigned char * buffer) {
 }
 
 
+/*
+    Replies the console has to do real work for (signing, checksumming,
+    initializing the FS, finishing a block write) are timed as their own
+    class, so they are not cut off by the timeout learned from block data.
+*/
+static int receive_slow_reply(struct session * session, unsigned char * buffer, size_t length) {
+    policy_set_transfer_class(&session->policy, POLICY_TRANSFER_SLOW_REPLY);
+    int success = ique_receive_reply(session, buffer, length);
+    policy_set_transfer_class(&session->policy, POLICY_TRANSFER_DATA);
+    return success;
+}
+
+
+/*
+    Block reads and writes are attempted up to the policy's maximum number of
+    times, backing off for longer before each retry, and give up early if the
+    stall watchdog has fired. If the connection itself was lost (e.g. the
+    console was reset), it is re-established before retrying, so a long
+    operation continues from the block that failed instead of starting over.
+*/
+static int recover_connection(struct session * session) {
+    fprintf(stderr, "The connection to the console was lost; aulon will try to reconnect and continue the operation from the failed block.\n");
+    ique_reset_protocol_state(session);
+    if (!usb_reconnect(session) || !set_seqno(session, 0x0001) || !get_num_blocks(session)) {
+        fprintf(stderr, "Could not reconnect to the console.\n");
+        return 0;
+    }
+    fprintf(stderr, "Reconnected to the console; continuing.\n");
+    return 1;
+}
+
+static int retry_allowed(struct session * session, unsigned int * attempts) {
+    if (*attempts >= policy_get_config()->max_attempts || policy_stalled(&session->policy)) {
+        return 0;
+    }
+    if (*attempts > 0) {
+        if (usb_connection_lost(session) && !recover_connection(session)) {
+            return 0;
+        }
+        policy_backoff(*attempts);
+    }
+    (*attempts)++;
+    return 1;
+}
+
+
 /*
     read_block
     One command (READ_BLOCK_ONLY) reads a block only. The other
     (READ_BLOCK_AND_SPARE) reads both the block and the spare area
     of the block's last page.
 */
-int read_block_only(unsigned char * block_buffer, uint32_t block_number) {
-    unsigned attempts = 1;
+int read_block_only(struct session * session, unsigned char * block_buffer, uint32_t block_number) {
+    unsigned int attempts = 0;
     int success = 0;
-    while(attempts <= 5) {
-        attempts++;
-        if (!request_block_read(READ_BLOCK_ONLY, block_number)) {
+    while (retry_allowed(session, &attempts)) {
+        if (!request_block_read(session, READ_BLOCK_ONLY, block_number)) {
             success = 0;
         }
-        else if (!get_block(block_buffer)) {
+        else if (!get_block(session, block_buffer)) {
             fprintf(stderr, "Reading block 0x%04x failed.\n", block_number);
             success = 0;
         }
@@ -76,24 +127,24 @@ int read_block_only(unsigned char * block_buffer, uint32_t block_number) {
         }
     }
     if (!success) {
-        fprintf(stderr, "Reading block unsuccessful after 5 retries!\n");
+        fprintf(stderr, "Reading block unsuccessful after %u attempts!\n", attempts);
     }
+    stats_record_operation(&session->stats, STATS_READ_BLOCK, attempts, success);
     return success;
 }
 
-int read_block_spare(unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number) {
-    unsigned attempts = 1;
+int read_block_spare(struct session * session, unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number) {
+    unsigned int attempts = 0;
     int success = 0;
-    while (attempts <= 5) {
-        attempts++;
-        if (!request_block_read(READ_BLOCK_AND_SPARE, block_number)) {
+    while (retry_allowed(session, &attempts)) {
+        if (!request_block_read(session, READ_BLOCK_AND_SPARE, block_number)) {
             success = 0;
         }
-        else if (!get_block(block_buffer)) {
+        else if (!get_block(session, block_buffer)) {
             fprintf(stderr, "Reading block 0x%04x failed.\n", block_number);
             success = 0;
         }
-        else if (!get_spare(spare_buffer)) {
+        else if (!get_spare(session, spare_buffer)) {
             fprintf(stderr, "Reading block 0x%04x spare failed.\n", block_number);
             success = 0;
         }
@@ -103,19 +154,20 @@ int read_block_spare(unsigned char * block_buffer, unsigned char * spare_buffer,
         }
     }
     if (!success) {
-        fprintf(stderr, "Reading block unsuccessful after 5 retries!\n");
+        fprintf(stderr, "Reading block unsuccessful after %u attempts!\n", attempts);
     }
+    stats_record_operation(&session->stats, STATS_READ_BLOCK_SPARE, attempts, success);
     return success;
 }
 
-static int request_block_read(uint32_t command, uint32_t block_number) {    
-    if (!ique_send_command(command, block_number)) {
+static int request_block_read(struct session * session, uint32_t command, uint32_t block_number) {    
+    if (!ique_send_command(session, command, block_number)) {
         fprintf(stderr, "Command to read block 0x%04x was sent, but it was not received by the console.\n", block_number);
         return 0;
     }
     
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         // fprintf(stderr, "Console response to command not received.\nAssuming the worst and aborting block read.\n");
         return 0;
     }
@@ -128,25 +180,22 @@ static int request_block_read(uint32_t command, uint32_t block_number) {
     return 1;
 }
 
-static int get_block(unsigned char * block_buffer) {
-    unsigned char chunk_buffer[BLOCK_CHUNK_SIZE] = { 0 };
+static int get_block(struct session * session, unsigned char * block_buffer) {
     unsigned int i;
     unsigned int offset = 0;
     for (i = 0; i < CHUNKS_PER_BLOCK; ++i) {
-        if (ique_receive_reply(chunk_buffer, BLOCK_CHUNK_SIZE)) {
-            memcpy(block_buffer + offset, chunk_buffer, BLOCK_CHUNK_SIZE);
-            offset += BLOCK_CHUNK_SIZE;
-        }
-        else {
+        // Each chunk is decoded directly into its place in the block
+        if (!ique_receive_reply(session, block_buffer + offset, BLOCK_CHUNK_SIZE)) {
             return 0;
         }
+        offset += BLOCK_CHUNK_SIZE;
     }
 
     return 1;
 }
 
-static int get_spare(unsigned char * spare_buffer) {
-    return ique_receive_reply(spare_buffer, SPARE_SIZE);
+static int get_spare(struct session * session, unsigned char * spare_buffer) {
+    return ique_receive_reply(session, spare_buffer, SPARE_SIZE);
 }
 
 
@@ -156,19 +205,18 @@ static int get_spare(unsigned char * spare_buffer) {
     (WRITE_BLOCK_AND_SPARE) writes both the block and the spare area
     of the block's last page.
 */
-int write_block_only(unsigned char * block_buffer, uint32_t block_number) {
-    unsigned int attempts = 1;
+int write_block_only(struct session * session, unsigned char * block_buffer, uint32_t block_number) {
+    unsigned int attempts = 0;
     int success = 0;
-    while (attempts <= 5) {
-        attempts++;
-        if (!request_block_write(WRITE_BLOCK_ONLY, block_number)) {
+    while (retry_allowed(session, &attempts)) {
+        if (!request_block_write(session, WRITE_BLOCK_ONLY, block_number)) {
             success = 0;
         }
-        else if (!send_block(block_buffer)) {
+        else if (!send_block(session, block_buffer)) {
             fprintf(stderr, "Writing block 0x%04x failed.\n", block_number);
             success = 0;
         }
-        else if (!check_block_write(block_number)) {
+        else if (!check_block_write(session, block_number)) {
             success = 0;
         }
         else {
@@ -177,33 +225,37 @@ int write_block_only(unsigned char * block_buffer, uint32_t block_number) {
         }
     }
     if (!success) {
-        fprintf(stderr, "Writing block unsuccessful after 5 retries!\n");
+        fprintf(stderr, "Writing block unsuccessful after %u attempts!\n", attempts);
     }
+    stats_record_operation(&session->stats, STATS_WRITE_BLOCK, attempts, success);
     return success;
 }
 
-int write_block_spare(unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number) {
-    if (spare_buffer[5] != 0xFF) {
+int spare_marks_bad_block(const unsigned char * spare_buffer) {
+    return spare_buffer[5] != 0xFF;
+}
+
+int write_block_spare(struct session * session, unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number) {
+    if (spare_marks_bad_block(spare_buffer)) {
         // Block is marked bad; just return normally
         return 1;
     }
     
-    unsigned attempts = 1;
+    unsigned int attempts = 0;
     int success = 0;
-    while (attempts <= 5) {
-        attempts++;
-        if (!request_block_write(WRITE_BLOCK_AND_SPARE, block_number)) {
+    while (retry_allowed(session, &attempts)) {
+        if (!request_block_write(session, WRITE_BLOCK_AND_SPARE, block_number)) {
             success = 0;
         }
-        else if (!send_block(block_buffer)) {
+        else if (!send_block(session, block_buffer)) {
             fprintf(stderr, "Writing block 0x%04x failed.\n", block_number);
             success = 0;
         }
-        else if (!send_spare(spare_buffer)) {
+        else if (!send_spare(session, spare_buffer)) {
             fprintf(stderr, "Writing block 0x%04x spare failed.\n", block_number);
             success = 0;
         }
-        else if (!check_block_write(block_number)) {
+        else if (!check_block_write(session, block_number)) {
             success = 0;
         }
         else {
@@ -212,23 +264,23 @@ int write_block_spare(unsigned char * block_buffer, unsigned char * spare_buffer
         }
     }
     if (!success) {
-        fprintf(stderr, "Writing block unsuccessful after 5 retries!\n");
+        fprintf(stderr, "Writing block unsuccessful after %u attempts!\n", attempts);
     }
+    stats_record_operation(&session->stats, STATS_WRITE_BLOCK_SPARE, attempts, success);
     return success;
 }
 
-static int request_block_write(uint32_t command, uint32_t block_number) {
-    if (!ique_send_command(command, block_number)) {
+static int request_block_write(struct session * session, uint32_t command, uint32_t block_number) {
+    if (!ique_send_command(session, command, block_number)) {
         fprintf(stderr, "Command to write block 0x%04x was sent, but it was not received by the console.\n", block_number);
         return 0;
     }
-    ique_wait_for_ready();
-    return 1;
+    return ique_wait_for_ready(session);
 }
 
-static int check_block_write(uint32_t block_number) {
+static int check_block_write(struct session * session, uint32_t block_number) {
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!receive_slow_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Error after writing block: Console did not send success state response.\n");
         return 0;
     }
@@ -241,18 +293,20 @@ static int check_block_write(uint32_t block_number) {
     return 1;
 }
 
-static int send_block(unsigned char * block_buffer) {
-    return ique_send_chunked_data(block_buffer, BLOCK_SIZE);
+static int send_block(struct session * session, unsigned char * block_buffer) {
+    return ique_send_chunked_data(session, block_buffer, BLOCK_SIZE);
 }
 
-static int send_spare(unsigned char * spare_buffer) {
-    ique_wait_for_ready();
+static int send_spare(struct session * session, unsigned char * spare_buffer) {
+    if (!ique_wait_for_ready(session)) {
+        return 0;
+    }
     // Other than the SA data (first 3 bytes), rest can all be 0xFF.
     unsigned int i;
     for (i = 3; i < SPARE_SIZE; ++i) {
         spare_buffer[i] = 0xFF;
     }
-    return ique_send_piecemeal_data(spare_buffer, SPARE_SIZE);
+    return ique_send_piecemeal_data(session, spare_buffer, SPARE_SIZE);
 }
 
 
@@ -261,14 +315,14 @@ static int send_spare(unsigned char * spare_buffer) {
     Purpose not entirely known.
     SA1 calls osBbFInit when it receives this command.
 */
-int init_fs(void) {
-    if (!ique_send_command(INIT_FS, 0x0000)) {
+int init_fs(struct session * session) {
+    if (!ique_send_command(session, INIT_FS, 0x0000)) {
         fprintf(stderr, "INIT_FS command was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!receive_slow_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to INIT_FS command not received.\n");
         return 0;
     }
@@ -287,14 +341,14 @@ int init_fs(void) {
     Returns the number of blocks in the current iQue Player NAND.
     All known cards have 0x1000 blocks.
 */
-int get_num_blocks(void) {
-    if (!ique_send_command(GET_NUM_BLOCKS, 0x0000)) {
+int get_num_blocks(struct session * session) {
+    if (!ique_send_command(session, GET_NUM_BLOCKS, 0x0000)) {
         fprintf(stderr, "GET_NUM_BLOCKS command was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to GET_NUM_BLOCKS command not received.\n");
         return 0;
     }
@@ -313,14 +367,14 @@ int get_num_blocks(void) {
     set_seqno
     Purpose unknown.
 */
-int set_seqno(uint32_t arg) {
-    if (!ique_send_command(SET_SEQNO, arg)) {
+int set_seqno(struct session * session, uint32_t arg) {
+    if (!ique_send_command(session, SET_SEQNO, arg)) {
         fprintf(stderr, "SET_SEQNO command was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to SET_SEQNO command not received.\n");
         return 0;
     }
@@ -333,14 +387,14 @@ int set_seqno(uint32_t arg) {
     get_seqno
     Purpose unknown.
 */
-int get_seqno(void) {
-    if (!ique_send_command(GET_SEQNO, 0x0000)) {
+int get_seqno(struct session * session) {
+    if (!ique_send_command(session, GET_SEQNO, 0x0000)) {
         fprintf(stderr, "GET_SEQNO command was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to GET_SEQNO command not received.\n");
         return 0;
     }
@@ -360,22 +414,24 @@ int get_seqno(void) {
     zero if the file on the console with the given filename has a matching
     checksum and size, or less-than-zero otherwise.
 */
-int file_checksum_cmp(const char * filename, uint32_t checksum, uint32_t size) {
-    return send_filename(filename) && send_params_and_receive_reply(checksum, size);
+int file_checksum_cmp(struct session * session, const char * filename, uint32_t checksum, uint32_t size) {
+    return send_filename(session, filename) && send_params_and_receive_reply(session, checksum, size);
 }
 
-static int send_filename(const char * filename) {
+static int send_filename(struct session * session, const char * filename) {
     uint32_t fn_len = strlen(filename) + 1;
     if (fn_len > 13) {
         fprintf(stderr, "The given filename is invalid; it is too long for the iQue Player FS.\n");
         return 0;
     }
     
-    if (!ique_send_command(FILE_CHKSUM, fn_len)) {
+    if (!ique_send_command(session, FILE_CHKSUM, fn_len)) {
         fprintf(stderr, "FILE_CHKSUM command was sent, but it was not received by the console.\n");
         return 0;
     }
-    ique_wait_for_ready();
+    if (!ique_wait_for_ready(session)) {
+        return 0;
+    }
     
     unsigned char * fn_data = calloc(fn_len, sizeof(unsigned char));
     if (fn_data == NULL) {
@@ -385,25 +441,24 @@ static int send_filename(const char * filename) {
     
     memcpy(fn_data, filename, fn_len - 1);
     
-    if (!ique_send_piecemeal_data(fn_data, fn_len)) {
+    if (!ique_send_piecemeal_data(session, fn_data, fn_len)) {
         fprintf(stderr, "Error sending filename to the console.\n");
         free(fn_data);
         return 0;
     }
     free(fn_data);
-    ique_wait_for_ready();
-    return 1;
+    return ique_wait_for_ready(session);
 }
 
-static int send_params_and_receive_reply(uint32_t checksum, uint32_t size) {
+static int send_params_and_receive_reply(struct session * session, uint32_t checksum, uint32_t size) {
     // Note: Not actually a command, just the same format
-    if (!ique_send_command(checksum, size)) {
+    if (!ique_send_command(session, checksum, size)) {
         fprintf(stderr, "Error sending potential checksum and file size to the console.\n");
         return 0;
     }
     
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!receive_slow_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to FILE_CHKSUM command not received.\n");
         return 0;
     }
@@ -419,14 +474,14 @@ static int send_params_and_receive_reply(uint32_t checksum, uint32_t size) {
     set_led
     Causes the LED on the front of the console to light up.
 */
-int set_led(uint32_t arg) {
-    if (!ique_send_command(SET_LED, arg)) {
+int set_led(struct session * session, uint32_t arg) {
+    if (!ique_send_command(session, SET_LED, arg)) {
         fprintf(stderr, "SET_LED command was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to SET_LED command not received.\n");
         return 0;
     }
@@ -439,14 +494,14 @@ int set_led(uint32_t arg) {
     set_time
     Sets the console's clock to the current PC time
 */
-int set_time(uint32_t first_half, unsigned char * second_half) {    
-    if (!ique_send_command(SET_TIME, first_half)) {
+int set_time(struct session * session, uint32_t first_half, unsigned char * second_half) {    
+    if (!ique_send_command(session, SET_TIME, first_half)) {
         fprintf(stderr, "SET_TIME command was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to SET_TIME command not received.\n");
         return 0;
     }
@@ -456,7 +511,7 @@ int set_time(uint32_t first_half, unsigned char * second_half) {
         return 0;
     }
 
-    if(!ique_send_piecemeal_data(second_half, 4)) {
+    if(!ique_send_piecemeal_data(session, second_half, 4)) {
         fprintf(stderr, "Error when sending time data to the console.\n");
         return 0;
     }
@@ -466,16 +521,17 @@ int set_time(uint32_t first_half, unsigned char * second_half) {
 
 /*
     get_bbid
-    Retrieves the unique id number of the console
+    Retrieves the unique id number of the console, and keeps it in the
+    session so that it needn't be asked for again on this connection
 */
-int get_bbid(uint32_t * bbid_out) {
-    if (!ique_send_command(GET_BBID, 0x0000)) {
+int get_bbid(struct session * session, uint32_t * bbid_out) {
+    if (!ique_send_command(session, GET_BBID, 0x0000)) {
         fprintf(stderr, "BBID request was sent, but it was not received by the console.\n");
         return 0;
     }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!ique_receive_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to BBID request not received.\n");
         return 0;
     }
@@ -487,6 +543,8 @@ int get_bbid(uint32_t * bbid_out) {
 
     // last 4 bytes of the 8-byte reply are the BBID
     *bbid_out = uchars_to_uint32(&reply_buffer[4]);
+    session->bbid = *bbid_out;
+    session->bbid_known = 1;
     return 1;
 }
 
@@ -497,17 +555,19 @@ int get_bbid(uint32_t * bbid_out) {
     the hash. hash_in assumes a 20-byte SHA1 hash, and sig_out assumes a 64-byte
     ECC signature.
 */
-int sign_hash(unsigned char * hash_in, unsigned char * sig_out) {
-    if (!ique_send_command(SIGN_HASH, SHA1_HASH_LENGTH)) {
+int sign_hash(struct session * session, unsigned char * hash_in, unsigned char * sig_out) {
+    if (!ique_send_command(session, SIGN_HASH, SHA1_HASH_LENGTH)) {
         fprintf(stderr, "Request to sign hash was sent, but it was not received by the console.\n");
         return 0;
     }
 
-    ique_wait_for_ready();
-    ique_send_chunked_data(hash_in, SHA1_HASH_LENGTH);
+    if (!ique_wait_for_ready(session) || !ique_send_chunked_data(session, hash_in, SHA1_HASH_LENGTH)) {
+        fprintf(stderr, "Hash could not be sent to the console.\n");
+        return 0;
+    }
 
     unsigned char reply_buffer[8] = { 0 };
-    if (!ique_receive_reply(reply_buffer, 8)) {
+    if (!receive_slow_reply(session, reply_buffer, 8)) {
         fprintf(stderr, "Console response to sign_hash request not received.\n");
         return 0;
     }
@@ -517,7 +577,7 @@ int sign_hash(unsigned char * hash_in, unsigned char * sig_out) {
         return 0;
     }
 
-    if (!ique_receive_reply(sig_out, ECC_SIG_LENGTH)) {
+    if (!receive_slow_reply(session, sig_out, ECC_SIG_LENGTH)) {
         fprintf(stderr, "ECC signature not received.\n");
         return 0;
     }
@@ -22,6 +22,8 @@
 
 #include <stdint.h>
 
+struct session;
+
 // USB command numbers
 enum {
     WRITE_BLOCK_ONLY        = 0x06,
@@ -53,18 +55,20 @@ enum {
     ECC_SIG_LENGTH   = 0x40
 };
 
-int write_block_only(unsigned char * block_buffer, uint32_t block_number);
-int read_block_only(unsigned char * block_buffer, uint32_t block_number);
-int write_block_spare(unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number);
-int read_block_spare(unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number);
-int init_fs(void);
-int get_num_blocks(void);
-int set_seqno(uint32_t arg);
-int get_seqno(void);
-int file_checksum_cmp(const char * filename, uint32_t checksum, uint32_t size);
-int set_led(uint32_t arg);
-int set_time(uint32_t first_half, unsigned char * second_half);
-int get_bbid(uint32_t * bbid_out);
-int sign_hash(unsigned char * hash_in, unsigned char * sig_out);
+int write_block_only(struct session * session, unsigned char * block_buffer, uint32_t block_number);
+int read_block_only(struct session * session, unsigned char * block_buffer, uint32_t block_number);
+// Blocks whose spare data marks them bad are skipped (and reported as written) by write_block_spare
+int spare_marks_bad_block(const unsigned char * spare_buffer);
+int write_block_spare(struct session * session, unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number);
+int read_block_spare(struct session * session, unsigned char * block_buffer, unsigned char * spare_buffer, uint32_t block_number);
+int init_fs(struct session * session);
+int get_num_blocks(struct session * session);
+int set_seqno(struct session * session, uint32_t arg);
+int get_seqno(struct session * session);
+int file_checksum_cmp(struct session * session, const char * filename, uint32_t checksum, uint32_t size);
+int set_led(struct session * session, uint32_t arg);
+int set_time(struct session * session, uint32_t first_half, unsigned char * second_half);
+int get_bbid(struct session * session, uint32_t * bbid_out);
+int sign_hash(struct session * session, unsigned char * hash_in, unsigned char * sig_out);
 
 #endif
@@ -0,0 +1,124 @@
+/*
+    console_hashes.c
+    the last known contents of each console's NAND, as block hashes
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "commands.h"
+#include "console_hashes.h"
+
+#define CONSOLE_HASHES_HEADER "aulon console hashes 1\n"
+
+struct console_hashes {
+    char path[FILENAME_MAX];
+    unsigned char known[NUM_BLOCKS];
+    struct block_hashes hashes[NUM_BLOCKS];
+};
+
+
+struct console_hashes * console_hashes_load(const char * path) {
+    struct console_hashes * console = calloc(1, sizeof(struct console_hashes));
+    if (console == NULL) {
+        fprintf(stderr, "Could not allocate memory for the console's block hashes.\n");
+        return NULL;
+    }
+    if (strlen(path) >= sizeof(console->path)) {
+        fprintf(stderr, "ERROR: Filename is too long. Opening file aborted.\n");
+        free(console);
+        return NULL;
+    }
+    strcpy(console->path, path);
+
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        return console;
+    }
+    char line[80];
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, CONSOLE_HASHES_HEADER) != 0) {
+        fprintf(stderr, "%s is not a list of block hashes; ignoring it.\n", path);
+    }
+    else {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            uint32_t block_number;
+            struct block_hashes hashes;
+            if (hash_parse_block_line(line, &block_number, &hashes)) {
+                console_hashes_set(console, block_number, &hashes);
+            }
+        }
+    }
+    fclose(file);
+    return console;
+}
+
+const struct block_hashes * console_hashes_get(const struct console_hashes * console, uint32_t block_number) {
+    return console->known[block_number] ? &console->hashes[block_number] : NULL;
+}
+
+int console_hashes_match(const struct console_hashes * console, uint32_t block_number, const struct block_hashes * hashes) {
+    return console->known[block_number] && hash_blocks_equal(&console->hashes[block_number], hashes);
+}
+
+void console_hashes_set(struct console_hashes * console, uint32_t block_number, const struct block_hashes * hashes) {
+    console->known[block_number] = 1;
+    console->hashes[block_number] = *hashes;
+}
+
+void console_hashes_forget(struct console_hashes * console, uint32_t block_number) {
+    console->known[block_number] = 0;
+}
+
+int console_hashes_empty(const struct console_hashes * console) {
+    uint32_t blk_no;
+    for (blk_no = 0; blk_no < NUM_BLOCKS; ++blk_no) {
+        if (console->known[blk_no]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    The whole file is rewritten, listing only the known blocks.
+*/
+int console_hashes_save(const struct console_hashes * console) {
+    FILE * file = fopen(console->path, "w");
+    if (file == NULL) {
+        perror("Error saving the console's block hashes");
+        return 0;
+    }
+    int success = fputs(CONSOLE_HASHES_HEADER, file) != EOF;
+    uint32_t blk_no;
+    for (blk_no = 0; blk_no < NUM_BLOCKS && success; ++blk_no) {
+        if (console->known[blk_no]) {
+            success = hash_write_block_line(file, blk_no, &console->hashes[blk_no]);
+        }
+    }
+    success = fclose(file) == 0 && success;
+    if (!success) {
+        fprintf(stderr, "Error saving the console's block hashes to %s.\n", console->path);
+    }
+    return success;
+}
+
+void console_hashes_free(struct console_hashes * console) {
+    free(console);
+}
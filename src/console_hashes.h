@@ -0,0 +1,53 @@
+/*
+    console_hashes.h
+    the last known contents of each console's NAND, as block hashes
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_CONSOLE_HASHES_H
+#define AULON_CONSOLE_HASHES_H
+
+#include <stdint.h>
+
+#include "hash.h"
+
+/*
+    What one console's NAND is known to hold, as the hashes of each block
+    and its spare data, kept in a file named after its BBID and updated by
+    every dump from it, every differential write to it, and every other
+    write once anything is known about it. A differential write can then
+    skip the blocks that already hold what it would write. Blocks that
+    weren't dumped or written (or whose write failed) are unknown, and are
+    never skipped.
+
+    console_hashes_load returns NULL on failure; a missing file just means
+    nothing is known yet. console_hashes_get returns NULL for an unknown
+    block. console_hashes_empty returns 1 if no block is known.
+    console_hashes_save returns 1 for success and 0 for failure.
+*/
+struct console_hashes;
+
+struct console_hashes * console_hashes_load(const char * path);
+const struct block_hashes * console_hashes_get(const struct console_hashes * console, uint32_t block_number);
+int console_hashes_match(const struct console_hashes * console, uint32_t block_number, const struct block_hashes * hashes);
+void console_hashes_set(struct console_hashes * console, uint32_t block_number, const struct block_hashes * hashes);
+void console_hashes_forget(struct console_hashes * console, uint32_t block_number);
+int console_hashes_empty(const struct console_hashes * console);
+int console_hashes_save(const struct console_hashes * console);
+void console_hashes_free(struct console_hashes * console);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+    dump_journal.c
+    checkpoints of the blocks a NAND dump has completed
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "commands.h"
+#include "hash.h"
+#include "dump_journal.h"
+
+#define DUMP_JOURNAL_HEADER "aulon dump journal 1\n"
+
+struct journal_entry {
+    int recorded;
+    struct block_hashes hashes;
+};
+
+/*
+    entries holds what was loaded from an earlier run; blocks recorded in
+    this one are only appended to the file.
+*/
+struct dump_journal {
+    FILE * file;
+    char path[FILENAME_MAX];
+    struct journal_entry entries[NUM_BLOCKS];
+};
+
+
+/*
+    Load the entries of an existing journal. A line cut short by an
+    interruption, or anything else that doesn't parse, is ignored; that
+    block is simply read again. Returns 0 if there is no usable journal.
+*/
+static int load_entries(struct dump_journal * journal) {
+    FILE * file = fopen(journal->path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[80];
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, DUMP_JOURNAL_HEADER) != 0) {
+        fprintf(stderr, "%s is not a dump journal; starting a new one.\n", journal->path);
+        fclose(file);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        uint32_t block_number;
+        struct block_hashes hashes;
+        if (hash_parse_block_line(line, &block_number, &hashes)) {
+            journal->entries[block_number].recorded = 1;
+            journal->entries[block_number].hashes = hashes;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+struct dump_journal * dump_journal_open(const char * path, int resume) {
+    struct dump_journal * journal = calloc(1, sizeof(struct dump_journal));
+    if (journal == NULL) {
+        fprintf(stderr, "Could not allocate memory for the dump journal.\n");
+        return NULL;
+    }
+    if (strlen(path) >= sizeof(journal->path)) {
+        fprintf(stderr, "ERROR: Filename is too long. Opening file aborted.\n");
+        free(journal);
+        return NULL;
+    }
+    strcpy(journal->path, path);
+
+    int appending = resume && load_entries(journal);
+    journal->file = fopen(path, appending ? "a" : "w");
+    if (journal->file == NULL) {
+        perror("Error opening the dump journal");
+        free(journal);
+        return NULL;
+    }
+    if (!appending && (fputs(DUMP_JOURNAL_HEADER, journal->file) == EOF || fflush(journal->file) != 0)) {
+        fprintf(stderr, "Error writing the dump journal.\n");
+        fclose(journal->file);
+        free(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+/*
+    Whether a block was read by an earlier run, and is still intact in the
+    image, so that it needn't be read again.
+*/
+int dump_journal_block_done(struct dump_journal * journal, struct nand_image * image, uint32_t block_number) {
+    const struct journal_entry * entry = &journal->entries[block_number];
+    if (!entry->recorded) {
+        return 0;
+    }
+    unsigned char block[BLOCK_SIZE];
+    unsigned char spare[SPARE_SIZE];
+    if (!nand_image_load(image, block_number, block, spare)) {
+        return 0;
+    }
+    struct block_hashes hashes;
+    hash_block_and_spare(block, spare, &hashes);
+    return hash_blocks_equal(&hashes, &entry->hashes);
+}
+
+int dump_journal_record(struct dump_journal * journal, uint32_t block_number,
+                        const unsigned char * block, const unsigned char * spare) {
+    struct block_hashes hashes;
+    hash_block_and_spare(block, spare, &hashes);
+    if (!hash_write_block_line(journal->file, block_number, &hashes) || fflush(journal->file) != 0) {
+        fprintf(stderr, "Error writing the dump journal.\n");
+        return 0;
+    }
+    return 1;
+}
+
+int dump_journal_close(struct dump_journal * journal, int remove_file) {
+    if (journal == NULL) {
+        return 1;
+    }
+    int success = fclose(journal->file) == 0;
+    if (success && remove_file && remove(journal->path) != 0) {
+        perror("Error removing the dump journal");
+        success = 0;
+    }
+    free(journal);
+    return success;
+}
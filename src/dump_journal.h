@@ -0,0 +1,50 @@
+/*
+    dump_journal.h
+    checkpoints of the blocks a NAND dump has completed
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_DUMP_JOURNAL_H
+#define AULON_DUMP_JOURNAL_H
+
+#include <stdint.h>
+
+#include "nand_image.h"
+
+/*
+    A text file kept next to a dump while it runs, with a line for each
+    block once it has been read: its number and the XXH64 hashes of its
+    block and spare data. Each line is flushed as it is written, so a dump
+    that is interrupted, or fails, can be resumed later: a block counts as
+    done only if it is in the journal and the image still holds exactly
+    what was read.
+
+    dump_journal_open starts a new, empty journal, or with resume set loads
+    an existing one (if there is one) and appends to it. It returns NULL on
+    failure. dump_journal_close removes the journal's file if remove_file
+    is set, e.g. once the dump is complete; it and dump_journal_record
+    return 1 for success and 0 for failure.
+*/
+struct dump_journal;
+
+struct dump_journal * dump_journal_open(const char * path, int resume);
+int dump_journal_block_done(struct dump_journal * journal, struct nand_image * image, uint32_t block_number);
+int dump_journal_record(struct dump_journal * journal, uint32_t block_number,
+                        const unsigned char * block, const unsigned char * spare);
+int dump_journal_close(struct dump_journal * journal, int remove_file);
+
+#endif
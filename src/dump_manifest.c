@@ -0,0 +1,148 @@
+/*
+    dump_manifest.c
+    hashes of every block of a NAND dump, written alongside it
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "dump_manifest.h"
+
+#define DUMP_MANIFEST_HEADER "aulon dump manifest 1\n"
+
+/*
+    next is the first block not hashed yet. The image-wide digests are
+    built up in block order as it advances.
+*/
+struct dump_manifest {
+    struct nand_image * image;
+    uint32_t next;
+    struct sha1_context nand_context;
+    struct sha1_context spare_context;
+    unsigned char skipped[NUM_BLOCKS];
+    struct block_hashes hashes[NUM_BLOCKS];
+    unsigned char block_sha1[NUM_BLOCKS][SHA1_HASH_LENGTH];
+    unsigned char nand_sha1[SHA1_HASH_LENGTH];
+    unsigned char spare_sha1[SHA1_HASH_LENGTH];
+    unsigned char block[BLOCK_SIZE];  // for blocks hashed from the image
+    unsigned char spare[SPARE_SIZE];
+};
+
+
+struct dump_manifest * dump_manifest_create(struct nand_image * image) {
+    struct dump_manifest * manifest = calloc(1, sizeof(struct dump_manifest));
+    if (manifest == NULL) {
+        fprintf(stderr, "Could not allocate memory for the dump manifest.\n");
+        return NULL;
+    }
+    manifest->image = image;
+    hash_sha1_init(&manifest->nand_context);
+    hash_sha1_init(&manifest->spare_context);
+    return manifest;
+}
+
+static void hash_next_block(struct dump_manifest * manifest, const unsigned char * block, const unsigned char * spare) {
+    uint32_t blk_no = manifest->next++;
+    hash_block_and_spare(block, spare, &manifest->hashes[blk_no]);
+
+    struct sha1_context block_context;
+    hash_sha1_init(&block_context);
+    hash_sha1_update(&block_context, block, BLOCK_SIZE);
+    hash_sha1_final(&block_context, manifest->block_sha1[blk_no]);
+
+    hash_sha1_update(&manifest->nand_context, block, BLOCK_SIZE);
+    hash_sha1_update(&manifest->spare_context, spare, SPARE_SIZE);
+}
+
+static int hash_blocks_from_image(struct dump_manifest * manifest, uint32_t end) {
+    while (manifest->next < end) {
+        if (!nand_image_load(manifest->image, manifest->next, manifest->block, manifest->spare)) {
+            return 0;
+        }
+        hash_next_block(manifest, manifest->block, manifest->spare);
+    }
+    return 1;
+}
+
+int dump_manifest_add(struct dump_manifest * manifest, uint32_t block_number,
+                      const unsigned char * block, const unsigned char * spare) {
+    if (!hash_blocks_from_image(manifest, block_number)) {
+        return 0;
+    }
+    hash_next_block(manifest, block, spare);
+    return 1;
+}
+
+void dump_manifest_skip(struct dump_manifest * manifest, uint32_t block_number) {
+    manifest->skipped[block_number] = 1;
+}
+
+int dump_manifest_finish(struct dump_manifest * manifest) {
+    if (!hash_blocks_from_image(manifest, NUM_BLOCKS)) {
+        return 0;
+    }
+    hash_sha1_final(&manifest->nand_context, manifest->nand_sha1);
+    hash_sha1_final(&manifest->spare_context, manifest->spare_sha1);
+    return 1;
+}
+
+const struct block_hashes * dump_manifest_block_hashes(const struct dump_manifest * manifest, uint32_t block_number) {
+    return manifest->skipped[block_number] ? NULL : &manifest->hashes[block_number];
+}
+
+static int write_sha1(FILE * file, const unsigned char * digest) {
+    int i;
+    for (i = 0; i < SHA1_HASH_LENGTH; ++i) {
+        if (fprintf(file, "%02x", digest[i]) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int dump_manifest_save(const struct dump_manifest * manifest, const char * path) {
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Error creating the dump manifest");
+        return 0;
+    }
+    int success = fputs(DUMP_MANIFEST_HEADER, file) != EOF &&
+                  fputs("nand.bin ", file) != EOF && write_sha1(file, manifest->nand_sha1) && fputc('\n', file) != EOF &&
+                  fputs("spare.bin ", file) != EOF && write_sha1(file, manifest->spare_sha1) && fputc('\n', file) != EOF;
+    uint32_t blk_no;
+    for (blk_no = 0; blk_no < NUM_BLOCKS && success; ++blk_no) {
+        const struct block_hashes * hashes = &manifest->hashes[blk_no];
+        if (manifest->skipped[blk_no]) {
+            success = fprintf(file, "%04x skipped\n", (unsigned int)blk_no) >= 0;
+            continue;
+        }
+        success = fprintf(file, "%04x %016llx %016llx ", (unsigned int)blk_no,
+                          (unsigned long long)hashes->block, (unsigned long long)hashes->spare) >= 0 &&
+                  write_sha1(file, manifest->block_sha1[blk_no]) && fputc('\n', file) != EOF;
+    }
+    success = fclose(file) == 0 && success;
+    if (!success) {
+        fprintf(stderr, "Error writing the dump manifest to %s.\n", path);
+    }
+    return success;
+}
+
+void dump_manifest_free(struct dump_manifest * manifest) {
+    free(manifest);
+}
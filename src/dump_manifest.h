@@ -0,0 +1,64 @@
+/*
+    dump_manifest.h
+    hashes of every block of a NAND dump, written alongside it
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_DUMP_MANIFEST_H
+#define AULON_DUMP_MANIFEST_H
+
+#include <stdint.h>
+
+#include "commands.h"
+#include "hash.h"
+#include "nand_image.h"
+
+/*
+    A text file written next to a complete dump (nand.manifest), so dumps
+    can be compared, deduplicated and verified without reading whole
+    images: the SHA-1 of nand.bin and of spare.bin, then a line for each
+    block with its number, the XXH64 hashes of its block and spare data,
+    and the SHA-1 of its block data. Blocks a sparse dump left out are
+    listed as skipped instead.
+
+    Blocks are hashed as they are read, by dump_manifest_add, from a
+    consumer thread of the dump's block stream. They must be added in
+    ascending order, but may skip blocks that are already in the image
+    (as when a dump is resumed): those are hashed from the image, as are
+    any left over when dump_manifest_finish is called after the last
+    block.
+
+    Blocks are marked skipped before the dump starts, and are hashed as
+    the zeros the image holds for them, but have no hashes of their own:
+    dump_manifest_block_hashes returns NULL for them.
+
+    dump_manifest_create returns NULL on failure; dump_manifest_add,
+    dump_manifest_finish and dump_manifest_save return 1 for success and 0
+    for failure (the first two fail only if the image can't be read).
+*/
+struct dump_manifest;
+
+struct dump_manifest * dump_manifest_create(struct nand_image * image);
+int dump_manifest_add(struct dump_manifest * manifest, uint32_t block_number,
+                      const unsigned char * block, const unsigned char * spare);
+void dump_manifest_skip(struct dump_manifest * manifest, uint32_t block_number);
+int dump_manifest_finish(struct dump_manifest * manifest);
+const struct block_hashes * dump_manifest_block_hashes(const struct dump_manifest * manifest, uint32_t block_number);
+int dump_manifest_save(const struct dump_manifest * manifest, const char * path);
+void dump_manifest_free(struct dump_manifest * manifest);
+
+#endif
@@ -0,0 +1,731 @@
+/*
+    emulator.c
+    a software console backed by a NAND image
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "commands.h"
+#include "emulator.h"
+#include "fs.h"
+#include "io.h"
+#include "timer.h"
+#include "transport.h"
+
+#define NAND_FILENAME   "nand.bin"
+#define SPARE_FILENAME  "spare.bin"
+#define NAND_SIZE       ((size_t)NUM_BLOCKS * BLOCK_SIZE)
+#define SPARES_SIZE     ((size_t)NUM_BLOCKS * SPARE_SIZE)
+#define MAX_FILENAME    13
+#define MAX_MESSAGES    16
+#define OUTPUT_SIZE     0x8000  // more than the replies to a block and spare read
+#define REPLY_SIZE      8
+#define FS_BLOCKS_START 0xFF0
+
+static const unsigned char READY_SIGNAL[4] = { 0x15, 0, 0, 0 };
+static const unsigned char LENGTH_SIGNAL = 0x1B;
+static const unsigned char ACK_SIGNAL = 0x44;
+static const unsigned char SEND_CHUNK_SIGNAL = 0x63;
+
+/*
+    What the console is waiting to receive from the host. Commands and
+    their small parameters arrive in the piecemeal format, blocks and
+    hashes in the chunked format (see player_comms.c).
+*/
+enum emulator_input {
+    INPUT_COMMAND,
+    INPUT_BLOCK,
+    INPUT_SPARE,
+    INPUT_FILENAME,
+    INPUT_CHECKSUM_PARAMS,
+    INPUT_TIME,
+    INPUT_HASH
+};
+
+/*
+    Replies are queued as messages (a length header, then the encoded data),
+    each of which the host reads separately. An empty queue is read as a
+    READY signal, as the console is then waiting on the host.
+*/
+struct emulator {
+    char nand_path[FILENAME_MAX];
+    char spare_path[FILENAME_MAX];
+    unsigned char * nand;
+    unsigned char * spare;
+    int modified;
+
+    enum emulator_input input;
+    int chunked;                    // the input is in the chunked format rather than piecemeal
+    uint32_t input_expected;
+    uint32_t input_received;
+    uint32_t unit_remaining;        // data bytes left in the current unit or chunk
+    int chunk_length_next;          // the last byte was a chunk tag, so the next is its length
+    int desynchronized;             // a protocol error has been reported since the last command
+    uint32_t command;
+    uint32_t argument;
+    unsigned char input_buffer[BLOCK_SIZE];
+    unsigned char pending_block[BLOCK_SIZE];
+    char filename[MAX_FILENAME];
+    uint32_t seqno;
+
+    unsigned char output[OUTPUT_SIZE];
+    uint32_t output_length;
+    uint32_t message_ends[MAX_MESSAGES];
+    unsigned int message_count;
+    unsigned int message_next;
+    uint32_t read_offset;           // how much of the output the host has read
+    int zlp_pending;
+
+    unsigned long in_transfers;
+};
+
+static char * emulator_directory = NULL;
+
+static struct emulator_config config = {
+    0,      // latency_us
+    0,      // bandwidth_kib
+    0x80,   // packet_size
+    0,      // timeout_every
+    0,      // stall_every
+    0,      // short_every
+    0x1234  // bbid
+};
+
+
+void emulator_set_directory(char * directory) {
+    emulator_directory = directory;
+}
+
+const char * emulator_get_directory(void) {
+    return emulator_directory;
+}
+
+
+/*
+    Configuration
+    Parsed the same way as the transfer policy, e.g.
+    "latency=500,bandwidth=1024,timeout_every=100".
+*/
+static int set_config_value(const char * key, unsigned long value) {
+    static const struct {
+        const char * key;
+        unsigned int * value;
+    } keys[] = {
+        { "latency",       &config.latency_us    },
+        { "bandwidth",     &config.bandwidth_kib },
+        { "packet",        &config.packet_size   },
+        { "timeout_every", &config.timeout_every },
+        { "stall_every",   &config.stall_every   },
+        { "short_every",   &config.short_every   },
+        { "bbid",          &config.bbid          }
+    };
+    size_t i;
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        if (strcmp(key, keys[i].key) == 0) {
+            *keys[i].value = (unsigned int)value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int emulator_parse_options(const char * spec) {
+    char buffer[256] = { 0 };
+    if (strlen(spec) >= sizeof(buffer)) {
+        fprintf(stderr, "Emulator options are too long.\n");
+        return 0;
+    }
+    strcpy(buffer, spec);
+
+    char * pair = strtok(buffer, ",");
+    while (pair) {
+        char * equals = strchr(pair, '=');
+        if (equals == NULL) {
+            fprintf(stderr, "Invalid emulator option: %s\n", pair);
+            return 0;
+        }
+        *equals = '\0';
+        if (!set_config_value(pair, strtoul(equals + 1, NULL, 0))) {
+            fprintf(stderr, "Unknown emulator option: %s\n", pair);
+            return 0;
+        }
+        pair = strtok(NULL, ",");
+    }
+
+    if (config.packet_size == 0 || config.packet_size % 4 != 0) {
+        fprintf(stderr, "Invalid emulator options: the packet size must be a nonzero multiple of 4.\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+    Simple utility functions
+*/
+static void uint32_to_uchars(uint32_t value, unsigned char * bytes) {
+    bytes[0] = (value >> 24) & 0xFF;
+    bytes[1] = (value >> 16) & 0xFF;
+    bytes[2] = (value >>  8) & 0xFF;
+    bytes[3] = value & 0xFF;
+}
+
+/*
+    Sleeping is only accurate to a millisecond or so, so the last of the
+    delay is spun away.
+*/
+static void simulate_transfer_time(uint32_t length) {
+    uint64_t delay_us = config.latency_us;
+    if (config.bandwidth_kib) {
+        delay_us += ((uint64_t)length * 1000000) / ((uint64_t)config.bandwidth_kib * 1024);
+    }
+    if (delay_us == 0) {
+        return;
+    }
+
+    uint64_t end_time = timer_now_us() + delay_us;
+    if (delay_us > 2000) {
+        timer_sleep_ms((unsigned int)(delay_us / 1000) - 1);
+    }
+    while (timer_now_us() < end_time) {
+        // spin
+    }
+}
+
+
+/*
+    The NAND image
+    Both files are read into memory whole, and written back on close only
+    if a block was written.
+*/
+static unsigned char * load_image(const char * path, size_t size) {
+    FILE * file = NULL;
+    if (!open_file(&file, path, "rb")) {
+        return NULL;
+    }
+    if (!file_size_check(file, size)) {
+        fprintf(stderr, "%s is not 0x%zx bytes.\n", path, size);
+        fclose(file);
+        return NULL;
+    }
+    rewind(file);
+
+    unsigned char * image = malloc(size);
+    if (image == NULL) {
+        fprintf(stderr, "Could not allocate memory to load %s.\n", path);
+    }
+    else if (fread(image, 1, size, file) != size) {
+        fprintf(stderr, "Could not read %s.\n", path);
+        free(image);
+        image = NULL;
+    }
+    fclose(file);
+    return image;
+}
+
+static int save_image(const char * path, const unsigned char * image, size_t size) {
+    FILE * file = NULL;
+    if (!open_file(&file, path, "wb")) {
+        return 0;
+    }
+    int success = (fwrite(image, 1, size, file) == size);
+    if (fclose(file) != 0 || !success) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+static struct emulator * emulator_open(const char * directory) {
+    struct emulator * emulator = calloc(1, sizeof(struct emulator));
+    if (emulator == NULL) {
+        fprintf(stderr, "Could not allocate memory for the emulator.\n");
+        return NULL;
+    }
+
+    snprintf(emulator->nand_path, sizeof(emulator->nand_path), "%s/%s", directory, NAND_FILENAME);
+    snprintf(emulator->spare_path, sizeof(emulator->spare_path), "%s/%s", directory, SPARE_FILENAME);
+    emulator->nand = load_image(emulator->nand_path, NAND_SIZE);
+    emulator->spare = emulator->nand ? load_image(emulator->spare_path, SPARES_SIZE) : NULL;
+    if (emulator->spare == NULL) {
+        free(emulator->nand);
+        free(emulator);
+        return NULL;
+    }
+
+    emulator->input = INPUT_COMMAND;
+    emulator->input_expected = REPLY_SIZE;
+    return emulator;
+}
+
+static void emulator_close(struct emulator * emulator) {
+    if (emulator->modified) {
+        save_image(emulator->nand_path, emulator->nand, NAND_SIZE);
+        save_image(emulator->spare_path, emulator->spare, SPARES_SIZE);
+    }
+    free(emulator->nand);
+    free(emulator->spare);
+    free(emulator);
+}
+
+
+/*
+    Replies
+*/
+static void clear_replies(struct emulator * emulator) {
+    emulator->output_length = 0;
+    emulator->message_count = 0;
+    emulator->message_next = 0;
+    emulator->read_offset = 0;
+    emulator->zlp_pending = 0;
+}
+
+static void end_message(struct emulator * emulator) {
+    emulator->message_ends[emulator->message_count++] = emulator->output_length;
+}
+
+/*
+    The length header, then the data in 0x1C + n transfer units, the last
+    one padded out to 4 bytes.
+*/
+static void queue_reply(struct emulator * emulator, const unsigned char * data, uint32_t length) {
+    uint32_t encoded_length = ((length + 2) / 3) * 4;
+    if (emulator->message_count + 2 > MAX_MESSAGES || emulator->output_length + 4 + encoded_length > OUTPUT_SIZE) {
+        fprintf(stderr, "Emulator: too many replies queued; dropping a reply of %u bytes.\n", length);
+        return;
+    }
+
+    unsigned char * out = emulator->output + emulator->output_length;
+    uint32_to_uchars(length, out);
+    out[0] = LENGTH_SIGNAL;
+    emulator->output_length += 4;
+    end_message(emulator);
+
+    out = emulator->output + emulator->output_length;
+    uint32_t offset;
+    for (offset = 0; offset < length; offset += 3) {
+        uint32_t unit_length = (length - offset >= 3) ? 3 : (length - offset);
+        memset(out, 0, 4);
+        out[0] = (unsigned char)(0x1C + unit_length);
+        memcpy(out + 1, data + offset, unit_length);
+        out += 4;
+    }
+    emulator->output_length += encoded_length;
+    end_message(emulator);
+}
+
+static void queue_command_reply(struct emulator * emulator, uint32_t result) {
+    unsigned char reply[REPLY_SIZE];
+    uint32_to_uchars(emulator->command, reply);
+    uint32_to_uchars(result, reply + 4);
+    queue_reply(emulator, reply, REPLY_SIZE);
+}
+
+
+/*
+    Commands
+*/
+static void expect_input(struct emulator * emulator, enum emulator_input input, uint32_t length, int chunked) {
+    emulator->input = input;
+    emulator->input_expected = length;
+    emulator->input_received = 0;
+    emulator->chunked = chunked;
+}
+
+static void expect_command(struct emulator * emulator) {
+    expect_input(emulator, INPUT_COMMAND, REPLY_SIZE, 0);
+}
+
+static int block_number_valid(uint32_t block_number) {
+    return block_number < NUM_BLOCKS;
+}
+
+static void read_block(struct emulator * emulator, int with_spare) {
+    uint32_t block_number = emulator->argument;
+    if (!block_number_valid(block_number)) {
+        queue_command_reply(emulator, (uint32_t)-1);
+        return;
+    }
+
+    queue_command_reply(emulator, 0);
+    const unsigned char * block = emulator->nand + ((size_t)block_number * BLOCK_SIZE);
+    unsigned int i;
+    for (i = 0; i < CHUNKS_PER_BLOCK; ++i) {
+        queue_reply(emulator, block + (i * BLOCK_CHUNK_SIZE), BLOCK_CHUNK_SIZE);
+    }
+    if (with_spare) {
+        queue_reply(emulator, emulator->spare + ((size_t)block_number * SPARE_SIZE), SPARE_SIZE);
+    }
+}
+
+static void write_block(struct emulator * emulator, const unsigned char * spare) {
+    uint32_t block_number = emulator->argument;
+    memcpy(emulator->nand + ((size_t)block_number * BLOCK_SIZE), emulator->pending_block, BLOCK_SIZE);
+    if (spare) {
+        memcpy(emulator->spare + ((size_t)block_number * SPARE_SIZE), spare, SPARE_SIZE);
+    }
+    emulator->modified = 1;
+    queue_command_reply(emulator, 0);
+}
+
+/*
+    The current FS block is the one of 0xFF0-0xFFF with the highest
+    sequence number, as get_current_fs finds it.
+*/
+static unsigned char * current_fs_block(struct emulator * emulator) {
+    unsigned char * current = NULL;
+    uint32_t current_seqno = 0;
+    uint32_t i;
+    for (i = FS_BLOCKS_START; i < NUM_BLOCKS; ++i) {
+        unsigned char * block = emulator->nand + ((size_t)i * BLOCK_SIZE);
+        uint32_t seqno = uchars_to_uint32(&block[0x3FF8]);
+        if (seqno > current_seqno) {
+            current = block;
+            current_seqno = seqno;
+        }
+    }
+    return current;
+}
+
+/*
+    The checksum is the sum of the file's bytes, calculated the same way as
+    when fs.c writes a file; the size must match the file's entry exactly.
+*/
+static int file_matches(struct emulator * emulator, uint32_t checksum, uint32_t size) {
+    unsigned char * fs = current_fs_block(emulator);
+    size_t index = fs ? find_file(fs, emulator->filename) : 0;
+    if (index == 0 || uchars_to_uint32(&fs[index + 0x10]) != size) {
+        return 0;
+    }
+
+    uint32_t sum = 0;
+    uint32_t remaining = size;
+    int16_t block_number = uchars_to_int16(&fs[index + 0xC]);
+    while (remaining) {
+        if (block_number < 0 || block_number >= NUM_BLOCKS) {
+            return 0;
+        }
+        const unsigned char * block = emulator->nand + ((size_t)block_number * BLOCK_SIZE);
+        uint32_t length = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
+        uint32_t i;
+        for (i = 0; i < length; ++i) {
+            sum += block[i];
+        }
+        remaining -= length;
+        block_number = uchars_to_int16(&fs[block_number * 2]);
+    }
+    return sum == checksum;
+}
+
+/*
+    A 64-byte stand-in for the console's ECC signature, derived from the
+    hash so that different hashes get different signatures.
+*/
+static void sign_emulated_hash(struct emulator * emulator, const unsigned char * hash) {
+    unsigned char signature[ECC_SIG_LENGTH];
+    unsigned int i;
+    for (i = 0; i < ECC_SIG_LENGTH; ++i) {
+        signature[i] = hash[i % SHA1_HASH_LENGTH] ^ (unsigned char)(i * 0x3B);
+    }
+    queue_command_reply(emulator, 0);
+    queue_reply(emulator, signature, ECC_SIG_LENGTH);
+}
+
+static void run_command(struct emulator * emulator) {
+    uint32_t argument = emulator->argument;
+    expect_command(emulator);
+    switch (emulator->command) {
+        case READ_BLOCK_ONLY:       read_block(emulator, 0);                            break;
+        case READ_BLOCK_AND_SPARE:  read_block(emulator, 1);                            break;
+        case WRITE_BLOCK_ONLY:
+        case WRITE_BLOCK_AND_SPARE:
+            if (!block_number_valid(argument)) {
+                queue_command_reply(emulator, (uint32_t)-1);
+                break;
+            }
+            expect_input(emulator, INPUT_BLOCK, BLOCK_SIZE, 1);
+            break;
+        case INIT_FS:               queue_command_reply(emulator, 0);                   break;
+        case GET_NUM_BLOCKS:        queue_command_reply(emulator, NUM_BLOCKS);          break;
+        case SET_SEQNO:             emulator->seqno = argument;
+                                    queue_command_reply(emulator, 0);                   break;
+        case GET_SEQNO:             queue_command_reply(emulator, emulator->seqno);     break;
+        case FILE_CHKSUM:
+            if (argument == 0 || argument > MAX_FILENAME) {
+                queue_command_reply(emulator, (uint32_t)-1);
+                break;
+            }
+            expect_input(emulator, INPUT_FILENAME, argument, 0);
+            break;
+        case SET_LED:               queue_command_reply(emulator, 0);                   break;
+        case SET_TIME:              queue_command_reply(emulator, 0);
+                                    expect_input(emulator, INPUT_TIME, 4, 0);           break;
+        case GET_BBID:              queue_command_reply(emulator, config.bbid);         break;
+        case SIGN_HASH:
+            if (argument != SHA1_HASH_LENGTH) {
+                queue_command_reply(emulator, (uint32_t)-1);
+                break;
+            }
+            expect_input(emulator, INPUT_HASH, SHA1_HASH_LENGTH, 1);
+            break;
+        default:
+            fprintf(stderr, "Emulator: unknown command 0x%02x.\n", emulator->command);
+            queue_command_reply(emulator, (uint32_t)-1);
+            break;
+    }
+}
+
+/*
+    Everything the current input step was waiting for has arrived.
+*/
+static void input_complete(struct emulator * emulator) {
+    unsigned char * input = emulator->input_buffer;
+    switch (emulator->input) {
+        case INPUT_COMMAND:
+            emulator->desynchronized = 0;
+            clear_replies(emulator);
+            emulator->command = uchars_to_uint32(input);
+            emulator->argument = uchars_to_uint32(input + 4);
+            run_command(emulator);
+            break;
+        case INPUT_BLOCK:
+            memcpy(emulator->pending_block, input, BLOCK_SIZE);
+            if (emulator->command == WRITE_BLOCK_AND_SPARE) {
+                expect_input(emulator, INPUT_SPARE, SPARE_SIZE, 0);
+                break;
+            }
+            expect_command(emulator);
+            write_block(emulator, NULL);
+            break;
+        case INPUT_SPARE:
+            expect_command(emulator);
+            write_block(emulator, input);
+            break;
+        case INPUT_FILENAME:
+            memcpy(emulator->filename, input, emulator->input_expected);
+            emulator->filename[MAX_FILENAME - 1] = '\0';
+            expect_input(emulator, INPUT_CHECKSUM_PARAMS, REPLY_SIZE, 0);
+            break;
+        case INPUT_CHECKSUM_PARAMS:
+            expect_command(emulator);
+            queue_command_reply(emulator, file_matches(emulator, uchars_to_uint32(input), uchars_to_uint32(input + 4)) ? 0 : (uint32_t)-1);
+            break;
+        case INPUT_TIME:
+            expect_command(emulator);
+            break;
+        case INPUT_HASH:
+            expect_command(emulator);
+            sign_emulated_hash(emulator, input);
+            break;
+    }
+}
+
+
+/*
+    Input
+    The host's data is parsed a byte at a time, as it may split it into
+    transfers anywhere. An ACK may turn up between any two units. Anything
+    else out of place is reported once, and ignored until a command can be
+    parsed again.
+*/
+static void protocol_error(struct emulator * emulator, unsigned char byte) {
+    if (!emulator->desynchronized) {
+        fprintf(stderr, "Emulator: unexpected byte 0x%02x from the host; waiting for a new command.\n", byte);
+        emulator->desynchronized = 1;
+    }
+    expect_command(emulator);
+    emulator->unit_remaining = 0;
+    emulator->chunk_length_next = 0;
+}
+
+static void receive_byte(struct emulator * emulator, unsigned char byte) {
+    if (emulator->chunk_length_next) {
+        emulator->chunk_length_next = 0;
+        emulator->unit_remaining = byte;
+        if (byte == 0 || byte > emulator->input_expected - emulator->input_received) {
+            protocol_error(emulator, byte);
+        }
+        return;
+    }
+
+    if (emulator->unit_remaining == 0) {
+        if (byte == ACK_SIGNAL) {
+            return;
+        }
+        if (emulator->chunked && byte == SEND_CHUNK_SIGNAL) {
+            emulator->chunk_length_next = 1;
+        }
+        else if (!emulator->chunked && byte >= 0x41 && byte <= 0x43 &&
+                 (uint32_t)(byte - 0x40) <= emulator->input_expected - emulator->input_received) {
+            emulator->unit_remaining = byte - 0x40;
+        }
+        else if (emulator->input != INPUT_COMMAND || emulator->input_received != 0) {
+            // Start over: the host may have given up on what it was sending
+            protocol_error(emulator, byte);
+            receive_byte(emulator, byte);
+        }
+        else {
+            protocol_error(emulator, byte);
+        }
+        return;
+    }
+
+    emulator->input_buffer[emulator->input_received++] = byte;
+    emulator->unit_remaining--;
+    if (emulator->input_received == emulator->input_expected) {
+        input_complete(emulator);
+    }
+}
+
+static int emulator_send(struct emulator * emulator, const unsigned char * data, uint32_t length, int32_t * status) {
+    simulate_transfer_time(length);
+    uint32_t i;
+    for (i = 0; i < length; ++i) {
+        receive_byte(emulator, data[i]);
+    }
+    *status = 0;
+    return 1;
+}
+
+
+/*
+    Output
+    A read returns at most the rest of the current message, as the console
+    sends each message as its own transfer. When a message that is a
+    multiple of the packet size exactly fills a read, it is followed by a
+    zero-length packet so the host knows it has ended.
+*/
+static int replies_pending(struct emulator * emulator) {
+    return emulator->message_next != emulator->message_count;
+}
+
+static void abandon_exchange(struct emulator * emulator) {
+    if (replies_pending(emulator)) {
+        clear_replies(emulator);
+        expect_command(emulator);
+        emulator->unit_remaining = 0;
+        emulator->chunk_length_next = 0;
+    }
+}
+
+static int fault_due(unsigned int every, unsigned long count) {
+    return every && (count % every) == 0;
+}
+
+static int emulator_receive(struct emulator * emulator, unsigned char * data, uint32_t length, uint32_t * actual_length, int32_t * status) {
+    *actual_length = 0;
+    *status = 0;
+    emulator->in_transfers++;
+    if (fault_due(config.timeout_every, emulator->in_transfers)) {
+        simulate_transfer_time(0);
+        abandon_exchange(emulator);
+        *status = -110;  // ETIMEDOUT
+        return 1;
+    }
+    if (fault_due(config.stall_every, emulator->in_transfers)) {
+        simulate_transfer_time(0);
+        abandon_exchange(emulator);
+        *status = -32;   // EPIPE
+        return 1;
+    }
+
+    if (emulator->zlp_pending) {
+        emulator->zlp_pending = 0;
+        simulate_transfer_time(0);
+        return 1;
+    }
+    if (!replies_pending(emulator)) {
+        uint32_t ready_length = (length < sizeof(READY_SIGNAL)) ? length : sizeof(READY_SIGNAL);
+        simulate_transfer_time(ready_length);
+        memcpy(data, READY_SIGNAL, ready_length);
+        *actual_length = ready_length;
+        return 1;
+    }
+
+    uint32_t message_start = emulator->message_next ? emulator->message_ends[emulator->message_next - 1] : 0;
+    uint32_t message_end = emulator->message_ends[emulator->message_next];
+    uint32_t remaining = message_end - emulator->read_offset;
+    uint32_t sent = (remaining < length) ? remaining : length;
+    if (fault_due(config.short_every, emulator->in_transfers) && sent > 1) {
+        // Half a read arrives and the rest is lost
+        sent /= 2;
+        simulate_transfer_time(sent);
+        memcpy(data, emulator->output + emulator->read_offset, sent);
+        *actual_length = sent;
+        abandon_exchange(emulator);
+        return 1;
+    }
+
+    simulate_transfer_time(sent);
+    memcpy(data, emulator->output + emulator->read_offset, sent);
+    *actual_length = sent;
+    emulator->read_offset += sent;
+    if (emulator->read_offset == message_end) {
+        emulator->message_next++;
+        emulator->zlp_pending = (sent == length) && ((message_end - message_start) % config.packet_size == 0);
+        if (!replies_pending(emulator)) {
+            int zlp_pending = emulator->zlp_pending;
+            clear_replies(emulator);
+            emulator->zlp_pending = zlp_pending;
+        }
+    }
+    return 1;
+}
+
+
+/*
+    The emulator as a transport. Its transfers take as long as the latency
+    and bandwidth settings say, whatever the host's timeout.
+*/
+static void * emulator_transport_open(void) {
+    return emulator_open(emulator_directory);
+}
+
+static void emulator_transport_close(void * state) {
+    emulator_close(state);
+}
+
+static int emulator_transport_max_packet_size(void * state) {
+    (void)state;
+    return (int)config.packet_size;
+}
+
+static int emulator_transport_send(void * state, const unsigned char * data, uint32_t length, unsigned int timeout, int32_t * status) {
+    (void)timeout;
+    return emulator_send(state, data, length, status);
+}
+
+static int emulator_transport_receive(void * state, unsigned char * data, uint32_t length, unsigned int timeout,
+                                      uint32_t * actual_length, int32_t * status) {
+    (void)timeout;
+    return emulator_receive(state, data, length, actual_length, status);
+}
+
+const struct transport emulator_transport = {
+    "emulator",
+    emulator_transport_open,
+    emulator_transport_close,
+    emulator_transport_max_packet_size,
+    emulator_transport_send,
+    NULL,
+    emulator_transport_receive,
+    NULL
+};
@@ -0,0 +1,65 @@
+/*
+    emulator.h
+    a software console backed by a NAND image
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_EMULATOR_H
+#define AULON_EMULATOR_H
+
+#include "transport.h"
+
+/*
+    Set with -o as a comma-separated list of key=value pairs:
+
+    latency       microseconds added to every transfer
+    bandwidth     KiB/s the transfers are limited to (0 for no limit)
+    packet        maximum packet size of the IN endpoint
+    timeout_every every nth IN transfer times out
+    stall_every   every nth IN transfer stalls
+    short_every   every nth IN transfer comes back short
+    bbid          the console ID returned by GET_BBID
+
+    A fault in the middle of a reply discards the rest of it, so the
+    host's retry starts from a clean state. A period of 0 disables a fault.
+*/
+struct emulator_config {
+    unsigned int latency_us;
+    unsigned int bandwidth_kib;
+    unsigned int packet_size;
+    unsigned int timeout_every;
+    unsigned int stall_every;
+    unsigned int short_every;
+    unsigned int bbid;
+};
+
+/*
+    emulator_parse_options returns 1 for success and 0 for failure.
+*/
+void emulator_set_directory(char * directory);
+const char * emulator_get_directory(void);
+int emulator_parse_options(const char * spec);
+
+/*
+    A console emulated in-process over nand.bin and spare.bin in a host
+    directory, answering the same commands with the same framing as the
+    real thing, so every read, write, and FS operation can be run (and
+    timed) without hardware.
+*/
+extern const struct transport emulator_transport;
+
+#endif
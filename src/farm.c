@@ -0,0 +1,138 @@
+/*
+    farm.c
+    running one job on every attached console at once
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "session.h"
+#include "job.h"
+#include "thread.h"
+#include "timer.h"
+#include "farm.h"
+
+
+/*
+    Each console gets a session and a worker thread of its own. A console
+    spends nearly all of its time waiting on USB, so the workers hardly
+    compete for the host, and the station's throughput grows with the
+    number of consoles. Every session keeps its files in a directory
+    named after its console's BBID (see job_run_on_console), so e.g. a
+    farm dump leaves 0123ABCD/nand.bin, 0123ABCD/spare.bin, and so on, and
+    a farm partial write restores each console from its own directory.
+*/
+struct farm_worker {
+    struct session * session;
+    char location[32];
+    const struct job_list * jobs;
+    struct job_result result;
+    aulon_thread thread;
+    int started;
+};
+
+
+static void farm_worker_run(void * argument) {
+    struct farm_worker * worker = argument;
+    job_run_on_console(worker->session, worker->jobs, worker->location, &worker->result);
+}
+
+
+static void print_farm_report(struct farm_worker * workers, int count, uint64_t elapsed_us) {
+    uint64_t total_bytes = 0;
+    int succeeded = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        struct farm_worker * worker = &workers[i];
+        uint64_t bytes = worker->session->stats.bytes_in + worker->session->stats.bytes_out;
+        total_bytes += bytes;
+        if (!worker->result.connected) {
+            printf("  [%s] could not connect\n", worker->location);
+            continue;
+        }
+
+        double seconds = worker->result.elapsed_us / 1000000.0;
+        printf("  [%s] %08X: %s, %.1f MiB in %.1f s (%.1f KiB/s)\n", worker->location, worker->result.bbid,
+               worker->result.result ? "succeeded" : "FAILED", bytes / 1048576.0, seconds,
+               seconds > 0 ? (bytes / 1024.0) / seconds : 0.0);
+        succeeded += worker->result.result;
+    }
+
+    double seconds = elapsed_us / 1000000.0;
+    printf("Total: %.1f MiB in %.1f s (%.1f KiB/s); %d of %d consoles succeeded.\n",
+           total_bytes / 1048576.0, seconds, seconds > 0 ? (total_bytes / 1024.0) / seconds : 0.0,
+           succeeded, count);
+}
+
+int farm_run(const char * spec) {
+    struct job_list jobs;
+    if (!job_list_parse(&jobs, spec)) {
+        return 0;
+    }
+
+    struct usb_device_location locations[FARM_MAX_DEVICES];
+    int count = usb_find_devices(locations, FARM_MAX_DEVICES);
+    if (count <= 0) {
+        if (count == 0) {
+            fprintf(stderr, "No consoles were found. Make sure they are plugged in!\n");
+        }
+        return 0;
+    }
+
+    struct farm_worker * workers = calloc(count, sizeof(struct farm_worker));
+    if (workers == NULL) {
+        fprintf(stderr, "Could not allocate memory for the farm.\n");
+        return 0;
+    }
+
+    int i;
+    int success = 1;
+    for (i = 0; i < count; ++i) {
+        workers[i].session = session_create();
+        if (workers[i].session == NULL) {
+            success = 0;
+            break;
+        }
+        usb_set_device_location(workers[i].session, &locations[i]);
+        usb_format_location(&locations[i], workers[i].location, sizeof(workers[i].location));
+        workers[i].session->quiet = 1;
+        workers[i].jobs = &jobs;
+    }
+
+    printf("Running '%s' on %d console%s...\n", spec, count, (count == 1 ? "" : "s"));
+    uint64_t start_time = timer_now_us();
+    for (i = 0; success && i < count; ++i) {
+        workers[i].started = thread_create(&workers[i].thread, farm_worker_run, &workers[i]);
+    }
+    for (i = 0; i < count; ++i) {
+        if (workers[i].started) {
+            thread_join(workers[i].thread);
+        }
+    }
+
+    if (success) {
+        print_farm_report(workers, count, timer_now_us() - start_time);
+    }
+    for (i = 0; i < count; ++i) {
+        success = success && workers[i].started && workers[i].result.result;
+        session_destroy(workers[i].session);
+    }
+    free(workers);
+    return success;
+}
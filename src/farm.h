@@ -0,0 +1,31 @@
+/*
+    farm.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_FARM_H
+#define AULON_FARM_H
+
+#define FARM_MAX_DEVICES 32
+
+/*
+    Run a comma-separated list of commands (see job.h) on every attached
+    console. Returns 1 if they succeeded on every console, and 0 otherwise.
+*/
+int farm_run(const char * spec);
+
+#endif
@@ -25,21 +25,21 @@
 #include "fs.h"
 #include "io.h"
 #include "commands.h"
+#include "session.h"
+#include "stats.h"
+#include "timer.h"
 
-static unsigned char current_fs[BLOCK_SIZE];
-static unsigned char current_sp[SPARE_SIZE];
-static uint32_t current_index = 0;
 
 /*
     Simple utility functions
 */
-static void construct_filename(char * filename, size_t index) {
-    strncat(filename, (char *)&current_fs[index], 8);
+static void construct_filename(unsigned char * fs, char * filename, size_t index) {
+    strncat(filename, (char *)&fs[index], 8);
     filename[strlen(filename)] = '.';
-    strncat(filename, (char *)&current_fs[index + 8], 3);
+    strncat(filename, (char *)&fs[index + 8], 3);
 }
 
-static int set_filename(size_t index, const char * new_fn) {
+static int set_filename(unsigned char * fs, size_t index, const char * new_fn) {
     size_t full_len = strlen(new_fn);
     size_t fn_len   = strcspn(new_fn, ".");
     size_t ext_len  = full_len - fn_len - 1;
@@ -49,35 +49,35 @@ static int set_filename(size_t index, const char * new_fn) {
         return 0;
     }
     
-    memset(&current_fs[index], 0, 11);
-    memcpy(&current_fs[index], new_fn, fn_len);
-    memcpy(&current_fs[index + 8], (new_fn + fn_len + 1), ext_len);
+    memset(&fs[index], 0, 11);
+    memcpy(&fs[index], new_fn, fn_len);
+    memcpy(&fs[index + 8], (new_fn + fn_len + 1), ext_len);
     return 1;
 }
 
-static int entry_valid(size_t index) {
-    if (current_fs[index] == 0) {
+static int entry_valid(unsigned char * fs, size_t index) {
+    if (fs[index] == 0) {
         // Filename (and probably the entire entry) is NULL
         return 0;
     }
-    if (current_fs[index + 0xB] == 0) {
+    if (fs[index + 0xB] == 0) {
         // File marked invalid
         return 0;
     }
-    else if (uchars_to_int16(&current_fs[index + 0xC]) == -1) {
+    else if (uchars_to_int16(&fs[index + 0xC]) == -1) {
         // Start block for the file is -1
         return 0;
     }
     return 1;
 }
 
-static size_t find_file(const char * filename) {
+size_t find_file(unsigned char * fs, const char * filename) {
     size_t result = 0;
     for (size_t i = 0; i < NUM_FILE_ENTRIES; ++i) {
         size_t index = FILE_ENTRIES_START + (i * FILE_ENTRY_SIZE);
-        if (entry_valid(index)) {
+        if (entry_valid(fs, index)) {
             char test_fn[13] = { 0 };
-            construct_filename(test_fn, index);
+            construct_filename(fs, test_fn, index);
             if (strcmp(filename, test_fn) == 0) {
                 result = index;
                 break;
@@ -88,33 +88,42 @@ static size_t find_file(const char * filename) {
     return result;
 }
 
-static int rename_file(const char * old_fn, const char * new_fn) {
-    size_t index = find_file(old_fn);
+int fs_block_in_use(const unsigned char * fs, uint32_t block_number) {
+    int16_t entry = uchars_to_int16((unsigned char *)&fs[block_number * 2]);
+    return entry != 0 && entry != -2;
+}
+
+uint32_t fs_get_seqno(const unsigned char * fs) {
+    return uchars_to_uint32((unsigned char *)&fs[0x3FF8]);
+}
+
+static int rename_file(unsigned char * fs, const char * old_fn, const char * new_fn) {
+    size_t index = find_file(fs, old_fn);
     if (index == 0) {
         fprintf(stderr, "Error renaming file: File to rename does not exist!\n");
         return 0;
     }
 
-    return set_filename(index, new_fn);
+    return set_filename(fs, index, new_fn);
 }
 
 static uint32_t bytes_to_blocks(uint32_t bytes) {
     return (bytes / BLOCK_SIZE) + (bytes % BLOCK_SIZE != 0);
 }
 
-static uint32_t get_file_block_count(const char * filename) {
-    size_t index = find_file(filename);
+static uint32_t get_file_block_count(unsigned char * fs, const char * filename) {
+    size_t index = find_file(fs, filename);
     if (index == 0) {
         fprintf(stderr, "Error calculating block count of file: file not found\n");
         return 0;
     }
-    return bytes_to_blocks(uchars_to_uint32(&current_fs[index + 0x10]));
+    return bytes_to_blocks(uchars_to_uint32(&fs[index + 0x10]));
 }
 
-static uint32_t get_free_block_count(void) {
+static uint32_t get_free_block_count(unsigned char * fs) {
     uint32_t result = 0;
     for (int i = 0; i < 0x2000; i+=2) {
-        if (uchars_to_int16(&current_fs[i]) == 0)
+        if (uchars_to_int16(&fs[i]) == 0)
             result++;
     }
     return result;
@@ -127,14 +136,14 @@ static uint32_t get_free_block_count(void) {
     This could be especially useful for trying to update the FS manually
     if automatically updating the FS failed.
 */
-int dump_current_fs(void) {
+int dump_current_fs(struct session * session) {
     FILE * file = NULL;
-    if (!open_file(&file, "current_fs.bin", "wb")) {
+    if (!session_open_file(session, &file, "current_fs.bin", "wb")) {
         fprintf(stderr, "Could not dump current filesystem!\n");
         return 0;
     }
     
-    fwrite(current_fs, sizeof(current_fs[0]), BLOCK_SIZE, file);
+    fwrite(session->fs.current_fs, sizeof(session->fs.current_fs[0]), BLOCK_SIZE, file);
     fclose(file);
     return 1;
 }
@@ -144,31 +153,31 @@ int dump_current_fs(void) {
 /*
     Update the console's filesystem by sending the current_fs with all of its changes.
 */
-static void increment_seqno(void) {
-    uint32_t seqno = uchars_to_uint32(&current_fs[0x3FF8]);
+static void increment_seqno(unsigned char * fs) {
+    uint32_t seqno = uchars_to_uint32(&fs[0x3FF8]);
     seqno++;
-    current_fs[0x3FF8] = (seqno & 0xFF000000) >> 24;
-    current_fs[0x3FF9] = (seqno & 0x00FF0000) >> 16;
-    current_fs[0x3FFA] = (seqno & 0x0000FF00) >>  8;
-    current_fs[0x3FFB] = (seqno & 0x000000FF);
+    fs[0x3FF8] = (seqno & 0xFF000000) >> 24;
+    fs[0x3FF9] = (seqno & 0x00FF0000) >> 16;
+    fs[0x3FFA] = (seqno & 0x0000FF00) >>  8;
+    fs[0x3FFB] = (seqno & 0x000000FF);
 }
 
-static int update_fs(void) {
-    uint32_t next_index = ((current_index - 1) % 16) + 0xFF0;
+static int update_fs(struct session * session) {
+    uint32_t next_index = ((session->fs.current_index - 1) % 16) + 0xFF0;
     
-    increment_seqno();    
+    increment_seqno(session->fs.current_fs);    
     
-    if (!write_block_spare(current_fs, current_sp, next_index)) {
+    if (!write_block_spare(session, session->fs.current_fs, session->fs.current_sp, next_index)) {
         fprintf(stderr, "Could not update filesystem! The block to be written was %u.\n", next_index);
         fprintf(stderr, "The filesystem to be written will be dumped to a file named 'current_fs.bin'\n");
-        dump_current_fs();
+        dump_current_fs(session);
         return 0;
     }
     
-    if (!init_fs()) {
+    if (!init_fs(session)) {
         fprintf(stderr, "Filesystem not synchronized! Resetting the console should do it for you.\n");
     }
-    current_index = next_index;
+    session->fs.current_index = next_index;
     return 1;
 }
 
@@ -177,25 +186,25 @@ static int update_fs(void) {
 /*
     Find the current up-to-date filesystem and its block
 */
-static uint32_t check_seqno(unsigned char * block, unsigned char * spare,
+static uint32_t check_seqno(struct session * session, unsigned char * block, unsigned char * spare,
                             uint32_t block_num, uint32_t current_seqno) {
-    if (!read_block_spare(block, spare, block_num)) {
+    if (!read_block_spare(session, block, spare, block_num)) {
         fprintf(stderr, "Unable to read all FS blocks!\n");
         return 0;
     }
     
-    uint32_t seqno = uchars_to_uint32(&block[0x3FF8]);
+    uint32_t seqno = fs_get_seqno(block);
     if (seqno > current_seqno) {
-        memcpy(current_fs, block, BLOCK_SIZE);
-        memcpy(current_sp, spare, SPARE_SIZE);
-        current_index = block_num - 0xFF0;
+        memcpy(session->fs.current_fs, block, BLOCK_SIZE);
+        memcpy(session->fs.current_sp, spare, SPARE_SIZE);
+        session->fs.current_index = block_num - 0xFF0;
         return seqno;
     }
     
     return current_seqno;
 }
 
-int get_current_fs(void) {
+int get_current_fs(struct session * session) {
     uint32_t current_seqno = 0;
     
     unsigned char * block_temp = calloc(BLOCK_SIZE, sizeof(unsigned char));
@@ -205,7 +214,7 @@ int get_current_fs(void) {
     }
     else {
         for (uint32_t i = 0xFFF; i >= 0xFF0; --i) {
-            current_seqno = check_seqno(block_temp, spare_temp, i, current_seqno);
+            current_seqno = check_seqno(session, block_temp, spare_temp, i, current_seqno);
         }
     }
 
@@ -219,19 +228,19 @@ int get_current_fs(void) {
 /*
     List the numbers of the blocks that make up the given file.
 */
-int list_file_blocks(const char * filename) {
-    size_t index = find_file(filename);
+int list_file_blocks(struct session * session, const char * filename) {
+    size_t index = find_file(session->fs.current_fs, filename);
     if (index == 0) {
         fprintf(stderr, "The given file is not present on the console.\n");
         return 0;
     }
     
-    int16_t next_block = uchars_to_int16(&current_fs[index + 0xC]);
+    int16_t next_block = uchars_to_int16(&session->fs.current_fs[index + 0xC]);
     unsigned count = 0;
     while (next_block >= 0) {
         count++;
         printf("Block %u: 0x%04x\n", count, next_block);
-        next_block = uchars_to_int16(&current_fs[next_block * 2]);
+        next_block = uchars_to_int16(&session->fs.current_fs[next_block * 2]);
     }
     return 1;
 }
@@ -241,13 +250,13 @@ int list_file_blocks(const char * filename) {
 /*
     Print all files currently on the console with their sizes.
 */
-static void print_file_entry(size_t entry_no, unsigned * count) {
+static void print_file_entry(unsigned char * fs, size_t entry_no, unsigned * count) {
     size_t index = FILE_ENTRIES_START + (entry_no * FILE_ENTRY_SIZE);
-    if (entry_valid(index)) {
+    if (entry_valid(fs, index)) {
         char filename[13] = { 0 };
-        construct_filename(filename, index);
+        construct_filename(fs, filename, index);
         
-        uint32_t file_size = uchars_to_uint32(&current_fs[index + 0x10]);
+        uint32_t file_size = uchars_to_uint32(&fs[index + 0x10]);
         unsigned num_blocks = file_size / BLOCK_SIZE;
         const char * s = (num_blocks == 1) ? "" : "s";
 
@@ -256,10 +265,10 @@ static void print_file_entry(size_t entry_no, unsigned * count) {
     }
 }
 
-void list_files(void) {
+void list_files(struct session * session) {
     unsigned count = 0;
     for (size_t i = 0; i < NUM_FILE_ENTRIES; ++i) {
-        print_file_entry(i, &count);
+        print_file_entry(session->fs.current_fs, i, &count);
     }
 }
 
@@ -268,34 +277,34 @@ void list_files(void) {
 /*
     Delete a file on the console.
 */
-static void free_blocks(size_t index) {
-    int16_t next_block = uchars_to_int16(&current_fs[index + 0xC]);
+static void free_blocks(unsigned char * fs, size_t index) {
+    int16_t next_block = uchars_to_int16(&fs[index + 0xC]);
     while (next_block >= 0) {
         int16_t curr_block = next_block;
-        next_block = uchars_to_int16(&current_fs[curr_block * 2]);
-        current_fs[(curr_block * 2)]     = 0;
-        current_fs[(curr_block * 2) + 1] = 0;
+        next_block = uchars_to_int16(&fs[curr_block * 2]);
+        fs[(curr_block * 2)]     = 0;
+        fs[(curr_block * 2) + 1] = 0;
     }
 }
 
-static void delete_file_entry(size_t index) {
-    memset(&current_fs[index], 0, 20);
+static void delete_file_entry(unsigned char * fs, size_t index) {
+    memset(&fs[index], 0, 20);
 }
 
-static int delete_file(const char * filename) {
-    size_t index = find_file(filename);
+static int delete_file(unsigned char * fs, const char * filename) {
+    size_t index = find_file(fs, filename);
     if (index == 0) {
         return 0;
     }
     
-    free_blocks(index);
-    delete_file_entry(index);
+    free_blocks(fs, index);
+    delete_file_entry(fs, index);
     return 1;
 }
 
-int delete_file_and_update(const char * filename) {
-    if (delete_file(filename)) {
-        return update_fs();
+int delete_file_and_update(struct session * session, const char * filename) {
+    if (delete_file(session->fs.current_fs, filename)) {
+        return update_fs(session);
     }
     else {
         return 1;
@@ -308,14 +317,14 @@ int delete_file_and_update(const char * filename) {
     Print the number of currently free, used, and bad blocks, and
     the sequence number of the current filesystem.
 */
-void print_stats(void) {
+void print_stats(struct session * session) {
     size_t free_count = 0;
     size_t used_count = 0;
     size_t bad_count = 0;
     
     int16_t temp = 0;
     for (int i = 0; i < 0x2000; i+=2) {
-        temp = uchars_to_int16(&current_fs[i]);
+        temp = uchars_to_int16(&session->fs.current_fs[i]);
         
         if (temp == 0)
             free_count++;
@@ -325,7 +334,7 @@ void print_stats(void) {
             used_count++;
     }
     
-    uint32_t seqno = uchars_to_uint32(&current_fs[0x3FF8]);
+    uint32_t seqno = uchars_to_uint32(&session->fs.current_fs[0x3FF8]);
     printf("Free: %zu\nUsed: %zu\nBad: %zu\nSequence Number: %d\n", free_count, used_count, bad_count, seqno);
 }
 
@@ -334,7 +343,7 @@ void print_stats(void) {
 /*
     Read a file from the console to a file on the host computer.
 */
-static int read_blocks_to_file(size_t entry_index, FILE * file) {
+static int read_blocks_to_file(struct session * session, size_t entry_index, FILE * file) {
     int success = 1;
     unsigned char * block_temp = calloc(BLOCK_SIZE, sizeof(unsigned char));
     unsigned char * spare_temp = calloc(SPARE_SIZE, sizeof(unsigned char));
@@ -343,16 +352,18 @@ static int read_blocks_to_file(size_t entry_index, FILE * file) {
         success = 0;
     }
     else {
-        int16_t next_block = uchars_to_int16(&current_fs[entry_index + 0xC]);
+        int16_t next_block = uchars_to_int16(&session->fs.current_fs[entry_index + 0xC]);
         while (next_block >= 0) {
-            if (!read_block_spare(block_temp, spare_temp, next_block)) {
+            if (!read_block_spare(session, block_temp, spare_temp, next_block)) {
                 fprintf(stderr, "Unable to read block %x while reading file from console!\n", next_block);
                 success = 0;
                 break;
             }
             
+            uint64_t write_start = timer_now_us();
             fwrite(block_temp, sizeof(unsigned char), BLOCK_SIZE, file);
-            next_block = uchars_to_int16(&current_fs[next_block * 2]);
+            stats_record_disk(&session->stats, write_start);
+            next_block = uchars_to_int16(&session->fs.current_fs[next_block * 2]);
         }
     }
     
@@ -361,26 +372,26 @@ static int read_blocks_to_file(size_t entry_index, FILE * file) {
     return success;
 }
 
-int read_file(const char * filename) {
+int read_file(struct session * session, const char * filename) {
     if (strlen(filename) > 12) {
         fprintf(stderr, "Filename invalid: Too long for iQue Player FS.\n");
         return 0;
     }
     
-    size_t index = find_file(filename);
+    size_t index = find_file(session->fs.current_fs, filename);
     if (index == 0) {
         fprintf(stderr, "The given file is not present on the console.\n");
         return 0;
     }
     
     FILE * pc_file = NULL;
-    if (!open_file(&pc_file, filename, "wb")) {
+    if (!session_open_file(session, &pc_file, filename, "wb")) {
         fprintf(stderr, "Could not open a file to retrieve data from the console.\n");
         return 0;
     }
     
     int success = 1;
-    if (!read_blocks_to_file(index, pc_file)) {
+    if (!read_blocks_to_file(session, index, pc_file)) {
         fprintf(stderr, "Could not read the console's filesystem!\n");
         success = 0;
     }
@@ -439,26 +450,26 @@ static uint32_t calculate_file_checksum(FILE * file, size_t size) {
     return checksum;
 }
 
-static int validate_file_write(const char * filename, uint32_t checksum, uint32_t blocks_required) {
-    size_t index = find_file(filename);
-    if (index && file_checksum_cmp(filename, checksum, blocks_required * BLOCK_SIZE)) {
+static int validate_file_write(struct session * session, const char * filename, uint32_t checksum, uint32_t blocks_required) {
+    size_t index = find_file(session->fs.current_fs, filename);
+    if (index && file_checksum_cmp(session, filename, checksum, blocks_required * BLOCK_SIZE)) {
         fprintf(stderr, "Exact file to be written already exists on the console!\n");
         return 0;
     }
     
-    uint32_t extra = index ? get_file_block_count(filename) : 0;
-    if (blocks_required >= (get_free_block_count() + extra)) {
+    uint32_t extra = index ? get_file_block_count(session->fs.current_fs, filename) : 0;
+    if (blocks_required >= (get_free_block_count(session->fs.current_fs) + extra)) {
         fprintf(stderr, "Not enough free blocks to write file!\n");
         return 0;
     }
     
     if (index) {
-        delete_file(filename);
+        delete_file(session->fs.current_fs, filename);
     }
     return 1;
 }
 
-static int write_file_blocks(FILE * file, int16_t * blocks_to_write, uint32_t num_blocks) {
+static int write_file_blocks(struct session * session, FILE * file, int16_t * blocks_to_write, uint32_t num_blocks) {
     
     unsigned char * block = calloc(BLOCK_SIZE, sizeof(unsigned char));
     if (block == NULL || file == NULL || blocks_to_write == NULL) {
@@ -478,14 +489,16 @@ static int write_file_blocks(FILE * file, int16_t * blocks_to_write, uint32_t nu
         }
         
         memset(block, 0, BLOCK_SIZE);
+        uint64_t read_start = timer_now_us();
         size_t read_count = fread(block, sizeof(block[0]), BLOCK_SIZE, file);
+        stats_record_disk(&session->stats, read_start);
         if (ferror(file) || read_count == 0) {
             fprintf(stderr, "Error reading from source file during file write operation!\n");
             success = 0;
             break;
         }
         
-        if (!write_block_spare(block, spare, blocks_to_write[i])) {
+        if (!write_block_spare(session, block, spare, blocks_to_write[i])) {
             fprintf(stderr, "Error writing block to console during file write!\n");
             success = 0;
             break;
@@ -496,12 +509,12 @@ static int write_file_blocks(FILE * file, int16_t * blocks_to_write, uint32_t nu
     return success;
 }
 
-static size_t find_blank_file_entry(void) {
+static size_t find_blank_file_entry(unsigned char * fs) {
     size_t result = 0;
     unsigned char blank_entry[20] = { 0 };
     for (size_t i = 0; i < NUM_FILE_ENTRIES; ++i) {
         size_t index = FILE_ENTRIES_START + (i * FILE_ENTRY_SIZE);
-        if (memcmp(&current_fs[index], blank_entry, 20) == 0) {
+        if (memcmp(&fs[index], blank_entry, 20) == 0) {
             result = index;
             break;
         }
@@ -509,21 +522,21 @@ static size_t find_blank_file_entry(void) {
     return result;
 }
 
-static int write_file_entry(const char * filename, int16_t start_block, uint32_t file_size) {
-    size_t index = find_blank_file_entry();
+static int write_file_entry(unsigned char * fs, const char * filename, int16_t start_block, uint32_t file_size) {
+    size_t index = find_blank_file_entry(fs);
     if (index == 0) {
         fprintf(stderr, "No more files can be written to the console.\nAt least one will have to be deleted to create space.\n");
         return 0;
     }
     
-    if (set_filename(index, filename)) {
-        current_fs[index + 0xB]  = 1;
-        current_fs[index + 0xC]  = (start_block & 0xFF00) >> 8;
-        current_fs[index + 0xD]  = (start_block & 0x00FF);
-        current_fs[index + 0x10] = (file_size & 0xFF000000) >> 24;
-        current_fs[index + 0x11] = (file_size & 0x00FF0000) >> 16;
-        current_fs[index + 0x12] = (file_size & 0x0000FF00) >>  8;
-        current_fs[index + 0x13] = (file_size & 0x000000FF);
+    if (set_filename(fs, index, filename)) {
+        fs[index + 0xB]  = 1;
+        fs[index + 0xC]  = (start_block & 0xFF00) >> 8;
+        fs[index + 0xD]  = (start_block & 0x00FF);
+        fs[index + 0x10] = (file_size & 0xFF000000) >> 24;
+        fs[index + 0x11] = (file_size & 0x00FF0000) >> 16;
+        fs[index + 0x12] = (file_size & 0x0000FF00) >>  8;
+        fs[index + 0x13] = (file_size & 0x000000FF);
         return 1;
     }
     else {
@@ -532,10 +545,10 @@ static int write_file_entry(const char * filename, int16_t start_block, uint32_t
     }
 }
 
-static int16_t find_next_free_block(int16_t start_block_num) {
+static int16_t find_next_free_block(unsigned char * fs, int16_t start_block_num) {
     int16_t result = -1;
     for (int16_t i = (start_block_num * 2); i < 0x2000; i+=2) {
-        int16_t temp = uchars_to_int16(&current_fs[i]);
+        int16_t temp = uchars_to_int16(&fs[i]);
         if (temp == 0) {
             result = i;
             break;
@@ -544,7 +557,7 @@ static int16_t find_next_free_block(int16_t start_block_num) {
     return (result / 2);
 }
 
-static void update_fs_links(int16_t * blocks_to_write, int16_t start_block, uint32_t num_blocks) {
+static void update_fs_links(unsigned char * fs, int16_t * blocks_to_write, int16_t start_block, uint32_t num_blocks) {
     int16_t current_blk = start_block;
     int16_t next_blk = 0;
     uint32_t blocks_remaining = num_blocks;
@@ -553,9 +566,9 @@ static void update_fs_links(int16_t * blocks_to_write, int16_t start_block, uint
     while (blocks_remaining > 1) {
         blocks_to_write[i] = current_blk;
         
-        next_blk = find_next_free_block(current_blk + 1);
-        current_fs[current_blk * 2]     = (next_blk & 0xFF00) >> 8;
-        current_fs[current_blk * 2 + 1] = (next_blk & 0x00FF);
+        next_blk = find_next_free_block(fs, current_blk + 1);
+        fs[current_blk * 2]     = (next_blk & 0xFF00) >> 8;
+        fs[current_blk * 2 + 1] = (next_blk & 0x00FF);
         
         current_blk = next_blk;
         blocks_remaining--;
@@ -563,14 +576,14 @@ static void update_fs_links(int16_t * blocks_to_write, int16_t start_block, uint
     }
     
     blocks_to_write[i] = current_blk;
-    current_fs[current_blk * 2]     = 0xFF;
-    current_fs[current_blk * 2 + 1] = 0xFF;
+    fs[current_blk * 2]     = 0xFF;
+    fs[current_blk * 2 + 1] = 0xFF;
 }
 
-static int write_blocks_to_temp_file(FILE * file, uint32_t blocks_required) {
+static int write_blocks_to_temp_file(struct session * session, FILE * file, uint32_t blocks_required) {
    
-    int16_t start_block = find_next_free_block(0x40);
-    if (start_block == -1 || !write_file_entry("temp.tmp", start_block, blocks_required * BLOCK_SIZE)) {
+    int16_t start_block = find_next_free_block(session->fs.current_fs, 0x40);
+    if (start_block == -1 || !write_file_entry(session->fs.current_fs, "temp.tmp", start_block, blocks_required * BLOCK_SIZE)) {
         return 0;
     }
     
@@ -580,8 +593,8 @@ static int write_blocks_to_temp_file(FILE * file, uint32_t blocks_required) {
         success = 0;
     }
     else {
-        update_fs_links(blocks_to_write, start_block, blocks_required);
-        if (!write_file_blocks(file, blocks_to_write, blocks_required)) {
+        update_fs_links(session->fs.current_fs, blocks_to_write, start_block, blocks_required);
+        if (!write_file_blocks(session, file, blocks_to_write, blocks_required)) {
             fprintf(stderr, "Could not write file data to the console!\n");
             success = 0;
         }
@@ -591,9 +604,9 @@ static int write_blocks_to_temp_file(FILE * file, uint32_t blocks_required) {
     return success;
 }
 
-static int check_and_cleanup_temp_file(const char * filename, uint32_t checksum, uint32_t blocks_required) {
-    if (file_checksum_cmp("temp.tmp", checksum, blocks_required * BLOCK_SIZE)) {
-        if (!rename_file("temp.tmp", filename)) {
+static int check_and_cleanup_temp_file(struct session * session, const char * filename, uint32_t checksum, uint32_t blocks_required) {
+    if (file_checksum_cmp(session, "temp.tmp", checksum, blocks_required * BLOCK_SIZE)) {
+        if (!rename_file(session->fs.current_fs, "temp.tmp", filename)) {
             fprintf(stderr, "Could not rename temp.tmp file!\n");
             return 0;
         }
@@ -605,7 +618,7 @@ static int check_and_cleanup_temp_file(const char * filename, uint32_t checksum,
     return 1;
 }
 
-int write_file(const char * filename) {
+int write_file(struct session * session, const char * filename) {
     FILE * pc_file = NULL;
     if (!open_file(&pc_file, filename, "rb")) {
         return 0;
@@ -622,13 +635,13 @@ int write_file(const char * filename) {
     else if (pc_file_checksum == 0) {
         fprintf(stderr, "Could not calculate checksum of file to be written!\n");
     }
-    else if (!validate_file_write(filename, pc_file_checksum, blocks_required)) {
+    else if (!validate_file_write(session, filename, pc_file_checksum, blocks_required)) {
         fprintf(stderr, "File write operation aborted.\n");
     }
-    else if (!write_blocks_to_temp_file(pc_file, blocks_required)) {
+    else if (!write_blocks_to_temp_file(session, pc_file, blocks_required)) {
         fprintf(stderr, "Error writing file to the console!\n");
     }
-    else if (!check_and_cleanup_temp_file(filename, pc_file_checksum, blocks_required)) {
+    else if (!check_and_cleanup_temp_file(session, filename, pc_file_checksum, blocks_required)) {
         fprintf(stderr, "Error verifying or cleaning up 'temp.tmp' file after file write!\n");
     }
     else {
@@ -636,7 +649,7 @@ int write_file(const char * filename) {
     }
     
     // update FS even if a write errors, because it should be as up-to-date as possible
-    update_fs();
+    update_fs(session);
 
     fclose(pc_file);
     return success;
@@ -20,17 +20,45 @@
 #ifndef AULON_FS_H
 #define AULON_FS_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include "commands.h"
+
 #define FILE_ENTRIES_START 0x2000
 #define FILE_ENTRY_SIZE    20
 #define NUM_FILE_ENTRIES   409
+#define FS_BLOCKS_START    0xFF0 // The last 16 blocks hold copies of the FS, the newest with the highest seqno
+
+/*
+    The console's current filesystem block, as last read from (or about
+    to be written to) one of the FS blocks 0xFF0-0xFFF.
+*/
+struct fs_state {
+    unsigned char current_fs[BLOCK_SIZE];
+    unsigned char current_sp[SPARE_SIZE];
+    uint32_t current_index;
+};
+
+/*
+    The index of a valid file's entry in an FS block, or 0 if there is none.
+*/
+size_t find_file(unsigned char * fs, const char * filename);
+
+/*
+    Whether an FS block's FAT marks a block as in use: neither free (0) nor
+    bad (-2). The newest copy of the FS is the one with the highest seqno.
+*/
+int fs_block_in_use(const unsigned char * fs, uint32_t block_number);
+uint32_t fs_get_seqno(const unsigned char * fs);
 
-int get_current_fs(void);
-int dump_current_fs(void);
-int read_file(const char * filename);
-int write_file(const char * filename);
-int list_file_blocks(const char * filename);
-void list_files(void);
-void print_stats(void);
-int delete_file_and_update(const char * filename);
+int get_current_fs(struct session * session);
+int dump_current_fs(struct session * session);
+int read_file(struct session * session, const char * filename);
+int write_file(struct session * session, const char * filename);
+int list_file_blocks(struct session * session, const char * filename);
+void list_files(struct session * session);
+void print_stats(struct session * session);
+int delete_file_and_update(struct session * session, const char * filename);
 
 #endif
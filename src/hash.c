@@ -0,0 +1,247 @@
+/*
+    hash.c
+    block hashes used to check dumps and images
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "commands.h"
+#include "hash.h"
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotate_left(uint64_t value, unsigned int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// XXH64 reads its input as little-endian words, whatever the host
+static uint64_t read_le64(const unsigned char * bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+static uint32_t read_le32(const unsigned char * bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t round64(uint64_t accumulator, uint64_t input) {
+    accumulator += input * PRIME64_2;
+    accumulator = rotate_left(accumulator, 31);
+    return accumulator * PRIME64_1;
+}
+
+static uint64_t merge_round64(uint64_t accumulator, uint64_t value) {
+    accumulator ^= round64(0, value);
+    return accumulator * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash_xxh64(const unsigned char * data, size_t length, uint64_t seed) {
+    const unsigned char * end = data + length;
+    uint64_t hash;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do {
+            v1 = round64(v1, read_le64(data));
+            v2 = round64(v2, read_le64(data + 8));
+            v3 = round64(v3, read_le64(data + 16));
+            v4 = round64(v4, read_le64(data + 24));
+            data += 32;
+        } while (end - data >= 32);
+
+        hash = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+        hash = merge_round64(hash, v1);
+        hash = merge_round64(hash, v2);
+        hash = merge_round64(hash, v3);
+        hash = merge_round64(hash, v4);
+    }
+    else {
+        hash = seed + PRIME64_5;
+    }
+    hash += (uint64_t)length;
+
+    while (end - data >= 8) {
+        hash ^= round64(0, read_le64(data));
+        hash = rotate_left(hash, 27) * PRIME64_1 + PRIME64_4;
+        data += 8;
+    }
+    if (end - data >= 4) {
+        hash ^= (uint64_t)read_le32(data) * PRIME64_1;
+        hash = rotate_left(hash, 23) * PRIME64_2 + PRIME64_3;
+        data += 4;
+    }
+    while (data < end) {
+        hash ^= (*data) * PRIME64_5;
+        hash = rotate_left(hash, 11) * PRIME64_1;
+        ++data;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+
+static uint32_t rotate_left32(uint32_t value, unsigned int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_process(struct sha1_context * context, const unsigned char * chunk) {
+    uint32_t w[80];
+    int i;
+    for (i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t)chunk[i * 4] << 24) | ((uint32_t)chunk[i * 4 + 1] << 16) |
+               ((uint32_t)chunk[i * 4 + 2] << 8) | (uint32_t)chunk[i * 4 + 3];
+    }
+    for (i = 16; i < 80; ++i) {
+        w[i] = rotate_left32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = context->state[0];
+    uint32_t b = context->state[1];
+    uint32_t c = context->state[2];
+    uint32_t d = context->state[3];
+    uint32_t e = context->state[4];
+    for (i = 0; i < 80; ++i) {
+        uint32_t f;
+        uint32_t k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t temp = rotate_left32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotate_left32(b, 30);
+        b = a;
+        a = temp;
+    }
+    context->state[0] += a;
+    context->state[1] += b;
+    context->state[2] += c;
+    context->state[3] += d;
+    context->state[4] += e;
+}
+
+void hash_sha1_init(struct sha1_context * context) {
+    context->state[0] = 0x67452301;
+    context->state[1] = 0xEFCDAB89;
+    context->state[2] = 0x98BADCFE;
+    context->state[3] = 0x10325476;
+    context->state[4] = 0xC3D2E1F0;
+    context->length = 0;
+    context->buffered = 0;
+}
+
+void hash_sha1_update(struct sha1_context * context, const unsigned char * data, size_t length) {
+    context->length += length;
+    if (context->buffered > 0) {
+        size_t count = 64 - context->buffered < length ? 64 - context->buffered : length;
+        memcpy(context->buffer + context->buffered, data, count);
+        context->buffered += count;
+        data += count;
+        length -= count;
+        if (context->buffered < 64) {
+            return;
+        }
+        sha1_process(context, context->buffer);
+        context->buffered = 0;
+    }
+    while (length >= 64) {
+        sha1_process(context, data);
+        data += 64;
+        length -= 64;
+    }
+    memcpy(context->buffer, data, length);
+    context->buffered = length;
+}
+
+void hash_sha1_final(struct sha1_context * context, unsigned char * digest_out) {
+    uint64_t bit_length = context->length * 8;
+    unsigned char padding[72] = { 0x80 };
+    size_t padding_length = (context->buffered < 56 ? 56 : 120) - context->buffered;
+    unsigned char length_bytes[8];
+    int i;
+    for (i = 0; i < 8; ++i) {
+        length_bytes[i] = (unsigned char)(bit_length >> (56 - i * 8));
+    }
+    hash_sha1_update(context, padding, padding_length);
+    hash_sha1_update(context, length_bytes, 8);
+    for (i = 0; i < 20; ++i) {
+        digest_out[i] = (unsigned char)(context->state[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+
+void hash_block_and_spare(const unsigned char * block, const unsigned char * spare, struct block_hashes * hashes_out) {
+    hashes_out->block = hash_xxh64(block, BLOCK_SIZE, 0);
+    hashes_out->spare = hash_xxh64(spare, SPARE_SIZE, 0);
+}
+
+int hash_blocks_equal(const struct block_hashes * a, const struct block_hashes * b) {
+    return a->block == b->block && a->spare == b->spare;
+}
+
+int hash_write_block_line(FILE * file, uint32_t block_number, const struct block_hashes * hashes) {
+    return fprintf(file, "%04x %016llx %016llx\n", (unsigned int)block_number,
+                   (unsigned long long)hashes->block, (unsigned long long)hashes->spare) >= 0;
+}
+
+int hash_parse_block_line(const char * line, uint32_t * block_number_out, struct block_hashes * hashes_out) {
+    unsigned int block_number;
+    unsigned long long block_hash;
+    unsigned long long spare_hash;
+    char end;
+    if (sscanf(line, "%x %llx %llx%c", &block_number, &block_hash, &spare_hash, &end) != 4 ||
+        end != '\n' || block_number >= NUM_BLOCKS) {
+        return 0;
+    }
+    *block_number_out = block_number;
+    hashes_out->block = block_hash;
+    hashes_out->spare = spare_hash;
+    return 1;
+}
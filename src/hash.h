@@ -0,0 +1,69 @@
+/*
+    hash.h
+    block hashes used to check dumps and images
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_HASH_H
+#define AULON_HASH_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    XXH64, a fast non-cryptographic hash, used to tell whether blocks have
+    changed. Its output matches the reference implementation's for the
+    same seed.
+*/
+uint64_t hash_xxh64(const unsigned char * data, size_t length, uint64_t seed);
+
+/*
+    SHA-1, for digests that can be checked with common tools (e.g.
+    sha1sum) and compared with the hashes the console itself signs. Feed
+    data in with any number of hash_sha1_update calls between init and
+    final; digest_out receives SHA1_HASH_LENGTH bytes.
+*/
+struct sha1_context {
+    uint32_t state[5];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t buffered;
+};
+
+void hash_sha1_init(struct sha1_context * context);
+void hash_sha1_update(struct sha1_context * context, const unsigned char * data, size_t length);
+void hash_sha1_final(struct sha1_context * context, unsigned char * digest_out);
+
+/*
+    The hashes of one block and its spare data, and the way they are
+    written in text files that list blocks (dump journals, console hash
+    lists): the block number and both hashes, in hex, on one line.
+    hash_parse_block_line returns 0 for a line that doesn't parse, e.g.
+    one cut short by an interruption.
+*/
+struct block_hashes {
+    uint64_t block;
+    uint64_t spare;
+};
+
+void hash_block_and_spare(const unsigned char * block, const unsigned char * spare, struct block_hashes * hashes_out);
+int hash_blocks_equal(const struct block_hashes * a, const struct block_hashes * b);
+int hash_write_block_line(FILE * file, uint32_t block_number, const struct block_hashes * hashes);
+int hash_parse_block_line(const char * line, uint32_t * block_number_out, struct block_hashes * hashes_out);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+    hotplug.c
+    running jobs on consoles automatically as they are plugged in
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+
+#include "session.h"
+#include "job.h"
+#include "thread.h"
+#include "hotplug.h"
+
+
+/*
+    Each console that is plugged in gets a slot, with a session and a worker
+    thread that connects, runs the jobs, and disconnects. The slot is kept
+    until the console is unplugged, so a console is handled once per
+    plug-in, and a console that resets and re-enumerates in the middle of a
+    job (which also looks like an unplug and a plug-in) is left to the
+    worker's own reconnect logic rather than being started over.
+
+    The main thread handles the hotplug events and owns the slots; a worker
+    only ever changes its slot's state, under the lock, to say it has
+    finished.
+*/
+enum {
+    SLOT_FREE,
+    SLOT_RUNNING,
+    SLOT_FINISHED
+};
+
+struct hotplug_slot {
+    int state;
+    int unplugged;
+    struct usb_device_location location;
+    char label[32];
+    struct session * session;
+    struct job_result result;
+    aulon_thread thread;
+};
+
+static struct hotplug_slot slots[HOTPLUG_MAX_CONSOLES];
+static aulon_mutex slot_lock;
+static const struct job_list * hotplug_jobs = NULL;
+static volatile sig_atomic_t stop_requested = 0;
+static unsigned int consoles_handled = 0;
+static unsigned int consoles_succeeded = 0;
+
+
+static void handle_interrupt(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+static int slot_state(struct hotplug_slot * slot) {
+    mutex_lock(&slot_lock);
+    int state = slot->state;
+    mutex_unlock(&slot_lock);
+    return state;
+}
+
+
+static void hotplug_worker_run(void * argument) {
+    struct hotplug_slot * slot = argument;
+    job_run_on_console(slot->session, hotplug_jobs, slot->label, &slot->result);
+
+    if (!slot->result.connected) {
+        printf("[%s] Could not connect to the console.\n", slot->label);
+    }
+    else {
+        printf("[%s] %08X: %s in %.1f s. The console can be unplugged.\n", slot->label, slot->result.bbid,
+               slot->result.result ? "done" : "FAILED", slot->result.elapsed_us / 1000000.0);
+    }
+    fflush(stdout);
+
+    mutex_lock(&slot_lock);
+    slot->state = SLOT_FINISHED;
+    mutex_unlock(&slot_lock);
+}
+
+
+static struct hotplug_slot * find_slot(const struct usb_device_location * location) {
+    int i;
+    for (i = 0; i < HOTPLUG_MAX_CONSOLES; ++i) {
+        struct hotplug_slot * slot = &slots[i];
+        if (slot_state(slot) != SLOT_FREE && slot->location.bus == location->bus &&
+            slot->location.depth == location->depth && memcmp(slot->location.ports, location->ports, (size_t)location->depth) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static void release_slot(struct hotplug_slot * slot) {
+    thread_join(slot->thread);
+    consoles_handled++;
+    consoles_succeeded += slot->result.result;
+    session_destroy(slot->session);
+    slot->session = NULL;
+    mutex_lock(&slot_lock);
+    slot->state = SLOT_FREE;
+    mutex_unlock(&slot_lock);
+}
+
+static void console_arrived(const struct usb_device_location * location) {
+    struct hotplug_slot * slot = find_slot(location);
+    if (slot != NULL) {
+        // Already being handled; it was reset, or replugged before it finished
+        slot->unplugged = 0;
+        return;
+    }
+
+    int i;
+    for (i = 0; i < HOTPLUG_MAX_CONSOLES && slot_state(&slots[i]) != SLOT_FREE; ++i);
+    if (i == HOTPLUG_MAX_CONSOLES) {
+        fprintf(stderr, "Too many consoles are plugged in; unplug one that has finished.\n");
+        return;
+    }
+    slot = &slots[i];
+
+    slot->session = session_create();
+    if (slot->session == NULL) {
+        return;
+    }
+    slot->location = *location;
+    slot->unplugged = 0;
+    usb_format_location(location, slot->label, sizeof(slot->label));
+    usb_set_device_location(slot->session, location);
+    slot->session->quiet = 1;
+
+    printf("[%s] Console plugged in; starting.\n", slot->label);
+    mutex_lock(&slot_lock);
+    slot->state = SLOT_RUNNING;
+    mutex_unlock(&slot_lock);
+    if (!thread_create(&slot->thread, hotplug_worker_run, slot)) {
+        session_destroy(slot->session);
+        slot->session = NULL;
+        mutex_lock(&slot_lock);
+        slot->state = SLOT_FREE;
+        mutex_unlock(&slot_lock);
+    }
+}
+
+static void console_left(const struct usb_device_location * location) {
+    struct hotplug_slot * slot = find_slot(location);
+    if (slot != NULL) {
+        slot->unplugged = 1;
+    }
+}
+
+/*
+    Free the slots of consoles that have finished and been unplugged.
+*/
+static void release_unplugged_slots(void) {
+    int i;
+    for (i = 0; i < HOTPLUG_MAX_CONSOLES; ++i) {
+        if (slots[i].unplugged && slot_state(&slots[i]) == SLOT_FINISHED) {
+            printf("[%s] Console unplugged.\n", slots[i].label);
+            release_slot(&slots[i]);
+        }
+    }
+}
+
+
+int hotplug_run(const char * spec) {
+    struct job_list jobs;
+    if (!job_list_parse(&jobs, spec)) {
+        return 0;
+    }
+    if (!usb_hotplug_start()) {
+        return 0;
+    }
+
+    hotplug_jobs = &jobs;
+    consoles_handled = 0;
+    consoles_succeeded = 0;
+    stop_requested = 0;
+    mutex_init(&slot_lock);
+    void (*previous_handler)(int) = signal(SIGINT, handle_interrupt);
+
+    printf("Running '%s' on each console as it is plugged in. Press Ctrl+C to stop.\n", spec);
+    fflush(stdout);
+    int success = 1;
+    while (!stop_requested) {
+        struct usb_hotplug_event events[16];
+        int count = usb_hotplug_wait(events, 16, 250);
+        if (count < 0) {
+            success = 0;
+            break;
+        }
+
+        int i;
+        for (i = 0; i < count; ++i) {
+            if (events[i].arrived) {
+                console_arrived(&events[i].location);
+            }
+            else {
+                console_left(&events[i].location);
+            }
+        }
+        release_unplugged_slots();
+    }
+
+    int i;
+    for (i = 0; i < HOTPLUG_MAX_CONSOLES; ++i) {
+        int state = slot_state(&slots[i]);
+        if (state != SLOT_FREE) {
+            if (state == SLOT_RUNNING) {
+                printf("[%s] Waiting for the console to finish...\n", slots[i].label);
+                fflush(stdout);
+            }
+            release_slot(&slots[i]);
+        }
+    }
+
+    signal(SIGINT, previous_handler == SIG_ERR ? SIG_DFL : previous_handler);
+    mutex_destroy(&slot_lock);
+    usb_hotplug_stop();
+
+    printf("\n%u of %u consoles succeeded.\n", consoles_succeeded, consoles_handled);
+    return success && (consoles_succeeded == consoles_handled);
+}
@@ -0,0 +1,32 @@
+/*
+    hotplug.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_HOTPLUG_H
+#define AULON_HOTPLUG_H
+
+#define HOTPLUG_MAX_CONSOLES 32
+
+/*
+    Run a comma-separated list of commands (see job.h) on every console
+    as it is plugged in, until interrupted with Ctrl+C. Returns 1 if the
+    commands succeeded on every console, and 0 otherwise.
+*/
+int hotplug_run(const char * spec);
+
+#endif
@@ -24,6 +24,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
 
 #include "io.h"
 
@@ -88,6 +94,23 @@ int open_file(FILE ** file, const char * filename, const char * mode) {
     }
 }
 
+/*
+    Create a directory, unless it already exists.
+*/
+int make_directory(const char * path) {
+    errno = 0;
+#ifdef _WIN32
+    int r = _mkdir(path);
+#else
+    int r = mkdir(path, 0777);
+#endif
+    if (r != 0 && errno != EEXIST) {
+        perror("Error creating directory");
+        return 0;
+    }
+    return 1;
+}
+
 size_t get_file_size(FILE * file) {
     unsigned char * buffer = calloc(0x4000, sizeof(unsigned char));
     rewind(file);
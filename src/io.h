@@ -26,6 +26,7 @@
 void print_buffer(unsigned char * buffer, unsigned int length, FILE * const outstream);
 int get_input(char * line_buffer, int buffer_length, FILE * instream);
 int open_file(FILE ** file, const char * filename, const char * mode);
+int make_directory(const char * path);
 size_t get_file_size(FILE * file);
 int file_size_check(FILE * file, size_t expected_size);
 uint32_t uchars_to_uint32(unsigned char * bytes);
@@ -0,0 +1,151 @@
+/*
+    job.c
+    running menu commands unattended on a console
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "defs.h"
+#include "session.h"
+#include "commands.h"
+#include "menu_func.h"
+#include "timer.h"
+#include "job.h"
+
+
+/*
+    Only commands that need no input from the user can run unattended.
+*/
+static int job_allowed(const char * job) {
+    switch (job[0]) {
+#if defined(AULON_WRITING_ENABLED) && (AULON_WRITING_ENABLED == 1)
+    case '2':
+#endif
+    case '1':
+    case 'X':
+    case '3':
+    case 'F':
+    case 'J':
+    case 'L':
+    case 'C':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int job_run(struct session * session, char * job) {
+    switch (job[0]) {
+#if defined(AULON_WRITING_ENABLED) && (AULON_WRITING_ENABLED == 1)
+    case '2':   return WriteNand(session, job, FILE_START);
+#endif
+    case '1':   return DumpNand(session, job);
+    case 'X':   return ReadSingleBlock(session, job);
+    case '3':   return ReadFile(session, job);
+    case 'F':   return DumpCurrentFS(session);
+    case 'J':   return SetTime(session);
+    case 'L':   return ListFiles(session);
+    case 'C':   return PrintStats(session);
+    default:    return 0;
+    }
+}
+
+
+/*
+    Split a comma-separated list of commands, e.g. "1,L" or "X 0x10,3 ique_id.dat".
+*/
+int job_list_parse(struct job_list * list, const char * spec) {
+    list->count = 0;
+    while (*spec) {
+        size_t length = strcspn(spec, ",");
+        if (list->count == JOB_LIST_MAX) {
+            fprintf(stderr, "At most %d commands can be given.\n", JOB_LIST_MAX);
+            return 0;
+        }
+        if (length == 0 || length >= JOB_LENGTH) {
+            fprintf(stderr, "Invalid command in list: %.*s\n", (int)length, spec);
+            return 0;
+        }
+
+        char * job = list->jobs[list->count];
+        memcpy(job, spec, length);
+        job[length] = '\0';
+        if (!job_allowed(job)) {
+            fprintf(stderr, "'%s' can't be run unattended.\n", job);
+            return 0;
+        }
+        list->count++;
+
+        spec += length;
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+
+    if (list->count == 0) {
+        fprintf(stderr, "No commands were given.\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+    Connect to the session's console, run each job in turn until one fails,
+    and disconnect. The session's files are kept in a directory named after
+    the console's BBID, e.g. 0123ABCD/nand.bin, so that many consoles can be
+    handled side by side.
+*/
+void job_run_on_console(struct session * session, const struct job_list * list,
+                        const char * label, struct job_result * result) {
+    uint64_t start_time = timer_now_us();
+    memset(result, 0, sizeof(*result));
+
+    policy_begin_operation(&session->policy);
+    if (!Init(session)) {
+        return;
+    }
+    result->connected = 1;
+
+    char directory[16];
+    if (!get_bbid(session, &result->bbid)) {
+        fprintf(stderr, "[%s] Could not read the console's BBID.\n", label);
+    }
+    else {
+        sprintf(directory, "%08X", result->bbid);
+        if (session_set_directory(session, directory)) {
+            int i;
+            result->result = 1;
+            for (i = 0; i < list->count && result->result; ++i) {
+                char job[JOB_LENGTH];
+                strcpy(job, list->jobs[i]);
+                policy_begin_operation(&session->policy);
+                result->result = job_run(session, job);
+                if (!result->result) {
+                    fprintf(stderr, "[%s] %08X: '%s' failed.\n", label, result->bbid, job);
+                }
+            }
+        }
+    }
+
+    result->elapsed_us = timer_now_us() - start_time;
+    usb_close_connection(session);
+}
@@ -0,0 +1,56 @@
+/*
+    job.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_JOB_H
+#define AULON_JOB_H
+
+#include <stdint.h>
+
+struct session;
+
+#define JOB_LIST_MAX 8
+#define JOB_LENGTH   32
+
+/*
+    Menu commands to be run, in order, on a console that nobody is typing
+    at (e.g. "1,L" to dump the NAND and then list the files).
+*/
+struct job_list {
+    int count;
+    char jobs[JOB_LIST_MAX][JOB_LENGTH];
+};
+
+/*
+    The outcome of running a job list on one console.
+*/
+struct job_result {
+    int connected;
+    uint32_t bbid;
+    int result;          // 1 if every job succeeded
+    uint64_t elapsed_us;
+};
+
+/*
+    job_list_parse returns 1 for success and 0 for failure.
+*/
+int job_list_parse(struct job_list * list, const char * spec);
+void job_run_on_console(struct session * session, const struct job_list * list,
+                        const char * label, struct job_result * result);
+
+#endif
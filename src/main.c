@@ -24,11 +24,17 @@
 
 #include "defs.h"
 #include "usb_log.h"
+#include "replay.h"
+#include "emulator.h"
+#include "bridge.h"
 #include "io.h"
+#include "codec.h"
+#include "policy.h"
 #include "menu.h"
 
 
 static FILE * input_file = NULL;
+static char * bridge_serve_address = NULL;
 
 
 static void close_input_file(void) {
@@ -49,17 +55,49 @@ static void parse_args(int argc, char * argv[]) {
         if (strcmp(argv[i], "-f") == 0) {
             open_input_file(argv[i + 1]);
         }
-#if defined(AULON_LOGGING_ENABLED) && (AULON_LOGGING_ENABLED == 1)
+        else if (strcmp(argv[i], "-p") == 0) {
+            if (!policy_parse(argv[i + 1])) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0) {
+            replay_set_path(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-e") == 0) {
+            emulator_set_directory(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-o") == 0) {
+            if (!emulator_parse_options(argv[i + 1])) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            bridge_set_address(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-B") == 0) {
+            bridge_serve_address = argv[i + 1];
+        }
         else if (strcmp(argv[i], "-l") == 0) {
             usb_log_set_path(argv[i + 1]);
         }
-#endif
+        else if (strcmp(argv[i], "-L") == 0) {
+            enum usb_log_level level;
+            if (!usb_log_parse_level(argv[i + 1], &level)) {
+                exit(EXIT_FAILURE);
+            }
+            usb_log_set_level(level);
+        }
     }
 }
 
 
 int main(int argc, char * argv[]) {
     parse_args(argc, argv);
+    codec_init();
+
+    if (bridge_serve_address) {
+        return bridge_serve(bridge_serve_address) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     FILE * input_source;
     if (input_file) {
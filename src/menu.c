@@ -26,22 +26,37 @@
 #include "defs.h"
 #include "io.h"
 #include "menu_func.h"
+#include "policy.h"
+#include "session.h"
 #include "menu.h"
 
 #define INPUT_BUFFER_LENGTH 64 // #define because this is used as the declared length of an array
 static const char * const version = AULON_VERSION;
 static const char * const writing = AULON_WRITING_ENABLED ? " (writing)" : "";
-static const char * const logging = AULON_LOGGING_ENABLED ? " (logging)" : "";
 
 
+static struct session * menu_session = NULL;
+
+
+static void menu_cleanup(void) {
+    session_destroy(menu_session);
+    menu_session = NULL;
+}
+
 void menu_loop(FILE * instream) {
+    menu_session = session_create();
+    if (menu_session == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    atexit(menu_cleanup);
+
     char * prompt = (instream == stdin ? "> " : "\n");
-    printf("aulon v%s%s%s\n", version, writing, logging);
+    printf("aulon v%s%s\n", version, writing);
     printf("%s", prompt);
     
     char line[INPUT_BUFFER_LENGTH] = { 0 };
     while (get_input(line, INPUT_BUFFER_LENGTH, instream)) {
-        execute_command(line);
+        execute_command(menu_session, line);
         printf("%s", prompt);
     }
 }
@@ -56,10 +71,16 @@ static void display_help(void) {
     printf("    L             - List all files currently on the console\n");
     printf("    F             - Dump the current filesystem block to 'current_fs.bin'\n");
     printf("    1             - Dump the console's NAND to 'nand.bin' and 'spare.bin'\n");
+    printf("    1 resume      - Finish a dump that was interrupted, reading only missing blocks\n");
+    printf("    1 sparse      - Dump only the SKSA, the FS, and the blocks in use by files\n");
     printf("    X blk_num     - Read one block and its spare data from the console to files\n");
 #if defined(AULON_WRITING_ENABLED) && (AULON_WRITING_ENABLED == 1)
     printf("    2             - Write partial NAND to the console from files (No SKSA)\n");
     printf("    W             - Write full NAND to the console from files (UNSAFE)\n");
+    printf("    2 diff        - Write only the blocks the console doesn't already hold\n");
+    printf("                    ('W diff' for a full write; 'diff verify' to read back a\n");
+    printf("                    sample of the blocks it holds first)\n");
+    printf("    2 sparse      - Write only the FS and the blocks nand.bin's own FS has in use\n");
     printf("    Y blk_num     - Write one block to the console from 'block_[blk_num].bin'\n");
 #endif
     printf("    3 file        - Read [file] from the console\n");
@@ -68,7 +89,18 @@ static void display_help(void) {
 //  printf("    R file        - Delete [file] from the console\n");
 #endif
     printf("    C             - Print statistics about the console's NAND\n");
-    printf("    Q             - Close USB connection to the console\n");
+    printf("    T             - Print USB transfer statistics for the current connection\n");
+    printf("    Q             - Close USB connection to the console, printing its statistics\n");
+    printf("    G level       - Set how much USB traffic is logged (off, errors, headers, or full)\n");
+    printf("    A commands    - Run [commands] on every attached console at once, keeping\n");
+    printf("                    each console's files in a directory named after its BBID\n");
+    printf("    P commands    - Wait for consoles to be plugged in and run [commands] on\n");
+    printf("                    each one as it arrives, until Ctrl+C is pressed\n");
+#if defined(AULON_WRITING_ENABLED) && (AULON_WRITING_ENABLED == 1)
+    printf("                    ([commands] is a comma-separated list of 1, X, 3, F, J, L, C, or 2)\n");
+#else
+    printf("                    ([commands] is a comma-separated list of 1, X, 3, F, J, L, or C)\n");
+#endif
     printf("\n");
     printf("    h             - Print this help (but of course you already know that)\n");
     printf("    ?             - Print copyright and licensing information\n");
@@ -77,7 +109,7 @@ static void display_help(void) {
 }
 
 static void display_info(void) {
-    printf("\naulon v%s%s%s\n", version, writing, logging);
+    printf("\naulon v%s%s\n", version, writing);
     printf("Copyright (c) 2018,2019,2020 Jbop (https://github.com/jbop1626)\n");
     printf("aulon is licensed under the GPL v3 (or any later version).\n\n");
     printf("Portions Copyright (c) 2012-2018 Mike Ryan\nOriginally released under the MIT license\n\n");
@@ -96,30 +128,35 @@ static void display_info(void) {
     printf("See the included file LIBUSB_AUTHORS.txt for more.\n\n");
 }
 
-int execute_command(char * input_line) {
+int execute_command(struct session * session, char * input_line) {
     unsigned char command = input_line[0];
     
+    policy_begin_operation(&session->policy);
     switch (command) {
 #if defined(AULON_WRITING_ENABLED) && (AULON_WRITING_ENABLED == 1)
-    case 'W':   printf("WriteNand (full) returns %d\n", WriteNand(NAND_START));                 break;
-    case '2':   printf("WriteNand (partial) returns %d\n", WriteNand(FILE_START));              break;
-    case 'Y':   printf("WriteSingleBlock returns %d\n", WriteSingleBlock(input_line));          break;
-//  case '4':   printf("WriteFile returns %u\n", WriteFile(input_line));                        break;
-//  case 'R':   printf("DeleteFile returns %u\n", DeleteFile(input_line));                      break;
+    case 'W':   printf("WriteNand (full) returns %d\n", WriteNand(session, input_line, NAND_START));    break;
+    case '2':   printf("WriteNand (partial) returns %d\n", WriteNand(session, input_line, FILE_START)); break;
+    case 'Y':   printf("WriteSingleBlock returns %d\n", WriteSingleBlock(session, input_line)); break;
+//  case '4':   printf("WriteFile returns %u\n", WriteFile(session, input_line));               break;
+//  case 'R':   printf("DeleteFile returns %u\n", DeleteFile(session, input_line));             break;
 #endif
-    case 'B':   printf("Init returns %u\n", Init());                                            break;
-    case 'I':   printf("GetBBID returns %u\n", GetBBID());                                      break;
-    case 'H':   printf("SetLED returns %u\n", SetLED(input_line));                              break;
-    case 'S':   printf("SignHash returns %u\n", SignHash(input_line));                          break;
-    case 'J':   printf("SetTime returns %u\n", SetTime());                                      break;
-    case 'K':   printf("ListFileBlocks returns %u\n", ListFileBlocks(input_line));              break;
-    case 'L':   printf("ListFiles returns %u\n", ListFiles());                                  break;
-    case 'F':   printf("DumpCurrentFS returns %u\n", DumpCurrentFS());                          break;
-    case '1':   printf("DumpNand returns %u\n", DumpNand());                                    break;
-    case 'X':   printf("ReadSingleBlock returns %d\n", ReadSingleBlock(input_line));            break;
-    case '3':   printf("ReadFile returns %u\n", ReadFile(input_line));                          break;
-    case 'C':   printf("PrintStats returns %u\n", PrintStats());                                break;
-    case 'Q':   printf("Close returns %u\n", Close());                                          break;
+    case 'B':   printf("Init returns %u\n", Init(session));                                     break;
+    case 'I':   printf("GetBBID returns %u\n", GetBBID(session));                               break;
+    case 'H':   printf("SetLED returns %u\n", SetLED(session, input_line));                     break;
+    case 'S':   printf("SignHash returns %u\n", SignHash(session, input_line));                 break;
+    case 'J':   printf("SetTime returns %u\n", SetTime(session));                               break;
+    case 'K':   printf("ListFileBlocks returns %u\n", ListFileBlocks(session, input_line));     break;
+    case 'L':   printf("ListFiles returns %u\n", ListFiles(session));                           break;
+    case 'F':   printf("DumpCurrentFS returns %u\n", DumpCurrentFS(session));                   break;
+    case '1':   printf("DumpNand returns %u\n", DumpNand(session, input_line));                 break;
+    case 'X':   printf("ReadSingleBlock returns %d\n", ReadSingleBlock(session, input_line));   break;
+    case '3':   printf("ReadFile returns %u\n", ReadFile(session, input_line));                 break;
+    case 'C':   printf("PrintStats returns %u\n", PrintStats(session));                         break;
+    case 'T':   printf("TransferStats returns %u\n", TransferStats(session));                   break;
+    case 'G':   printf("LogLevel returns %u\n", LogLevel(session, input_line));                 break;
+    case 'Q':   printf("Close returns %u\n", Close(session));                                   break;
+    case 'A':   printf("Farm returns %u\n", Farm(session, input_line));                         break;
+    case 'P':   printf("Hotplug returns %u\n", Hotplug(session, input_line));                   break;
     case 'h':   display_help();                                                                 break;
     case '?':   display_info();                                                                 break;
     case 'q':   exit(EXIT_SUCCESS);                                                             break;
@@ -20,8 +20,12 @@
 #ifndef AULON_MENU_H
 #define AULON_MENU_H
 
+#include <stdio.h>
+
+struct session;
+
 void menu_loop(FILE * instream);
-int execute_command(char * input_line);
+int execute_command(struct session * session, char * input_line);
 
 #endif
 
@@ -27,61 +27,88 @@
 #include <time.h>
 
 #include "usb.h"
+#include "usb_log.h"
 #include "player_comms.h"
 #include "commands.h"
 #include "io.h"
 #include "fs.h"
+#include "timer.h"
+#include "session.h"
+#include "stats.h"
+#include "block_stream.h"
+#include "nand_image.h"
+#include "dump_journal.h"
+#include "dump_manifest.h"
+#include "console_hashes.h"
+#include "farm.h"
+#include "hotplug.h"
 #include "menu_func.h"
 
 
-static int dump_nand_and_spare_to_files(FILE * nand_file, FILE * spare_file);
+static int dump_nand_and_spare_to_image(struct session * session, struct nand_image * image,
+                                        struct dump_journal * journal, struct dump_manifest * manifest,
+                                        int sparse, unsigned int * blocks_read);
+
+struct nand_write_options;
 
 static int get_unsafe_write_confirmation(void);
-static int open_and_check_files(FILE * nand_file, FILE * spare_file);
-static int write_nand_and_spare_to_player(FILE * nand_file, FILE * spare_file, int block_start);
+static int open_and_check_files(struct session * session, FILE ** nand_file, FILE ** spare_file);
+static int read_image_fs(FILE * nand_file, unsigned char * fs);
+static int write_nand_and_spare_to_player(struct session * session, FILE ** nand_file, FILE ** spare_file,
+                                          const struct nand_write_options * options);
+static void check_console_hashes(struct session * session, struct console_hashes * console, int block_start);
 static int reading_files_failed(FILE * nand_file,  unsigned char * block_buffer,
                                 FILE * spare_file, unsigned char * spare_buffer);
 
-static int save_single_block(unsigned char * block, unsigned char * spare, uint32_t block_num);
-static int send_single_block(unsigned char * block, uint32_t block_num);
+static int save_single_block(struct session * session, unsigned char * block, unsigned char * spare, uint32_t block_num);
+static int send_single_block(struct session * session, unsigned char * block, uint32_t block_num);
 
 static int read_hash_from_file(unsigned char * hash, char * hash_filename);
 static void print_hash_and_sig(unsigned char * hash, unsigned char * sig);
 
 static int prepare_time_data(uint32_t * first_half, unsigned char * second_half);
 
+static void print_ready_stats(struct session * session, unsigned int blocks);
+static struct console_hashes * load_console_hashes(struct session * session);
+static void remember_dumped_image(struct session * session, const struct dump_manifest * manifest);
+static void remember_written_block(struct session * session, uint32_t block_num,
+                                   const unsigned char * block, const unsigned char * spare);
+
 
-int Init(void) {
-    if (usb_handle_exists()) {
+int Init(struct session * session) {
+    if (usb_handle_exists(session)) {
         fprintf(stderr, "A device is already connected.\nCall Close (Q) to disconnect, and try again.\n\n");
         return 0;
     }
     
     int success = 1;
-    if (!usb_init_connection()) {
+    session->bbid_known = 0;
+    if (!usb_init_connection(session)) {
         success = 0;
     }
-    else if (!set_seqno(0x0001)) {
+    else if (!set_seqno(session, 0x0001)) {
         success = 0;
     }
-    else if (!get_num_blocks()) {
+    else if (!get_num_blocks(session)) {
         success = 0;
     }
-    else if (!get_current_fs()) {
+    else if (!get_current_fs(session)) {
         success = 0;
     }
-    else if (!init_fs()) {
+    else if (!init_fs(session)) {
         success = 0;
     }
-    else if (!delete_file_and_update("temp.tmp")) {
+    else if (!delete_file_and_update(session, "temp.tmp")) {
         success = 0;
     }
 
     if (success) {
-        printf("Connection to the device was initialized successfully.\n");      
+        if (!session->quiet) {
+            printf("Connection to the device was initialized successfully.\n");
+        }
     }
     else {
-        usb_close_connection();
+        usb_close_connection(session);
         fprintf(stderr, "Failed to establish a USB connection to the device.\n");
     }
 
@@ -90,22 +117,22 @@ int Init(void) {
 
 
 
-int GetBBID(void) {
-    if (!usb_handle_exists()) {
+int GetBBID(struct session * session) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
 
     uint32_t BBID = 0;
-    int r = get_bbid(&BBID);
+    int r = get_bbid(session, &BBID);
     printf("BBID returned by the console is %04x.\n", BBID);
     return r;
 }
 
 
 
-int SetLED(char * line) {
-    if (!usb_handle_exists()) {
+int SetLED(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
@@ -119,13 +146,13 @@ int SetLED(char * line) {
         return 0;
     }
 
-    return set_led((uint32_t) input);
+    return set_led(session, (uint32_t) input);
 }
 
 
 
-int SignHash(char * line) {
-    if (!usb_handle_exists()) {
+int SignHash(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
@@ -142,7 +169,7 @@ int SignHash(char * line) {
         return 0;
     }
     
-    if (!sign_hash(hash, sig)) {
+    if (!sign_hash(session, hash, sig)) {
         fprintf(stderr, "Signing hash failed.\n");
         return 0;
     }
@@ -177,8 +204,8 @@ static void print_hash_and_sig(unsigned char * hash, unsigned char * sig) {
 
 
 
-int SetTime(void) {
-    if (!usb_handle_exists()) {
+int SetTime(struct session * session) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. No connection is open.\n");
         return 0;
     }
@@ -189,7 +216,7 @@ int SetTime(void) {
         return 0;
     }
     
-    return set_time(time_data_first_half, time_data_second_half);
+    return set_time(session, time_data_first_half, time_data_second_half);
 }
 
 static int prepare_time_data(uint32_t * first_half, unsigned char * second_half) {
@@ -219,8 +246,8 @@ static int prepare_time_data(uint32_t * first_half, unsigned char * second_half)
 
 
 
-int ListFileBlocks(char * line) {
-    if (!usb_handle_exists()) {
+int ListFileBlocks(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
@@ -228,90 +255,312 @@ int ListFileBlocks(char * line) {
         return 0;
     }
 
-    return list_file_blocks(line + 2);
+    return list_file_blocks(session, line + 2);
 }
 
 
 
-int ListFiles(void) {
-    if (!usb_handle_exists()) {
+int ListFiles(struct session * session) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
 
-    list_files();
+    list_files(session);
     return 1;
 }
 
 
 
-int DumpCurrentFS(void) {
-    if (!usb_handle_exists()) {
+int DumpCurrentFS(struct session * session) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
 
-    return dump_current_fs();
+    return dump_current_fs(session);
 }
 
 
 
-int DumpNand(void) {
-    if(!usb_handle_exists()) {
+/*
+    "1" dumps the whole NAND into new files. "1 resume" keeps the files
+    (and journal) left by an earlier dump that didn't finish, and reads only
+    the blocks it hadn't read yet, or that don't match what it read.
+    "1 sparse" reads only the SKSA, the FS blocks, and the blocks the
+    current FS has in use, leaving the rest as holes in the files; its
+    journal is kept, so "1 resume" can fill in the holes later.
+*/
+int DumpNand(struct session * session, char * line) {
+    if(!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
+    enum nand_image_mode mode = NAND_IMAGE_CREATE;
+    if (strlen(line) > 2) {
+        if (strcmp(line + 2, "resume") == 0) {
+            mode = NAND_IMAGE_KEEP;
+        }
+        else if (strcmp(line + 2, "sparse") == 0) {
+            mode = NAND_IMAGE_SPARSE;
+        }
+        else {
+            fprintf(stderr, "Unknown dump mode %s (expected resume or sparse).\n", line + 2);
+            return 0;
+        }
+    }
     
-    FILE * nand_file = NULL;
-    FILE * spare_file = NULL;
-    if (!open_file(&spare_file, "spare.bin", "wb")) {
+    char nand_path[FILENAME_MAX];
+    char spare_path[FILENAME_MAX];
+    char journal_path[FILENAME_MAX];
+    char manifest_path[FILENAME_MAX];
+    if (!session_file_path(session, nand_path, "nand.bin") ||
+        !session_file_path(session, spare_path, "spare.bin") ||
+        !session_file_path(session, journal_path, "nand.journal") ||
+        !session_file_path(session, manifest_path, "nand.manifest")) {
         return 0;
     }
-    if (!open_file(&nand_file, "nand.bin", "wb")) {
-        fclose(spare_file);
+    struct nand_image * image = nand_image_open(nand_path, spare_path, mode);
+    if (image == NULL) {
         return 0;
     }
-    if (!dump_nand_and_spare_to_files(nand_file, spare_file)) {
-        fclose(nand_file);
-        fclose(spare_file);
+    struct dump_journal * journal = dump_journal_open(journal_path, mode == NAND_IMAGE_KEEP);
+    if (journal == NULL) {
+        nand_image_close(image);
+        return 0;
+    }
+    struct dump_manifest * manifest = dump_manifest_create(image);
+    if (manifest == NULL) {
+        dump_journal_close(journal, 0);
+        nand_image_close(image);
         return 0;
     }
+    ique_reset_ready_stats(session);
+    uint64_t start_time = timer_now_us();
+    unsigned int blocks_read = 0;
+    int dumped = dump_nand_and_spare_to_image(session, image, journal, manifest, mode == NAND_IMAGE_SPARSE, &blocks_read);
+    if (dumped) {
+        dumped = dump_manifest_save(manifest, manifest_path);
+        remember_dumped_image(session, manifest);
+    }
+    dump_manifest_free(manifest);
+    // Once the dump is complete the journal has served its purpose, unless it was
+    // sparse: then it is kept so that "1 resume" reads only the blocks skipped
+    int closed = dump_journal_close(journal, dumped && mode != NAND_IMAGE_SPARSE);
+    closed = nand_image_close(image) && closed;
+    if (!closed || !dumped) {
+        if (!dumped && blocks_read > 0) {
+            fprintf(stderr, "%u blocks were read. Use \"1 resume\" to read the rest.\n", blocks_read);
+        }
+        return 0;
+    }
+    double seconds = (timer_now_us() - start_time) / 1000000.0;
 
-    fclose(nand_file);
-    fclose(spare_file);
-    printf("\nNAND dump complete!\n");
+    if (!session->quiet) {
+        printf("\nNAND dump complete!\n");
+        if (blocks_read > 0) {
+            printf("%.1f seconds (%.1f KiB/s)\n", seconds, (blocks_read * (BLOCK_SIZE + SPARE_SIZE) / 1024.0) / seconds);
+            print_ready_stats(session, blocks_read);
+        }
+    }
     return 1;
 }
 
-static int dump_nand_and_spare_to_files(FILE * nand_file, FILE * spare_file) {
-    unsigned char block_buffer[BLOCK_SIZE] = { 0 };
-    unsigned char spare_buffer[SPARE_SIZE] = { 0 };
+/*
+    The dump is pipelined: this thread only reads blocks from the console,
+    into a block stream, while they are stored in the image, recorded in
+    the journal and hashed for the manifest on threads of their own, and
+    progress is printed on another.
+*/
+struct dump_progress {
+    unsigned int read;
+    unsigned int total;
+};
 
-    printf("Reading NAND and spare blocks from the console...\n");
-    printf("Blocks read: %.4d (%.2f%%).", 0, 0.0);
-    int blk_no;
+static int store_dumped_block(void * context, const struct block_buffer * buffer) {
+    return nand_image_store(context, buffer->block_number, buffer->block, buffer->spare);
+}
+
+static int record_dumped_block(void * context, const struct block_buffer * buffer) {
+    return dump_journal_record(context, buffer->block_number, buffer->block, buffer->spare);
+}
+
+static int hash_dumped_block(void * context, const struct block_buffer * buffer) {
+    return dump_manifest_add(context, buffer->block_number, buffer->block, buffer->spare);
+}
+
+static int finish_dump_hashes(void * context, int complete) {
+    return !complete || dump_manifest_finish(context);
+}
+
+static int print_dump_progress(void * context, const struct block_buffer * buffer) {
+    struct dump_progress * progress = context;
+    (void)buffer;
+    ++progress->read;
+    printf("\rBlocks read: %.4u (%.2f%%).", progress->read, (progress->read / (double)progress->total) * 100.0);
+    fflush(stdout);
+    return 1;
+}
+
+static int dump_nand_and_spare_to_image(struct session * session, struct nand_image * image,
+                                        struct dump_journal * journal, struct dump_manifest * manifest,
+                                        int sparse, unsigned int * blocks_read) {
+    // Blocks a resumed dump already has are skipped, as are blocks a sparse dump has no use for
+    unsigned char needed[NUM_BLOCKS];
+    unsigned int needed_count = 0;
+    unsigned int unused_count = 0;
+    uint32_t blk_no;
     for (blk_no = 0; blk_no < NUM_BLOCKS; ++blk_no) {
-        if (read_block_spare(block_buffer, spare_buffer, blk_no)) {
-            fwrite(block_buffer, sizeof(block_buffer[0]), BLOCK_SIZE, nand_file);
-            fwrite(spare_buffer, sizeof(spare_buffer[0]), SPARE_SIZE, spare_file);
-            fflush(nand_file);
-            fflush(spare_file);
-            printf("\rBlocks read: %.4d (%.2f%%).", blk_no + 1, ((blk_no + 1) / 4096.0) * 100.0);
-            fflush(stdout);
+        if (sparse && blk_no >= FILE_START && blk_no < FS_BLOCKS_START &&
+            !fs_block_in_use(session->fs.current_fs, blk_no)) {
+            dump_manifest_skip(manifest, blk_no);
+            needed[blk_no] = 0;
+            ++unused_count;
         }
         else {
+            needed[blk_no] = !dump_journal_block_done(journal, image, blk_no);
+        }
+        needed_count += needed[blk_no];
+    }
+    if (!session->quiet) {
+        if (unused_count > 0) {
+            printf("%u blocks are free or bad, and will be skipped.\n", unused_count);
+        }
+        else if (needed_count < NUM_BLOCKS) {
+            printf("%u blocks were already read; reading the remaining %u.\n", NUM_BLOCKS - needed_count, needed_count);
+        }
+    }
+
+    struct dump_progress progress_count = { 0, needed_count };
+    struct block_consumer writer = { store_dumped_block, NULL, image };
+    struct block_consumer recorder = { record_dumped_block, NULL, journal };
+    struct block_consumer hasher = { hash_dumped_block, finish_dump_hashes, manifest };
+    struct block_consumer progress = { print_dump_progress, NULL, &progress_count };
+    struct block_stream * stream = block_stream_create();
+    if (stream == NULL) {
+        return 0;
+    }
+    if (!block_stream_attach(stream, &writer) ||
+        !block_stream_attach(stream, &recorder) ||
+        !block_stream_attach(stream, &hasher) ||
+        (!session->quiet && !block_stream_attach(stream, &progress)) ||
+        !block_stream_start(stream)) {
+        block_stream_destroy(stream);
+        return 0;
+    }
+
+    if (!session->quiet) {
+        printf("Reading NAND and spare blocks from the console...\n");
+        printf("Blocks read: %.4d (%.2f%%).", 0, 0.0);
+    }
+    int complete = 1;
+    for (blk_no = 0; blk_no < NUM_BLOCKS; ++blk_no) {
+        if (!needed[blk_no]) {
+            continue;
+        }
+        // Only time spent waiting for the writer to catch up holds up the console
+        uint64_t wait_start = timer_now_us();
+        struct block_buffer * buffer = block_stream_acquire(stream);
+        stats_record_disk(&session->stats, wait_start);
+        if (buffer == NULL) {
+            complete = 0;
+            break;
+        }
+        if (!read_block_spare(session, buffer->block, buffer->spare, blk_no)) {
             fprintf(stderr, "Error reading block while dumping NAND from the console.\n");
-            return 0;
+            complete = 0;
+            break;
         }
+        buffer->block_number = blk_no;
+        block_stream_publish(stream);
+        ++*blocks_read;
     }
 
-    return 1;
+    int success = block_stream_finish(stream, complete);
+    block_stream_destroy(stream);
+    return success;
 }
 
 
 
-int ReadSingleBlock(char * line) {
-    if (!usb_handle_exists()) {
+/*
+    Round trips spent polling the console for READY signals, so the latency
+    they add to each block can be measured, and the READY signals that
+    arrived without a poll: early ones that saved a poll, and extra ones
+    that were dropped.
+*/
+static void print_ready_stats(struct session * session, unsigned int blocks) {
+    struct ique_ready_stats stats;
+    ique_get_ready_stats(session, &stats);
+    printf("READY polls: %lu (%lu wasted), %.2f per block; unpolled READY signals: %lu used, %lu dropped\n",
+           stats.polls, stats.wasted_polls, (double)stats.polls / blocks,
+           stats.polls_avoided, stats.ready_signals_dropped);
+}
+
+/*
+    Each console's block hashes are kept in its session's directory, in
+    a file named after its BBID. The console is only asked for its BBID if
+    it hasn't been already on this connection.
+*/
+static struct console_hashes * load_console_hashes(struct session * session) {
+    uint32_t bbid = session->bbid;
+    if (!session->bbid_known && !get_bbid(session, &bbid)) {
+        fprintf(stderr, "Could not read the console's BBID.\n");
+        return NULL;
+    }
+    char filename[32];
+    char path[FILENAME_MAX];
+    sprintf(filename, "console_%08X.hashes", bbid);
+    if (!session_file_path(session, path, filename)) {
+        return NULL;
+    }
+    return console_hashes_load(path);
+}
+
+/*
+    After a complete dump, the image is exactly what the console holds,
+    apart from any blocks a sparse dump skipped. Failing to record that
+    only costs a later differential write its shortcut, so it isn't an
+    error.
+*/
+static void remember_dumped_image(struct session * session, const struct dump_manifest * manifest) {
+    struct console_hashes * console = load_console_hashes(session);
+    if (console == NULL) {
+        fprintf(stderr, "The console's block hashes were not updated.\n");
+        return;
+    }
+    uint32_t blk_no;
+    for (blk_no = 0; blk_no < NUM_BLOCKS; ++blk_no) {
+        const struct block_hashes * hashes = dump_manifest_block_hashes(manifest, blk_no);
+        if (hashes != NULL) {
+            console_hashes_set(console, blk_no, hashes);
+        }
+        else {
+            console_hashes_forget(console, blk_no);
+        }
+    }
+    console_hashes_save(console);
+    console_hashes_free(console);
+}
+
+static void remember_written_block(struct session * session, uint32_t block_num,
+                                   const unsigned char * block, const unsigned char * spare) {
+    struct console_hashes * console = load_console_hashes(session);
+    if (console == NULL) {
+        fprintf(stderr, "The console's block hashes were not updated.\n");
+        return;
+    }
+    struct block_hashes hashes;
+    hash_block_and_spare(block, spare, &hashes);
+    console_hashes_set(console, block_num, &hashes);
+    console_hashes_save(console);
+    console_hashes_free(console);
+}
+
+
+
+int ReadSingleBlock(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
@@ -329,7 +578,7 @@ int ReadSingleBlock(char * line) {
     unsigned char * block = calloc(BLOCK_SIZE, sizeof(unsigned char));
     unsigned char * spare = calloc(SPARE_SIZE, sizeof(unsigned char));
     if (block != NULL && spare != NULL) {
-        success = save_single_block(block, spare, (uint32_t)block_num);
+        success = save_single_block(session, block, spare, (uint32_t)block_num);
     }
     
     free(block);
@@ -337,8 +586,8 @@ int ReadSingleBlock(char * line) {
     return success;
 }
 
-static int save_single_block(unsigned char * block, unsigned char * spare, uint32_t block_num) {
-    if (!read_block_spare(block, spare, block_num)) {
+static int save_single_block(struct session * session, unsigned char * block, unsigned char * spare, uint32_t block_num) {
+    if (!read_block_spare(session, block, spare, block_num)) {
         fprintf(stderr, "Could not read single block!\n");
         return 0;        
     }
@@ -351,11 +600,11 @@ static int save_single_block(unsigned char * block, unsigned char * spare, uint3
         strcat(spare_fn, num);
         
         FILE * block_file = NULL;
-        if (!open_file(&block_file, block_fn, "wb")) {
+        if (!session_open_file(session, &block_file, block_fn, "wb")) {
             return 0;
         }
         FILE * spare_file = NULL;
-        if (!open_file(&spare_file, spare_fn, "wb")) {
+        if (!session_open_file(session, &spare_file, spare_fn, "wb")) {
             fclose(block_file);
             return 0;
         }
@@ -370,11 +619,46 @@ static int save_single_block(unsigned char * block, unsigned char * spare, uint3
 
 
 
-int WriteNand(int block_start) {
-    if (!usb_handle_exists()) {
+/*
+    "2" and "W" write every block from block_start on. With "diff" (e.g.
+    "2 diff"), blocks the console is known to hold already, from its last
+    dump or write, are skipped; "diff verify" first reads back a sample of
+    the blocks that are known, and writes everything if any of them has
+    changed behind aulon's back. With "sparse", only the blocks that the
+    newest FS in nand.bin itself has in use are written, along with the FS
+    blocks (and the SKSA for "W").
+*/
+struct nand_write_options {
+    int block_start;
+    struct console_hashes * console;  // NULL if the console's block hashes couldn't be loaded
+    int differential;
+    const unsigned char * image_fs;   // the FS from nand.bin, for a sparse write; NULL otherwise
+};
+
+int WriteNand(struct session * session, char * line, int block_start) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
+    int differential = 0;
+    int verify = 0;
+    int sparse = 0;
+    if (strlen(line) > 2) {
+        if (strcmp(line + 2, "diff") == 0) {
+            differential = 1;
+        }
+        else if (strcmp(line + 2, "diff verify") == 0) {
+            differential = 1;
+            verify = 1;
+        }
+        else if (strcmp(line + 2, "sparse") == 0) {
+            sparse = 1;
+        }
+        else {
+            fprintf(stderr, "Unknown write mode %s (expected diff, diff verify or sparse).\n", line + 2);
+            return 0;
+        }
+    }
 
     // If doing an unsafe write, make sure the user definitely wants it.
     if (block_start == NAND_START) {
@@ -384,24 +668,59 @@ int WriteNand(int block_start) {
         }
     }
 
+    // A plain write can go ahead without them, but then the console's hashes can't be kept up to date.
+    // It only keeps them up to date if something is known, so it needn't hash every block otherwise.
+    struct console_hashes * console = load_console_hashes(session);
+    if (console == NULL) {
+        if (differential) {
+            return 0;
+        }
+        fprintf(stderr, "The console's block hashes will not be updated.\n");
+    }
+    else if (!differential && console_hashes_empty(console)) {
+        console_hashes_free(console);
+        console = NULL;
+    }
+    else if (verify) {
+        check_console_hashes(session, console, block_start);
+    }
+
     int success = 1;
     FILE * nand_file = NULL;
     FILE * spare_file = NULL;
+    unsigned char * image_fs = NULL;
+    struct nand_write_options options = { block_start, console, differential, NULL };
     
-    if (!open_and_check_files(&nand_file, &spare_file)) {
+    ique_reset_ready_stats(session);
+    if (!open_and_check_files(session, &nand_file, &spare_file)) {
         success = 0;
     }
-    else if (!write_nand_and_spare_to_player(&nand_file, &spare_file, block_start)) {
+    else if (sparse && ((image_fs = malloc(BLOCK_SIZE)) == NULL || !read_image_fs(nand_file, image_fs))) {
+        fprintf(stderr, "Could not find a valid FS in nand.bin to write sparsely from.\n");
         success = 0;
     }
+    else {
+        options.image_fs = image_fs;
+        success = write_nand_and_spare_to_player(session, &nand_file, &spare_file, &options);
+    }
+    free(image_fs);
 
-    if (fclose(nand_file) || fclose(spare_file)) {
+    // Either file may not have been opened, e.g. if a farm console's directory has no nand.bin
+    if ((nand_file && fclose(nand_file)) || (spare_file && fclose(spare_file))) {
         fprintf(stderr, "Error closing file!\nThe actual write of the NAND file to the console likely succeeded, however.\n");
         success = 0;
     }
+    // Saved even after a failure, to keep what was written before it
+    if (console != NULL) {
+        console_hashes_save(console);
+        console_hashes_free(console);
+    }
     
     if (success) {
-        printf("\nNAND write complete!\n");
+        if (!session->quiet) {
+            printf("\nNAND write complete!\n");
+            print_ready_stats(session, NUM_BLOCKS - block_start);
+        }
     } else {
         fprintf(stderr, "\nNAND write failed.\n");
     }
@@ -418,9 +737,9 @@ static int get_unsafe_write_confirmation(void) {
     return (tolower(line[0]) == 'y');
 }
 
-static int open_and_check_files(FILE ** nand_file, FILE ** spare_file) {
-    if (!open_file(spare_file, "spare.bin", "rb") || 
-        !open_file(nand_file, "nand.bin", "rb")) {
+static int open_and_check_files(struct session * session, FILE ** nand_file, FILE ** spare_file) {
+    if (!session_open_file(session, spare_file, "spare.bin", "rb") || 
+        !session_open_file(session, nand_file, "nand.bin", "rb")) {
         return 0;
     }
 
@@ -437,11 +756,44 @@ static int open_and_check_files(FILE ** nand_file, FILE ** spare_file) {
     return 1;
 }
 
-static int write_nand_and_spare_to_player(FILE ** nand_file, FILE ** spare_file, int block_start) {
+/*
+    The newest of the FS blocks in nand.bin (the one with the highest
+    seqno), chosen the same way get_current_fs chooses the console's.
+    Returns 0 if none of them has ever been written.
+*/
+static int read_image_fs(FILE * nand_file, unsigned char * fs) {
+    unsigned char * block = malloc(BLOCK_SIZE);
+    if (block == NULL) {
+        return 0;
+    }
+    uint32_t current_seqno = 0;
+    uint32_t blk_no;
+    for (blk_no = NUM_BLOCKS - 1; blk_no >= FS_BLOCKS_START; --blk_no) {
+        if (fseek(nand_file, (long)blk_no * BLOCK_SIZE, SEEK_SET) != 0 ||
+            fread(block, sizeof(block[0]), BLOCK_SIZE, nand_file) != BLOCK_SIZE) {
+            current_seqno = 0;
+            break;
+        }
+        uint32_t seqno = fs_get_seqno(block);
+        if (seqno > current_seqno) {
+            memcpy(fs, block, BLOCK_SIZE);
+            current_seqno = seqno;
+        }
+    }
+    free(block);
+    return (current_seqno != 0);
+}
+
+static int write_nand_and_spare_to_player(struct session * session, FILE ** nand_file, FILE ** spare_file,
+                                          const struct nand_write_options * options) {
     unsigned char block_buffer[BLOCK_SIZE] = { 0 };
     unsigned char spare_buffer[SPARE_SIZE] = { 0 };
+    int block_start = options->block_start;
+    struct console_hashes * console = options->console;
     double limit = NUM_BLOCKS - block_start;
     int blocks_written = 0;
+    int blocks_skipped = 0;
+    int blocks_unused = 0;
 
     if (fseek(*nand_file,  block_start * BLOCK_SIZE, SEEK_SET) != 0 || 
         fseek(*spare_file, block_start * SPARE_SIZE, SEEK_SET) != 0 ) {
@@ -449,28 +801,116 @@ static int write_nand_and_spare_to_player(FILE ** nand_file, FILE ** spare_file,
         return 0;
     }
 
-    printf("Writing NAND and spare blocks to the console...\n");
-    printf("Blocks written: %.4d (%.2f%%).", 0, 0.0);
+    if (!session->quiet) {
+        printf("Writing NAND and spare blocks to the console...\n");
+        printf("Blocks written: %.4d (%.2f%%).", 0, 0.0);
+    }
     int blk_no;
     for (blk_no = block_start; blk_no < NUM_BLOCKS; ++blk_no) {
+        uint64_t read_start = timer_now_us();
         if (reading_files_failed(*nand_file, block_buffer, *spare_file, spare_buffer)) {
             fprintf(stderr, "Could not read data from NAND or spare files. Aborting NAND write.\n");
             return 0;
         }
-        if (write_block_spare(block_buffer, spare_buffer, blk_no)) {
-            blocks_written = (blk_no + 1) - block_start;
-            printf("\rBlocks written: %.4d (%.2f%%).", blocks_written, (blocks_written / limit) * 100.0);
-            fflush(stdout);
+        stats_record_disk(&session->stats, read_start);
+
+        // Only needed to skip blocks or to keep the console's hashes up to date
+        struct block_hashes hashes;
+        if (console != NULL) {
+            hash_block_and_spare(block_buffer, spare_buffer, &hashes);
+        }
+        if (options->image_fs != NULL && blk_no >= FILE_START && blk_no < FS_BLOCKS_START &&
+            !fs_block_in_use(options->image_fs, blk_no)) {
+            ++blocks_unused;
+        }
+        else if (options->differential && console_hashes_match(console, blk_no, &hashes)) {
+            ++blocks_skipped;
+        }
+        else if (write_block_spare(session, block_buffer, spare_buffer, blk_no)) {
+            // A block marked bad isn't actually written, so the console still holds what it did
+            if (console != NULL && !spare_marks_bad_block(spare_buffer)) {
+                console_hashes_set(console, blk_no, &hashes);
+            }
         }
         else {
+            // The block may have been partly written
+            if (console != NULL) {
+                console_hashes_forget(console, blk_no);
+            }
             fprintf(stderr, "Error writing block while writing NAND to the console.\n");
             return 0;
         }
+        blocks_written = (blk_no + 1) - block_start;
+        if (!session->quiet) {
+            printf("\rBlocks written: %.4d (%.2f%%).", blocks_written, (blocks_written / limit) * 100.0);
+            fflush(stdout);
+        }
     }
 
+    if (options->differential && !session->quiet) {
+        printf("\n%d of %d blocks were already up to date and were skipped.", blocks_skipped, (int)limit);
+    }
+    if (options->image_fs != NULL && !session->quiet) {
+        printf("\n%d of %d blocks are free or bad in nand.bin's FS and were skipped.", blocks_unused, (int)limit);
+    }
     return 1;
 }
 
+/*
+    Read back an evenly spaced sample of the blocks the console is known
+    to hold, and if any has changed (e.g. it was written by something other
+    than aulon), forget everything that is known, so that every block is
+    written. Only block data is compared, since the console may fill in
+    spare bytes (like ECC) differently from what was written.
+*/
+#define CONSOLE_HASHES_SAMPLE 16
+
+static void check_console_hashes(struct session * session, struct console_hashes * console, int block_start) {
+    int known = 0;
+    int blk_no;
+    for (blk_no = block_start; blk_no < NUM_BLOCKS; ++blk_no) {
+        known += console_hashes_get(console, blk_no) != NULL;
+    }
+    if (known == 0) {
+        return;
+    }
+
+    unsigned char * block = malloc(BLOCK_SIZE);
+    unsigned char spare[SPARE_SIZE];
+    if (block == NULL) {
+        fprintf(stderr, "Could not allocate memory to check the console's blocks.\n");
+        return;
+    }
+    // Rounded up, so no more than CONSOLE_HASHES_SAMPLE blocks are read back
+    int step = (known + CONSOLE_HASHES_SAMPLE - 1) / CONSOLE_HASHES_SAMPLE;
+    int changed = 0;
+    int checked = 0;
+    int index = 0;
+    for (blk_no = block_start; blk_no < NUM_BLOCKS && !changed; ++blk_no) {
+        if (console_hashes_get(console, blk_no) == NULL || index++ % step != 0) {
+            continue;
+        }
+        if (!read_block_spare(session, block, spare, blk_no)) {
+            fprintf(stderr, "Could not read back block 0x%04x.\n", blk_no);
+            changed = 1;
+            break;
+        }
+        changed = hash_xxh64(block, BLOCK_SIZE, 0) != console_hashes_get(console, blk_no)->block;
+        ++checked;
+    }
+    free(block);
+
+    if (changed) {
+        fprintf(stderr, "The console no longer holds what was last written to it or dumped; writing every block.\n");
+        for (blk_no = block_start; blk_no < NUM_BLOCKS; ++blk_no) {
+            console_hashes_forget(console, blk_no);
+        }
+    }
+    else if (!session->quiet) {
+        printf("%d sampled blocks matched their recorded hashes.\n", checked);
+    }
+}
+
 static int reading_files_failed(FILE * nand_file, unsigned char * block_buffer, FILE * spare_file, unsigned char * spare_buffer) {
     int read_block_fail = (fread(block_buffer, sizeof(block_buffer[0]), BLOCK_SIZE, nand_file) != BLOCK_SIZE);
     int read_spare_fail = (fread(spare_buffer, sizeof(spare_buffer[0]), SPARE_SIZE, spare_file) != SPARE_SIZE);
@@ -479,8 +919,8 @@ static int reading_files_failed(FILE * nand_file, unsigned char * block_buffer,
 
 
 
-int WriteSingleBlock(char * line) {
-    if (!usb_handle_exists()) {
+int WriteSingleBlock(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
@@ -497,7 +937,7 @@ int WriteSingleBlock(char * line) {
     int success = 0;
     unsigned char * block = calloc(BLOCK_SIZE, sizeof(unsigned char));
     if (block != NULL) {
-        success = send_single_block(block, (uint32_t)block_num);
+        success = send_single_block(session, block, (uint32_t)block_num);
     }
     
     free(block);
@@ -511,7 +951,7 @@ static int get_single_block_write_confirmation(const char * num) {
     return (tolower(line[0]) == 'y');
 }
 
-static int send_single_block(unsigned char * block, uint32_t block_num) {
+static int send_single_block(struct session * session, unsigned char * block, uint32_t block_num) {
     char num[5] = { 0 };
     sprintf(num, "%04X", block_num & 0xFFFF);
     if (!get_single_block_write_confirmation(num)) {
@@ -523,7 +963,7 @@ static int send_single_block(unsigned char * block, uint32_t block_num) {
     strcat(block_fn, num);
     
     FILE * block_file = NULL;
-    if (!open_file(&block_file, block_fn, "rb")) {
+    if (!session_open_file(session, &block_file, block_fn, "rb")) {
         return 0;
     }
     
@@ -534,76 +974,134 @@ static int send_single_block(unsigned char * block, uint32_t block_num) {
     
     unsigned char spare[SPARE_SIZE] = { 0 };
     memset(spare, 0xFF, SPARE_SIZE * sizeof(spare[0]));
-    if (!write_block_spare(block, spare, block_num)) {
+    if (!write_block_spare(session, block, spare, block_num)) {
         fprintf(stderr, "Could not write single block!\n");
         return 0;
     }
+    remember_written_block(session, block_num, block, spare);
     printf("Single block successfully written to the console!\n");
     return 1;
 }
 
 
 
-int ReadFile(char * line) {
-    if (!usb_handle_exists()) {
+int ReadFile(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
     if (strlen(line) < 3) {
         return 0;
     }
-    return read_file(line + 2);
+    return read_file(session, line + 2);
 }
 
 
 
-int WriteFile(char * line) {
-    if (!usb_handle_exists()) {
+int WriteFile(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
     if (strlen(line) < 3) {
         return 0;
     }
-    return write_file(line + 2);
+    return write_file(session, line + 2);
 }
 
 
 
-int DeleteFile(char * line) {
-    if (!usb_handle_exists()) {
+int DeleteFile(struct session * session, char * line) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
     if (strlen(line) < 3) {
         return 0;
     }
-    return delete_file_and_update(line + 2);
+    return delete_file_and_update(session, line + 2);
 }
 
 
 
-int PrintStats(void) {
-    if (!usb_handle_exists()) {
+int PrintStats(struct session * session) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
         return 0;
     }
     
-    print_stats();
+    print_stats(session);
+    return 1;
+}
+
+
+
+int TransferStats(struct session * session) {
+    if (!usb_handle_exists(session)) {
+        fprintf(stderr, "Device handle does not exist. Did you call Init (B)?\n");
+        return 0;
+    }
+
+    stats_print(&session->stats, stdout);
     return 1;
 }
 
 
 
-int Close(void) {
-    if (!usb_handle_exists()) {
+int LogLevel(struct session * session, char * line) {
+    (void)session;
+    if (strlen(line) < 3) {
+        return 0;
+    }
+
+    enum usb_log_level level;
+    if (!usb_log_parse_level(line + 2, &level)) {
+        return 0;
+    }
+    if (!usb_log_has_path()) {
+        fprintf(stderr, "No log file was given. Start aulon with -l [log file] to log USB traffic.\n");
+        return 0;
+    }
+    usb_log_set_level(level);
+    return 1;
+}
+
+
+
+int Close(struct session * session) {
+    if (!usb_handle_exists(session)) {
         fprintf(stderr, "Device handle does not exist. No connection is open.\n");
         return 0;
     }
-    if(!usb_close_connection()) {
+    stats_print(&session->stats, stdout);
+    if(!usb_close_connection(session)) {
         fprintf(stderr, "Could not close USB connection.\n");
         return 0;
     }
     printf("Connection to current device closed.\n");
     return 1;
 }
+
+
+
+int Farm(struct session * session, char * line) {
+    if (usb_handle_exists(session)) {
+        fprintf(stderr, "A device is already connected.\nCall Close (Q) to disconnect it, so the job can run on every console.\n\n");
+        return 0;
+    }
+    if (strlen(line) < 3) {
+        return 0;
+    }
+    return farm_run(line + 2);
+}
+
+int Hotplug(struct session * session, char * line) {
+    if (usb_handle_exists(session)) {
+        fprintf(stderr, "A device is already connected.\nCall Close (Q) to disconnect it, so the commands can run on every console.\n\n");
+        return 0;
+    }
+    if (strlen(line) < 3) {
+        return 0;
+    }
+    return hotplug_run(line + 2);
+}
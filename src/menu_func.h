@@ -20,29 +20,35 @@
 #ifndef AULON_MENU_FUNC_H
 #define AULON_MENU_FUNC_H
 
+struct session;
+
 // Positions in NAND
 enum {
     NAND_START = 0x00, // Start of NAND (obviously)
     FILE_START = 0x40  // After the SKSA area, where the files/filesystem begin
 };
 
-int Init(void);
-int GetBBID(void);
-int SetLED(char * line);
-int SignHash(char * line);
-int SetTime(void);
-int ListFileBlocks(char * line);
-int ListFiles(void);
-int DumpCurrentFS(void);
-int DumpNand(void);
-int ReadSingleBlock(char * line);
-int WriteNand(int block_start);
-int WriteSingleBlock(char * line);
-int ReadFile(char * line);
-int WriteFile(char * line);
-int DeleteFile(char * line);
-int PrintStats(void);
-int Close(void);
+int Init(struct session * session);
+int GetBBID(struct session * session);
+int SetLED(struct session * session, char * line);
+int SignHash(struct session * session, char * line);
+int SetTime(struct session * session);
+int ListFileBlocks(struct session * session, char * line);
+int ListFiles(struct session * session);
+int DumpCurrentFS(struct session * session);
+int DumpNand(struct session * session, char * line);
+int ReadSingleBlock(struct session * session, char * line);
+int WriteNand(struct session * session, char * line, int block_start);
+int WriteSingleBlock(struct session * session, char * line);
+int ReadFile(struct session * session, char * line);
+int WriteFile(struct session * session, char * line);
+int DeleteFile(struct session * session, char * line);
+int PrintStats(struct session * session);
+int TransferStats(struct session * session);
+int LogLevel(struct session * session, char * line);
+int Close(struct session * session);
+int Farm(struct session * session, char * line);
+int Hotplug(struct session * session, char * line);
 
 
 #endif
@@ -0,0 +1,309 @@
+/*
+    nand_image.c
+    nand and spare dump files, preallocated and written in place
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // for posix_fallocate, pread and pwrite under -std=c99
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "commands.h"
+#include "nand_image.h"
+
+struct mapped_file {
+    unsigned char * data;  // NULL if the file isn't mapped
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+struct nand_image {
+    struct mapped_file nand;
+    struct mapped_file spare;
+};
+
+
+/*
+    Open or create a file as the mode says and make it the given size.
+    Unless it is sparse, all of its size is allocated on disk, so that
+    running out of space shows up here rather than in the middle of a dump,
+    and the file is mapped. Returns 0 on failure, with nothing left open.
+
+    A file with holes (sparse, or on a filesystem that couldn't allocate it
+    up front) is not mapped: touching a hole through a mapping can need
+    space allocated in the page fault (even a read does, on tmpfs), and a
+    full disk there kills the process with SIGBUS, or an in-page error on
+    Windows, instead of failing. Such a file is read and written with plain
+    file I/O, which reports running out of space as an error.
+*/
+#ifdef _WIN32
+static int map_file(struct mapped_file * mapped, const char * path, size_t size, enum nand_image_mode mode) {
+    mapped->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                               mode == NAND_IMAGE_KEEP ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Error creating %s (error %lu).\n", path, (unsigned long)GetLastError());
+        return 0;
+    }
+    DWORD returned;
+    if (mode == NAND_IMAGE_SPARSE) {
+        if (DeviceIoControl(mapped->file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL)) {
+            LARGE_INTEGER end;
+            end.QuadPart = (LONGLONG)size;
+            if (!SetFilePointerEx(mapped->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(mapped->file)) {
+                fprintf(stderr, "Error allocating %s (error %lu).\n", path, (unsigned long)GetLastError());
+                CloseHandle(mapped->file);
+                return 0;
+            }
+            mapped->data = NULL;
+            mapped->mapping = NULL;
+            mapped->size = size;
+            return 1;
+        }
+        // Not supported by this filesystem; the holes are just filled with zeros
+        fprintf(stderr, "%s could not be made sparse (error %lu).\n", path, (unsigned long)GetLastError());
+    }
+    // Mapping past the end of the file extends it to the mapping's size
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READWRITE, 0, (DWORD)size, NULL);
+    if (mapped->mapping != NULL) {
+        mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_WRITE, 0, 0, size);
+    }
+    if (mapped->mapping == NULL || mapped->data == NULL) {
+        fprintf(stderr, "Error mapping %s (error %lu).\n", path, (unsigned long)GetLastError());
+        if (mapped->mapping != NULL) {
+            CloseHandle(mapped->mapping);
+        }
+        CloseHandle(mapped->file);
+        return 0;
+    }
+    mapped->size = size;
+    return 1;
+}
+
+static int unmap_file(struct mapped_file * mapped) {
+    int success = (mapped->data == NULL || FlushViewOfFile(mapped->data, 0) != 0) && FlushFileBuffers(mapped->file) != 0;
+    if (!success) {
+        fprintf(stderr, "Error writing the NAND image back to disk: error %lu\n", (unsigned long)GetLastError());
+    }
+    if (mapped->data != NULL) {
+        success = UnmapViewOfFile(mapped->data) != 0 && success;
+        success = CloseHandle(mapped->mapping) != 0 && success;
+    }
+    success = CloseHandle(mapped->file) != 0 && success;
+    return success;
+}
+
+static void set_file_offset(OVERLAPPED * position, size_t offset) {
+    memset(position, 0, sizeof(*position));
+    position->Offset = (DWORD)offset;
+    position->OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+}
+
+static int read_file_at(struct mapped_file * mapped, size_t offset, unsigned char * data, size_t length) {
+    OVERLAPPED position;
+    set_file_offset(&position, offset);
+    DWORD got = 0;
+    if (!ReadFile(mapped->file, data, (DWORD)length, &got, &position) || got != length) {
+        fprintf(stderr, "Error reading from the NAND image (error %lu).\n", (unsigned long)GetLastError());
+        return 0;
+    }
+    return 1;
+}
+
+static int write_file_at(struct mapped_file * mapped, size_t offset, const unsigned char * data, size_t length) {
+    OVERLAPPED position;
+    set_file_offset(&position, offset);
+    DWORD written = 0;
+    if (!WriteFile(mapped->file, data, (DWORD)length, &written, &position) || written != length) {
+        fprintf(stderr, "Error writing to the NAND image (error %lu).\n", (unsigned long)GetLastError());
+        return 0;
+    }
+    return 1;
+}
+#else
+static int map_file(struct mapped_file * mapped, const char * path, size_t size, enum nand_image_mode mode) {
+    mapped->fd = open(path, O_RDWR | O_CREAT | (mode == NAND_IMAGE_KEEP ? 0 : O_TRUNC), 0666);
+    if (mapped->fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    int r = EINVAL;
+    if (mode != NAND_IMAGE_SPARSE) {
+        r = posix_fallocate(mapped->fd, 0, (off_t)size);
+    }
+    int allocated = (r == 0);
+    if (r == EINVAL || r == EOPNOTSUPP) {
+        // Sparse, or not supported by this filesystem; make a file of the right size, with holes
+        r = ftruncate(mapped->fd, (off_t)size) == 0 ? 0 : errno;
+    }
+    if (r != 0) {
+        fprintf(stderr, "Error allocating %s: %s\n", path, strerror(r));
+        close(mapped->fd);
+        return 0;
+    }
+    mapped->size = size;
+    if (!allocated) {
+        mapped->data = NULL;
+        return 1;
+    }
+    void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mapped->fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+        close(mapped->fd);
+        return 0;
+    }
+    mapped->data = data;
+    return 1;
+}
+
+static int unmap_file(struct mapped_file * mapped) {
+    int success = (mapped->data == NULL || msync(mapped->data, mapped->size, MS_SYNC) == 0) && fsync(mapped->fd) == 0;
+    if (!success) {
+        fprintf(stderr, "Error writing the NAND image back to disk: %s\n", strerror(errno));
+    }
+    if (mapped->data != NULL) {
+        success = munmap(mapped->data, mapped->size) == 0 && success;
+    }
+    success = close(mapped->fd) == 0 && success;
+    return success;
+}
+
+static int read_file_at(struct mapped_file * mapped, size_t offset, unsigned char * data, size_t length) {
+    while (length > 0) {
+        ssize_t got = pread(mapped->fd, data, length, (off_t)offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            fprintf(stderr, "Error reading from the NAND image: %s\n", got < 0 ? strerror(errno) : "unexpected end of file");
+            return 0;
+        }
+        data += got;
+        offset += (size_t)got;
+        length -= (size_t)got;
+    }
+    return 1;
+}
+
+static int write_file_at(struct mapped_file * mapped, size_t offset, const unsigned char * data, size_t length) {
+    while (length > 0) {
+        ssize_t written = pwrite(mapped->fd, data, length, (off_t)offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            fprintf(stderr, "Error writing to the NAND image: %s\n", strerror(errno));
+            return 0;
+        }
+        data += written;
+        offset += (size_t)written;
+        length -= (size_t)written;
+    }
+    return 1;
+}
+#endif
+
+static int load_from(struct mapped_file * mapped, size_t offset, unsigned char * data, size_t length) {
+    if (mapped->data == NULL) {
+        return read_file_at(mapped, offset, data, length);
+    }
+    memcpy(data, mapped->data + offset, length);
+    return 1;
+}
+
+static int store_at(struct mapped_file * mapped, size_t offset, const unsigned char * data, size_t length) {
+    if (mapped->data == NULL) {
+        return write_file_at(mapped, offset, data, length);
+    }
+    memcpy(mapped->data + offset, data, length);
+    return 1;
+}
+
+
+struct nand_image * nand_image_open(const char * nand_path, const char * spare_path, enum nand_image_mode mode) {
+    struct nand_image * image = calloc(1, sizeof(struct nand_image));
+    if (image == NULL) {
+        fprintf(stderr, "Could not allocate memory for the NAND image.\n");
+        return NULL;
+    }
+    if (!map_file(&image->nand, nand_path, (size_t)NUM_BLOCKS * BLOCK_SIZE, mode)) {
+        free(image);
+        return NULL;
+    }
+    if (!map_file(&image->spare, spare_path, (size_t)NUM_BLOCKS * SPARE_SIZE, mode)) {
+        unmap_file(&image->nand);
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+int nand_image_load(struct nand_image * image, uint32_t block_number,
+                    unsigned char * block, unsigned char * spare) {
+    return load_from(&image->nand, (size_t)block_number * BLOCK_SIZE, block, BLOCK_SIZE) &&
+           load_from(&image->spare, (size_t)block_number * SPARE_SIZE, spare, SPARE_SIZE);
+}
+
+/*
+    Safe to call from several threads at once, as long as they store
+    different blocks.
+*/
+int nand_image_store(struct nand_image * image, uint32_t block_number,
+                     const unsigned char * block, const unsigned char * spare) {
+    return store_at(&image->nand, (size_t)block_number * BLOCK_SIZE, block, BLOCK_SIZE) &&
+           store_at(&image->spare, (size_t)block_number * SPARE_SIZE, spare, SPARE_SIZE);
+}
+
+/*
+    Write the stored blocks back to disk, then unmap and close both files.
+    An I/O error writing back would otherwise only show up later, if at
+    all, so it is waited for here and reported. (Running out of space
+    doesn't wait until here: the files are either allocated up front, or
+    written with plain file I/O that fails the store as it happens.)
+    Returns 0 if anything failed along the way.
+*/
+int nand_image_close(struct nand_image * image) {
+    if (image == NULL) {
+        return 1;
+    }
+    int success = unmap_file(&image->nand);
+    success = unmap_file(&image->spare) && success;
+    if (!success) {
+        fprintf(stderr, "Error closing the NAND image files.\n");
+    }
+    free(image);
+    return success;
+}
@@ -0,0 +1,61 @@
+/*
+    nand_image.h
+    nand and spare dump files, preallocated and written in place
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_NAND_IMAGE_H
+#define AULON_NAND_IMAGE_H
+
+#include <stdint.h>
+
+/*
+    A NAND dump (nand.bin) and its spare data (spare.bin), each created at
+    its full size up front and mapped into memory, so every block can be
+    stored at its own offset as soon as it arrives, in any order, without
+    seeking or copying through stdio. Blocks that are never stored read
+    back as zeros. Files with holes in them are not mapped, and are read
+    and written with plain file I/O instead.
+
+    NAND_IMAGE_CREATE creates new files (or truncates existing ones), with
+    all of their space allocated. NAND_IMAGE_KEEP opens existing files as
+    they are (and grows them to full size if they're short), so an
+    interrupted dump can be filled in. NAND_IMAGE_SPARSE creates new files
+    without allocating anything, so blocks that are never stored are left
+    as holes that take no space on disk (where the filesystem allows it).
+
+    nand_image_load copies a block and its spare data out of the image.
+    nand_image_load and nand_image_store return 0 if the block couldn't be
+    read or stored, e.g. because the disk is full; nand_image_close returns
+    0 if the files couldn't be written back and closed cleanly.
+*/
+enum nand_image_mode {
+    NAND_IMAGE_CREATE,
+    NAND_IMAGE_KEEP,
+    NAND_IMAGE_SPARSE
+};
+
+struct nand_image;
+
+struct nand_image * nand_image_open(const char * nand_path, const char * spare_path, enum nand_image_mode mode);
+int nand_image_load(struct nand_image * image, uint32_t block_number,
+                    unsigned char * block, unsigned char * spare);
+int nand_image_store(struct nand_image * image, uint32_t block_number,
+                     const unsigned char * block, const unsigned char * spare);
+int nand_image_close(struct nand_image * image);
+
+#endif
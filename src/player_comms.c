@@ -31,19 +31,23 @@
 
 #include "usb.h"
 #include "player_comms.h"
+#include "codec.h"
+#include "policy.h"
 #include "io.h"
+#include "session.h"
+#include "timer.h"
 
 
-#define PACKET_SIZE 0x80  // #define because this is used as the declared length of an array
 static const unsigned char SEND_CHUNK_SIGNAL = 0x63;
 static const unsigned char READY_SIGNAL[4] = { 0x15, 0, 0, 0 };
+static const unsigned char LENGTH_SIGNAL = 0x1B;
 
-static int ique_is_ready(void);
-static size_t ique_receive_data_length(void);
-static int ique_receive_data(unsigned char * buffer, size_t data_length);
+static int ique_receive_signal(struct session * session);
+static size_t ique_receive_data_length(struct session * session);
+static int ique_receive_data(struct session * session, unsigned char * buffer, size_t data_length);
 static int parse_received_data(unsigned char * in_buffer,  size_t total_data_received,
                                unsigned char * out_buffer, size_t expected_data_length);
-static void process_piecemeal_data(unsigned char * input, size_t input_length, unsigned char * output);
+static size_t frame_chunked_data(unsigned char * input, size_t input_length, unsigned char * output);
 
 /*
     SEND data
@@ -58,6 +62,9 @@ static void process_piecemeal_data(unsigned char * input, size_t input_length, u
         clearly the size couldn't be larger than 0xFF anyway, since it must fit
         into a single byte).
 
+        The chunks don't need to be sent in separate transfers, so a whole
+        block's worth of chunks is framed into one buffer and sent at once.
+
     piecemeal data:
         The host sends data gradually, with 1-byte tags marking off 3-, 2-, or
         1-byte sections. The tags are in the form 0x40 + num_bytes.
@@ -65,78 +72,94 @@ static void process_piecemeal_data(unsigned char * input, size_t input_length, u
         Commands (among other things) are sent in this format.
 */
 
-int ique_send_chunked_data(unsigned char * data, size_t data_length) {
-    unsigned char chunk_buffer[0x100] = { SEND_CHUNK_SIGNAL };
-    size_t remaining_data = data_length;
-    unsigned int offset = 0;
-    int transferred = 0;
+int ique_send_chunked_data(struct session * session, unsigned char * data, size_t data_length) {
+    unsigned char * chunk_frame_buffer = session->comms.chunk_frame_buffer;
+    size_t offset = 0;
 
-    while (remaining_data) {
-        unsigned char chunk_length = (remaining_data >= 0xFE) ? 0xFE : (unsigned char)remaining_data;
-        chunk_buffer[1] = chunk_length;
-        memcpy(chunk_buffer + 2, data + offset, chunk_length);
-        if (!usb_bulk_transfer_send(chunk_buffer, chunk_length + 2, &transferred, 1000)) {
-            fprintf(stderr, "Error when sending chunk of data to the player.\n");
-            return 0;
+    // Frame as many chunks as fit in the frame buffer (a whole block) and send
+    // them as a single transfer, rather than one transfer per chunk.
+    while (offset < data_length) {
+        size_t batch_length = data_length - offset;
+        if (batch_length > CHUNKS_PER_TRANSFER * CHUNK_DATA_LENGTH) {
+            batch_length = CHUNKS_PER_TRANSFER * CHUNK_DATA_LENGTH;
         }
-        remaining_data -= chunk_length;
-        offset += chunk_length;
+        size_t framed_length = frame_chunked_data(data + offset, batch_length, chunk_frame_buffer);
+        if (!usb_bulk_transfer_send_async(session, chunk_frame_buffer, (int)framed_length, policy_transfer_timeout(&session->policy))) {
+            break;
+        }
+        offset += batch_length;
     }
 
+    if (!usb_bulk_transfer_flush(session) || offset < data_length) {
+        fprintf(stderr, "Error when sending chunk of data to the player.\n");
+        return 0;
+    }
     return 1;
 }
 
 
-int ique_send_piecemeal_data(unsigned char * data, size_t data_length) {
-    // data_length + space for tags every 3 bytes
-    size_t send_data_length = (data_length) + (data_length / 3) + (data_length % 3 != 0); 
-    unsigned char * send_data = calloc(send_data_length, sizeof(unsigned char));
-    if (send_data == NULL) {
-        fprintf(stderr, "calloc failed when sending data.\n");
+/*
+    Every full chunk is exactly 0x100 bytes, so each chunk still begins on a
+    packet boundary when several are sent in one transfer.
+*/
+static size_t frame_chunked_data(unsigned char * input, size_t input_length, unsigned char * output) {
+    size_t remaining_data = input_length;
+    size_t output_offset = 0;
+    size_t input_offset = 0;
+    while (remaining_data) {
+        unsigned char chunk_length = (remaining_data >= CHUNK_DATA_LENGTH) ? CHUNK_DATA_LENGTH : (unsigned char)remaining_data;
+        output[output_offset] = SEND_CHUNK_SIGNAL;
+        output[output_offset + 1] = chunk_length;
+        memcpy(output + output_offset + 2, input + input_offset, chunk_length);
+
+        output_offset += chunk_length + 2;
+        input_offset += chunk_length;
+        remaining_data -= chunk_length;
+    }
+    return output_offset;
+}
+
+
+int ique_send_piecemeal_data(struct session * session, unsigned char * data, size_t data_length) {
+    unsigned char * piecemeal_buffer = session->comms.piecemeal_buffer;
+    size_t send_data_length = piecemeal_encoded_length(data_length);
+    if (send_data_length > PIECEMEAL_BUFFER_SIZE) {
+        fprintf(stderr, "Piecemeal data of %zu bytes is too large to be sent.\n", data_length);
         return 0;
     }
-    
-    process_piecemeal_data(data, data_length, send_data);
+
+    encode_piecemeal_data(data, data_length, piecemeal_buffer);
 
     int transferred = 0;
-    if (!usb_bulk_transfer_send(send_data, send_data_length, &transferred, 1000)) {
+    if (!usb_bulk_transfer_send(session, piecemeal_buffer, (int)send_data_length, &transferred, policy_transfer_timeout(&session->policy))) {
         fprintf(stderr, "Error when sending piecemeal data to the player.\n");
-        free(send_data);
         return 0;
     }
-
-    free(send_data);
     return 1;
 }
 
 
-static void process_piecemeal_data(unsigned char * input, size_t input_length, unsigned char * output) {
-    size_t remaining_data = input_length;
-    size_t output_offset = 0;
-    size_t input_offset = 0;
-    while (remaining_data) {
-        unsigned char bytes_in_section = (remaining_data >= 3) ? 3 : (unsigned char)remaining_data;
-        output[output_offset] = 0x40 + bytes_in_section;
-        memcpy(output + output_offset + 1, input + input_offset, bytes_in_section);
-
-        output_offset += bytes_in_section + 1;
-        input_offset += bytes_in_section;
-        remaining_data -= bytes_in_section;
-    }   
-}
-
-
-int ique_send_command(uint32_t command, uint32_t argument) {
-    ique_wait_for_ready();
+int ique_send_command(struct session * session, uint32_t command, uint32_t argument) {
+    if (!ique_wait_for_ready(session)) {
+        return 0;
+    }
     uint32_t message[2] = { htonl(command), htonl(argument) };
-    return ique_send_piecemeal_data((unsigned char *)message, 8);
+    return ique_send_piecemeal_data(session, (unsigned char *)message, 8);
 }
 
 
-int ique_send_ack(void) {
-    int transferred = 0;
+/*
+    The ack is flushed straight away, so that a failure to send it fails the
+    reply it acknowledges rather than whatever is sent or read next.
+*/
+int ique_send_ack(struct session * session) {
     unsigned char ack = 0x44;
-    return usb_bulk_transfer_send(&ack, 1, &transferred, 1000);
+    int sent = usb_bulk_transfer_send_async(session, &ack, 1, policy_transfer_timeout(&session->policy));
+    if (!usb_bulk_transfer_flush(session) || !sent) {
+        fprintf(stderr, "Error when sending ack to the player.\n");
+        return 0;
+    }
+    return 1;
 }
 
 /*
@@ -152,8 +175,8 @@ int ique_send_ack(void) {
     are in the form 0x1C + num_bytes.
 */
 
-int ique_receive_reply(unsigned char * buffer, size_t recv_length) {
-    size_t data_length = ique_receive_data_length();
+int ique_receive_reply(struct session * session, unsigned char * buffer, size_t recv_length) {
+    size_t data_length = ique_receive_data_length(session);
     if (data_length == 0) {
         return 0;
     }
@@ -163,93 +186,100 @@ int ique_receive_reply(unsigned char * buffer, size_t recv_length) {
         return 0;
     }
     
-    return ique_receive_data(buffer, data_length);
+    return ique_receive_data(session, buffer, data_length);
 }
 
 
-static size_t ique_receive_data_length(void) {
-    unsigned char length_buffer[4] = { 0 };
-    int transferred = 0;
-    int r = 0;
-    
-    while (1) {
-        transferred = 0;
-        r = usb_bulk_transfer_receive(length_buffer, 4, &transferred, 1000);
-        if (r == 0 || transferred != 4) {
+static size_t ique_receive_data_length(struct session * session) {
+    struct comms_state * comms = &session->comms;
+    while (!comms->length_pending) {
+        if (!ique_receive_signal(session)) {
             return 0;
         }
-        if (memcmp(length_buffer, READY_SIGNAL, 4) == 0) {
-            // Received a ready signal instead -- try again.
-            continue;
-        }
-        if (length_buffer[0] != 0x1B) {
-            fprintf(stderr, "Unknown transfer unit type encountered when receiving reply length: %hhx\n", length_buffer[0]);
+        if (comms->unexpected_signal_received) {
+            fprintf(stderr, "Unknown transfer unit type encountered when receiving reply length: %hhx\n", comms->unexpected_signal);
+            comms->unexpected_signal_received = 0;
             return 0;
         }
-        break;
     }
 
-    length_buffer[0] = 0;
-    return uchars_to_uint32(length_buffer);
+    comms->length_pending = 0;
+    return comms->pending_length;
 }
 
 
-static int ique_receive_data(unsigned char * buffer, size_t data_length) {
-    // data_length + space for tags every 3 bytes (+ a little extra in case the player is inefficient)
-    size_t recv_buffer_length = (data_length) + ((data_length / 3) + 16); 
-    unsigned char * recv_buffer = calloc(recv_buffer_length, sizeof(unsigned char));
-    if (recv_buffer == NULL) {
-        fprintf(stderr, "calloc failed when receiving data.\n");
+static size_t round_up_to_packet(size_t length, size_t packet_size) {
+    return ((length + packet_size - 1) / packet_size) * packet_size;
+}
+
+/*
+    How much data the transfer units received so far carry. Counting stops
+    at a unit with a bad tag, which decoding reports.
+*/
+static size_t transfer_units_data_length(const unsigned char * units, size_t length) {
+    size_t data_length = 0;
+    size_t offset;
+    for (offset = 0; offset + 4 <= length; offset += 4) {
+        if (units[offset] < 0x1D || units[offset] > 0x1F) {
+            break;
+        }
+        data_length += units[offset] - 0x1C;
+    }
+    return data_length;
+}
+
+static int ique_receive_data(struct session * session, unsigned char * buffer, size_t data_length) {
+    unsigned char * recv_buffer = session->comms.recv_buffer;
+    size_t packet_size = (size_t)usb_get_max_packet_size(session);
+    // Every 4-byte transfer unit carries up to 3 bytes of data
+    size_t expected_length = ((data_length + 2) / 3) * 4;
+    // Room for a little extra in case the player is inefficient, plus one more packet
+    // for a read that runs past it
+    size_t recv_buffer_length = round_up_to_packet(expected_length + 16, packet_size) + packet_size;
+    if (recv_buffer_length > RECV_BUFFER_SIZE) {
+        fprintf(stderr, "Reply of %zu bytes is too large to be received.\n", data_length);
         return 0;
     }
 
     size_t total_data_received = 0;
-    unsigned char packet[PACKET_SIZE] = { 0 };
-    int transferred = PACKET_SIZE;
+    size_t request_length = round_up_to_packet(expected_length, packet_size);
+    int transferred = 0;
 
-    // Read one packet at a time; end after we receive a packet that is not full.
-    // This models the way USB receives packets normally and ensures all data sent
-    // from the console is read -- even if its more or less than expected.
-    while (transferred == PACKET_SIZE) {
+    // Read the whole expected reply in one transfer. USB ends a transfer early on a
+    // short packet, so a read that is not completely filled is the end of the data.
+    // A read that is filled is the end of the data if it carries all the length header
+    // declared (any zero-length packet after it is skipped by the next signal read);
+    // if the console was less efficient than expected, read one packet at a time
+    // until it does, or until a read is not full.
+    int read_full = 1;
+    while (read_full) {
         transferred = 0;
-        if (usb_bulk_transfer_receive(packet, PACKET_SIZE, &transferred, 1000) &&
-            (total_data_received + transferred) <= recv_buffer_length          ) {
-            memcpy(recv_buffer + total_data_received, packet, transferred);
-            total_data_received += transferred;
-        }
-        else {
-            free(recv_buffer);
+        if ((total_data_received + request_length) > recv_buffer_length ||
+            !usb_bulk_transfer_receive(session, recv_buffer + total_data_received, (int)request_length, &transferred, policy_transfer_timeout(&session->policy))) {
             fprintf(stderr, "Error receiving data!\n");
             fprintf(stderr, "Buffer size: %zu bytes, Data received so far: %zu bytes, Next transfer size: %d\n",
                     recv_buffer_length, total_data_received, transferred);
             return 0;
         }
+        total_data_received += transferred;
+        read_full = ((size_t)transferred == request_length) &&
+                    transfer_units_data_length(recv_buffer, total_data_received) < data_length;
+        request_length = packet_size;
     }
 
-    ique_send_ack();
-    int r = parse_received_data(recv_buffer, total_data_received, buffer, data_length);
-    free(recv_buffer);
-    return r;
+    if (!ique_send_ack(session)) {
+        return 0;
+    }
+    // Decode straight into the caller's buffer
+    return parse_received_data(recv_buffer, total_data_received, buffer, data_length);
 }
 
 
 static int parse_received_data(unsigned char * in_buffer,  size_t total_data_received,
                                unsigned char * out_buffer, size_t expected_data_length) {
-    size_t in_offset = 0;
     size_t copied_data = 0;
-
-    while (copied_data < expected_data_length && in_offset < total_data_received) {
-        unsigned char tu = in_buffer[in_offset];
-        if (tu == 0x1F || tu == 0x1E || tu == 0x1D) {
-            size_t tu_length = tu - 0x1C;
-            memcpy(out_buffer + copied_data, in_buffer + in_offset + 1, tu_length);
-            copied_data += tu_length;
-        }
-        else {
-            fprintf(stderr, "Unknown transfer unit type encountered when parsing received data: %hhx\n", tu);
-            return 0;
-        }
-        in_offset += 4;
+    if (!decode_transfer_units(in_buffer, total_data_received, out_buffer, expected_data_length, &copied_data)) {
+        return 0;
     }
 
     if (copied_data != expected_data_length) {
@@ -262,21 +292,112 @@ static int parse_received_data(unsigned char * in_buffer,  size_t total_data_rec
 
 
 /*
-    Wait for the ready signal (15 00 00 00)
+    READY signals and reply lengths
+    The console sends a READY signal (15 00 00 00) when it is waiting for the
+    host, and a 4-byte 0x1B length header before each reply. A READY signal may
+    turn up ahead of a reply's length header as well as in answer to a poll, so
+    every 4-byte signal read from the console goes through ique_receive_signal,
+    which records what it saw instead of throwing it away:
+
+        READY signal  -> ready_pending is set
+        length header -> length_pending is set, with the length in pending_length
+        anything else -> unexpected_signal_received is set
+
+    Waiting for READY then consumes a pending READY signal before polling the
+    console, and receiving a reply consumes a pending length header, so a
+    signal that arrives out of turn is used rather than lost.
+
+    This doesn't remove the READY poll before each command: the console only
+    sends READY in answer to a read once it has nothing else queued, in a
+    transfer of its own, so it can't be picked up with the previous reply.
+    Normally there is exactly one poll per command; a pending READY only
+    saves it when the console sent one ahead of a reply.
 */
-void ique_wait_for_ready(void) {
-    while (!ique_is_ready());
-}
-
-
-static int ique_is_ready(void) {
+static int ique_receive_signal(struct session * session) {
+    struct comms_state * comms = &session->comms;
     unsigned char buffer[4] = { 0 };
-
     int transferred = 0;
-    if (!usb_bulk_transfer_receive(buffer, 4, &transferred, 1000) || (transferred < 4)) {
+
+    if (!usb_bulk_transfer_receive(session, buffer, 4, &transferred, policy_transfer_timeout(&session->policy))) {
+        return 0;
+    }
+    if (transferred == 0) {
+        // The zero-length packet ending a reply that exactly filled its last packet
+        if (!usb_bulk_transfer_receive(session, buffer, 4, &transferred, policy_transfer_timeout(&session->policy))) {
+            return 0;
+        }
+    }
+    if (transferred != 4) {
         return 0;
     }
 
-    return memcmp(buffer, READY_SIGNAL, 4) == 0;
+    if (memcmp(buffer, READY_SIGNAL, 4) == 0) {
+        if (comms->ready_pending) {
+            comms->ready_stats.ready_signals_dropped++;
+        }
+        comms->ready_pending = 1;
+    }
+    else if (buffer[0] == LENGTH_SIGNAL) {
+        buffer[0] = 0;
+        comms->pending_length = uchars_to_uint32(buffer);
+        comms->length_pending = 1;
+    }
+    else {
+        comms->unexpected_signal = buffer[0];
+        comms->unexpected_signal_received = 1;
+    }
+    return 1;
 }
 
+int ique_wait_for_ready(struct session * session) {
+    struct comms_state * comms = &session->comms;
+    if (comms->ready_pending) {
+        comms->ready_stats.polls_avoided++;
+    }
+
+    uint64_t start_time = timer_now_us();
+    struct policy_deadline deadline;
+    policy_deadline_start(&deadline, policy_get_config()->ready_deadline_ms);
+    unsigned int wasted = 0;
+    while (!comms->ready_pending) {
+        if (policy_deadline_expired(&deadline) || policy_stalled(&session->policy)) {
+            fprintf(stderr, "The console did not become ready in time.\n");
+            session->stats.ready_wait_us += timer_now_us() - start_time;
+            return 0;
+        }
+        comms->ready_stats.polls++;
+        session->stats.ready_polls++;
+        int received = ique_receive_signal(session);
+        if (!received && usb_connection_lost(session)) {
+            // No point polling a console that is gone; let the caller reconnect
+            session->stats.ready_wait_us += timer_now_us() - start_time;
+            return 0;
+        }
+        if (!received || !comms->ready_pending) {
+            // Timed out, or got something other than READY
+            comms->ready_stats.wasted_polls++;
+            comms->unexpected_signal_received = 0;
+            policy_backoff(++wasted);
+        }
+    }
+    comms->ready_pending = 0;
+    session->stats.ready_wait_us += timer_now_us() - start_time;
+    return 1;
+}
+
+/*
+    Forget any signals received on a previous connection.
+*/
+void ique_reset_protocol_state(struct session * session) {
+    session->comms.ready_pending = 0;
+    session->comms.length_pending = 0;
+    session->comms.unexpected_signal_received = 0;
+}
+
+void ique_get_ready_stats(struct session * session, struct ique_ready_stats * stats) {
+    *stats = session->comms.ready_stats;
+}
+
+void ique_reset_ready_stats(struct session * session) {
+    memset(&session->comms.ready_stats, 0, sizeof(session->comms.ready_stats));
+}
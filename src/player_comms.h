@@ -20,15 +20,55 @@
 #ifndef AULON_PLAYER_COMMS_H
 #define AULON_PLAYER_COMMS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-int ique_send_chunked_data(unsigned char * data, size_t data_length);
-int ique_send_piecemeal_data(unsigned char * data, size_t data_length);
-int ique_send_command(uint32_t command, uint32_t argument);
-int ique_send_ack(void);
+/*
+    Counts of READY polls, for measuring the round trips spent waiting on the console.
+*/
+struct ique_ready_stats {
+    unsigned long polls;                 // reads issued while waiting for READY
+    unsigned long wasted_polls;          // polls that timed out or returned something else
+    unsigned long polls_avoided;         // waits satisfied by a READY that had already arrived
+    unsigned long ready_signals_dropped; // READY signals that arrived while one was already pending
+};
+
+#define CHUNK_DATA_LENGTH   0xFE
+#define CHUNKS_PER_TRANSFER 65    // enough chunks to hold one full block
+// Piecemeal data is only ever a command, a spare area, a filename, or the like
+#define PIECEMEAL_BUFFER_SIZE 0x100
+// Holds the encoded form of the largest reply (a 0x1000-byte block chunk) while it is decoded
+#define RECV_BUFFER_SIZE 0x2000
+
+struct session;
+
+/*
+    The protocol state of one connection: its framing buffers, and the
+    signals received from the console but not yet consumed.
+*/
+struct comms_state {
+    unsigned char chunk_frame_buffer[CHUNKS_PER_TRANSFER * (CHUNK_DATA_LENGTH + 2)];
+    unsigned char piecemeal_buffer[PIECEMEAL_BUFFER_SIZE];
+    unsigned char recv_buffer[RECV_BUFFER_SIZE];
+
+    int ready_pending;
+    int length_pending;
+    size_t pending_length;
+    int unexpected_signal_received;
+    unsigned char unexpected_signal;
+    struct ique_ready_stats ready_stats;
+};
+
+int ique_send_chunked_data(struct session * session, unsigned char * data, size_t data_length);
+int ique_send_piecemeal_data(struct session * session, unsigned char * data, size_t data_length);
+int ique_send_command(struct session * session, uint32_t command, uint32_t argument);
+int ique_send_ack(struct session * session);
 
-int ique_receive_reply(unsigned char * buffer, size_t recv_length);
+int ique_receive_reply(struct session * session, unsigned char * buffer, size_t recv_length);
 
-void ique_wait_for_ready(void);
+int ique_wait_for_ready(struct session * session);
+void ique_reset_protocol_state(struct session * session);
+void ique_get_ready_stats(struct session * session, struct ique_ready_stats * stats);
+void ique_reset_ready_stats(struct session * session);
 
 #endif
@@ -0,0 +1,262 @@
+/*
+    policy.c
+    timeouts, retries and stall detection for transfers to the console
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "policy.h"
+#include "timer.h"
+
+// Transfers seen before timeouts are adapted; until then DEFAULT_TIMEOUT_MS is used
+// for data, and timeout_max_ms for slow replies, which never go below DEFAULT_TIMEOUT_MS
+static const uint64_t MIN_SAMPLES = 32;
+static const unsigned int DEFAULT_TIMEOUT_MS = 1000;
+
+static struct policy_config config = {
+    .timeout_min_ms     = 100,
+    .timeout_max_ms     = 5000,
+    .timeout_multiplier = 4,
+    .ready_deadline_ms  = 10000,
+    .backoff_base_ms    = 50,
+    .backoff_max_ms     = 2000,
+    .max_attempts       = 5,
+    .stall_limit_ms     = 30000
+};
+
+
+
+/*
+    Latency histogram
+    Bucket 4*m + s holds latencies whose most significant bit is m and whose
+    next two bits are s.
+*/
+static unsigned int latency_bucket(uint64_t latency_us) {
+    if (latency_us < 4) {
+        return (unsigned int)latency_us;
+    }
+    unsigned int msb = 0;
+    while ((latency_us >> (msb + 1)) != 0) {
+        msb++;
+    }
+    unsigned int bucket = (msb * 4) + (unsigned int)((latency_us >> (msb - 2)) & 3);
+    return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static uint64_t latency_bucket_upper_bound(unsigned int bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    unsigned int msb = bucket / 4;
+    return ((uint64_t)(4 + (bucket % 4) + 1) << (msb - 2)) - 1;
+}
+
+void latency_record(struct latency_histogram * histogram, uint64_t latency_us) {
+    if (histogram->count == 0 || latency_us < histogram->min_us) {
+        histogram->min_us = latency_us;
+    }
+    if (latency_us > histogram->max_us) {
+        histogram->max_us = latency_us;
+    }
+    histogram->count++;
+    histogram->total_us += latency_us;
+    histogram->buckets[latency_bucket(latency_us)]++;
+}
+
+uint64_t latency_percentile(const struct latency_histogram * histogram, double percentile) {
+    uint64_t target = (uint64_t)(histogram->count * (percentile / 100.0));
+    uint64_t seen = 0;
+    unsigned int i;
+    for (i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen > target) {
+            uint64_t bound = latency_bucket_upper_bound(i);
+            return (bound < histogram->max_us) ? bound : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+
+
+/*
+    Configuration
+    The spec is a comma-separated list of key=value pairs, e.g.
+    "timeout_min=50,stall=10000". Unknown keys are an error.
+*/
+static int set_config_value(const char * key, unsigned long value) {
+    static const struct {
+        const char * key;
+        unsigned int * value;
+    } keys[] = {
+        { "timeout_min",    &config.timeout_min_ms     },
+        { "timeout_max",    &config.timeout_max_ms     },
+        { "timeout_mult",   &config.timeout_multiplier },
+        { "ready_deadline", &config.ready_deadline_ms  },
+        { "backoff_base",   &config.backoff_base_ms    },
+        { "backoff_max",    &config.backoff_max_ms     },
+        { "attempts",       &config.max_attempts       },
+        { "stall",          &config.stall_limit_ms     }
+    };
+    size_t i;
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        if (strcmp(key, keys[i].key) == 0) {
+            *keys[i].value = (unsigned int)value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int policy_parse(const char * spec) {
+    char buffer[256] = { 0 };
+    if (strlen(spec) >= sizeof(buffer)) {
+        fprintf(stderr, "Transfer policy is too long.\n");
+        return 0;
+    }
+    strcpy(buffer, spec);
+
+    char * pair = strtok(buffer, ",");
+    while (pair) {
+        char * equals = strchr(pair, '=');
+        if (equals == NULL) {
+            fprintf(stderr, "Invalid transfer policy setting: %s\n", pair);
+            return 0;
+        }
+        *equals = '\0';
+        if (!set_config_value(pair, strtoul(equals + 1, NULL, 0))) {
+            fprintf(stderr, "Unknown transfer policy setting: %s\n", pair);
+            return 0;
+        }
+        pair = strtok(NULL, ",");
+    }
+
+    if (config.timeout_min_ms == 0 || config.timeout_min_ms > config.timeout_max_ms || config.max_attempts == 0) {
+        fprintf(stderr, "Invalid transfer policy: timeouts must be nonzero with timeout_min <= timeout_max, and attempts nonzero.\n");
+        return 0;
+    }
+    return 1;
+}
+
+const struct policy_config * policy_get_config(void) {
+    return &config;
+}
+
+/*
+    Called at the start of each top-level command, so time spent idle at the
+    menu doesn't count as a stall, and so a stalled console can be retried.
+*/
+void policy_begin_operation(struct policy_state * state) {
+    state->last_progress_us = timer_now_us();
+    state->stalled = 0;
+}
+
+
+
+/*
+    Transfer timeouts
+    Each class of transfer has its own timeout. Until enough transfers of a
+    class have been seen its default timeout is used. After that, the
+    timeout tracks the class's p99 latency. A timed-out transfer is recorded
+    at the timeout it was given, which pushes the p99 (and so the next
+    timeout) up if timeouts become common.
+*/
+void policy_set_transfer_class(struct policy_state * state, enum policy_transfer_class transfer_class) {
+    state->transfer_class = transfer_class;
+}
+
+unsigned int policy_transfer_timeout(const struct policy_state * state) {
+    unsigned int timeout_ms = state->current_timeout_ms[state->transfer_class];
+    if (timeout_ms != 0) {
+        return timeout_ms;
+    }
+    return (state->transfer_class == POLICY_TRANSFER_SLOW_REPLY) ? config.timeout_max_ms : DEFAULT_TIMEOUT_MS;
+}
+
+static void update_transfer_timeout(struct policy_state * state) {
+    enum policy_transfer_class transfer_class = state->transfer_class;
+    if (state->transfer_latency[transfer_class].count < MIN_SAMPLES) {
+        return;
+    }
+    uint64_t timeout_ms = (latency_percentile(&state->transfer_latency[transfer_class], 99.0) * config.timeout_multiplier) / 1000;
+    unsigned int floor_ms = config.timeout_min_ms;
+    if (transfer_class == POLICY_TRANSFER_SLOW_REPLY && floor_ms < DEFAULT_TIMEOUT_MS) {
+        floor_ms = DEFAULT_TIMEOUT_MS;
+    }
+    if (timeout_ms < floor_ms) {
+        timeout_ms = floor_ms;
+    }
+    if (timeout_ms > config.timeout_max_ms) {
+        timeout_ms = config.timeout_max_ms;
+    }
+    state->current_timeout_ms[transfer_class] = (unsigned int)timeout_ms;
+}
+
+void policy_record_transfer(struct policy_state * state, uint64_t latency_us, int success, int timed_out) {
+    if (success) {
+        state->last_progress_us = timer_now_us();
+    }
+    if (success || timed_out) {
+        latency_record(&state->transfer_latency[state->transfer_class], latency_us);
+        update_transfer_timeout(state);
+    }
+}
+
+
+
+/*
+    Stall watchdog
+    Once no transfer has succeeded for stall_limit_ms, every caller that checks
+    policy_stalled gives up, until the next top-level command begins.
+*/
+int policy_stalled(struct policy_state * state) {
+    if (!state->stalled && state->last_progress_us != 0 &&
+        (timer_now_us() - state->last_progress_us) > (uint64_t)config.stall_limit_ms * 1000) {
+        fprintf(stderr, "\nNo data has been transferred for %u ms; aborting the current operation.\n", config.stall_limit_ms);
+        state->stalled = 1;
+    }
+    return state->stalled;
+}
+
+
+
+/*
+    Retries and deadlines
+*/
+void policy_backoff(unsigned int attempt) {
+    unsigned int delay = config.backoff_base_ms;
+    while (attempt > 1 && delay < config.backoff_max_ms) {
+        delay *= 2;
+        attempt--;
+    }
+    if (delay > config.backoff_max_ms) {
+        delay = config.backoff_max_ms;
+    }
+    timer_sleep_ms(delay);
+}
+
+void policy_deadline_start(struct policy_deadline * deadline, unsigned int ms) {
+    deadline->expires_us = timer_now_us() + ((uint64_t)ms * 1000);
+}
+
+int policy_deadline_expired(const struct policy_deadline * deadline) {
+    return timer_now_us() >= deadline->expires_us;
+}
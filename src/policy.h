@@ -0,0 +1,98 @@
+/*
+    policy.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_POLICY_H
+#define AULON_POLICY_H
+
+#include <stdint.h>
+
+#define LATENCY_BUCKETS 256
+
+/*
+    Latencies in microseconds, bucketed at 4 buckets per power of two
+    (so any percentile is accurate to within ~19%).
+*/
+struct latency_histogram {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint32_t buckets[LATENCY_BUCKETS];
+};
+
+void latency_record(struct latency_histogram * histogram, uint64_t latency_us);
+uint64_t latency_percentile(const struct latency_histogram * histogram, double percentile);
+
+struct policy_config {
+    unsigned int timeout_min_ms;      // adaptive transfer timeouts are clamped to
+    unsigned int timeout_max_ms;      // [timeout_min_ms, timeout_max_ms]
+    unsigned int timeout_multiplier;  // timeout = p99 latency * timeout_multiplier
+    unsigned int ready_deadline_ms;   // longest to wait for the console to become ready
+    unsigned int backoff_base_ms;     // delay before the first retry; doubles for each retry after
+    unsigned int backoff_max_ms;
+    unsigned int max_attempts;        // attempts at a block read or write before giving up
+    unsigned int stall_limit_ms;      // abort if no transfer succeeds for this long
+};
+
+/*
+    Transfers are timed separately for each class of operation, since a
+    reply the console has to work for (signing a hash, checksumming a file,
+    initializing the FS, finishing a block write) takes far longer than
+    moving block data, and must not get a timeout learned from the latter.
+*/
+enum policy_transfer_class {
+    POLICY_TRANSFER_DATA,       // block data, signals and quick command replies
+    POLICY_TRANSFER_SLOW_REPLY, // replies to commands the console takes a while to carry out
+    POLICY_TRANSFER_CLASSES
+};
+
+/*
+    Per-connection state: each console's latencies (and so its timeouts)
+    and its progress are tracked separately.
+*/
+struct policy_state {
+    struct latency_histogram transfer_latency[POLICY_TRANSFER_CLASSES];
+    unsigned int current_timeout_ms[POLICY_TRANSFER_CLASSES];
+    enum policy_transfer_class transfer_class; // the class of the transfers being made now
+    uint64_t last_progress_us;
+    int stalled;
+};
+
+struct policy_deadline {
+    uint64_t expires_us;
+};
+
+/*
+    Functions return 1 for success (or true) and 0 for failure (or false),
+    except where a value is returned.
+*/
+int policy_parse(const char * spec);
+const struct policy_config * policy_get_config(void);
+void policy_begin_operation(struct policy_state * state);
+
+void policy_set_transfer_class(struct policy_state * state, enum policy_transfer_class transfer_class);
+unsigned int policy_transfer_timeout(const struct policy_state * state);
+void policy_record_transfer(struct policy_state * state, uint64_t latency_us, int success, int timed_out);
+int policy_stalled(struct policy_state * state);
+
+void policy_backoff(unsigned int attempt);
+void policy_deadline_start(struct policy_deadline * deadline, unsigned int ms);
+int policy_deadline_expired(const struct policy_deadline * deadline);
+
+#endif
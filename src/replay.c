@@ -0,0 +1,352 @@
+/*
+    replay.c
+    replaying a USB capture in place of a console
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "io.h"
+#include "replay.h"
+#include "transport.h"
+
+#define PCAP_MAGIC                      0xA1B2C3D4
+#define PCAP_HEADER_SIZE                24
+#define PCAP_RECORD_HEADER_SIZE         16
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED 220
+#define USBMON_HEADER_SIZE              64
+#define USBMON_TRANSFER_CONTROL         2
+#define USBMON_TRANSFER_BULK            3
+
+/*
+    The capture is read into memory whole and indexed as a list of
+    transfers: an OUT transfer's data comes from its submission record and
+    an IN transfer's from its completion record, as usb_log writes them.
+    The only other transfer read is the configuration descriptor logged
+    when the connection was made, for the endpoints' maximum packet size.
+
+    OUT data is compared as a stream rather than transfer by transfer, so
+    a change in how the host splits what it sends into transfers doesn't
+    count as a mismatch; what does is sending different data, or sending
+    more or less than was recorded before the console's next reply.
+*/
+struct replay_transfer {
+    int in;
+    int32_t status;
+    uint32_t length;
+    const unsigned char * data;
+};
+
+struct replay {
+    unsigned char * capture;
+    struct replay_transfer * transfers;
+    size_t count;
+    size_t next;                // the next transfer to be replayed
+    uint32_t out_offset;        // how much of transfers[next] has been sent, if it is OUT
+    uint64_t out_total;         // OUT bytes matched so far
+    int max_packet_size;        // from the configuration descriptor; 0 if none was recorded
+    int failed;
+};
+
+static char * replay_path = NULL;
+
+static void replay_close(struct replay * replay);
+
+
+void replay_set_path(char * path) {
+    replay_path = path;
+}
+
+const char * replay_get_path(void) {
+    return replay_path;
+}
+
+
+static uint32_t get_u32(const unsigned char * in) { uint32_t value; memcpy(&value, in, sizeof(value)); return value; }
+static uint64_t get_u64(const unsigned char * in) { uint64_t value; memcpy(&value, in, sizeof(value)); return value; }
+
+static int read_capture(struct replay * replay, const char * path, size_t * size) {
+    FILE * file = NULL;
+    if (!open_file(&file, path, "rb")) {
+        return 0;
+    }
+    *size = get_file_size(file);
+    replay->capture = malloc(*size ? *size : 1);
+    if (replay->capture == NULL) {
+        fprintf(stderr, "Could not allocate memory to read the capture.\n");
+        fclose(file);
+        return 0;
+    }
+    int success = (fread(replay->capture, 1, *size, file) == *size);
+    fclose(file);
+    if (!success) {
+        fprintf(stderr, "Could not read the capture %s.\n", path);
+    }
+    return success;
+}
+
+/*
+    Take the bulk IN endpoint's maximum packet size from a configuration
+    descriptor (the configuration, interface and endpoint descriptors, one
+    after another).
+*/
+static void read_configuration(struct replay * replay, const unsigned char * data, uint32_t length) {
+    if (length < 2 || data[1] != 0x02) {
+        return;
+    }
+    uint32_t offset = 0;
+    while (offset + 2 <= length && data[offset] >= 2 && offset + data[offset] <= length) {
+        const unsigned char * descriptor = &data[offset];
+        if (descriptor[1] == 0x05 && descriptor[0] >= 7 && (descriptor[2] & 0x80) && (descriptor[3] & 0x03) == 0x02) {
+            replay->max_packet_size = (descriptor[4] | (descriptor[5] << 8)) & 0x7FF;
+        }
+        offset += descriptor[0];
+    }
+}
+
+/*
+    Build the list of transfers from the capture's records.
+*/
+static int index_capture(struct replay * replay, size_t size) {
+    const unsigned char * capture = replay->capture;
+    if (size < PCAP_HEADER_SIZE || get_u32(&capture[0]) != PCAP_MAGIC ||
+        get_u32(&capture[20]) != PCAP_LINKTYPE_USB_LINUX_MMAPPED) {
+        fprintf(stderr, "The capture is not a usbmon pcap file written by aulon on this machine.\n");
+        return 0;
+    }
+
+    // Every transfer has at least one record
+    size_t max_transfers = size / (PCAP_RECORD_HEADER_SIZE + USBMON_HEADER_SIZE);
+    replay->transfers = malloc((max_transfers ? max_transfers : 1) * sizeof(struct replay_transfer));
+    if (replay->transfers == NULL) {
+        fprintf(stderr, "Could not allocate memory to index the capture.\n");
+        return 0;
+    }
+
+    uint64_t last_out_id = 0;
+    struct replay_transfer * last_out = NULL;
+    size_t offset = PCAP_HEADER_SIZE;
+    while (offset + PCAP_RECORD_HEADER_SIZE + USBMON_HEADER_SIZE <= size) {
+        uint32_t record_length = get_u32(&capture[offset + 8]);
+        const unsigned char * header = &capture[offset + PCAP_RECORD_HEADER_SIZE];
+        if (record_length < USBMON_HEADER_SIZE || offset + PCAP_RECORD_HEADER_SIZE + record_length > size) {
+            break;
+        }
+        offset += PCAP_RECORD_HEADER_SIZE + record_length;
+
+        uint64_t id = get_u64(&header[0]);
+        char event = (char)header[8];
+        unsigned char type = header[9];
+        int in = (header[10] & 0x80) != 0;
+        int32_t status = (int32_t)get_u32(&header[28]);
+        uint32_t length = get_u32(&header[32]);
+        uint32_t captured = get_u32(&header[36]);
+        struct replay_transfer * transfer = &replay->transfers[replay->count];
+
+        if (type == USBMON_TRANSFER_CONTROL) {
+            if (event == 'C' && in && status == 0) {
+                uint32_t available = record_length - USBMON_HEADER_SIZE;
+                read_configuration(replay, header + USBMON_HEADER_SIZE, (captured < available) ? captured : available);
+            }
+            continue;
+        }
+        if (type != USBMON_TRANSFER_BULK) {
+            continue;
+        }
+
+        if (event == 'S' && !in) {
+            if (captured != length) {
+                fprintf(stderr, "The capture doesn't hold the data sent; record it with -L full.\n");
+                return 0;
+            }
+            transfer->in = 0;
+            transfer->status = 0;
+            transfer->length = length;
+            transfer->data = header + USBMON_HEADER_SIZE;
+            last_out = transfer;
+            last_out_id = id;
+            replay->count++;
+        }
+        else if (event == 'C' && !in && last_out != NULL && id == last_out_id) {
+            last_out->status = status;
+        }
+        else if (event == 'C' && in) {
+            if (captured != length) {
+                fprintf(stderr, "The capture doesn't hold the data received; record it with -L full.\n");
+                return 0;
+            }
+            transfer->in = 1;
+            transfer->status = status;
+            transfer->length = length;
+            transfer->data = header + USBMON_HEADER_SIZE;
+            replay->count++;
+        }
+    }
+
+    if (offset != size) {
+        fprintf(stderr, "The capture ends with a partial record, which will be ignored.\n");
+    }
+    return 1;
+}
+
+static struct replay * replay_open(const char * path) {
+    struct replay * replay = calloc(1, sizeof(struct replay));
+    if (replay == NULL) {
+        fprintf(stderr, "Could not allocate memory to replay a capture.\n");
+        return NULL;
+    }
+
+    size_t size = 0;
+    if (!read_capture(replay, path, &size) || !index_capture(replay, size)) {
+        replay_close(replay);
+        return NULL;
+    }
+    return replay;
+}
+
+static void replay_close(struct replay * replay) {
+    if (replay == NULL) {
+        return;
+    }
+    if (replay->transfers != NULL && !replay->failed) {
+        printf("Replayed %lu of %lu transfers from the capture.\n", (unsigned long)replay->next, (unsigned long)replay->count);
+    }
+    free(replay->transfers);
+    free(replay->capture);
+    free(replay);
+}
+
+
+static int replay_mismatch(struct replay * replay, const char * problem) {
+    fprintf(stderr, "Replay mismatch at transfer %lu of %lu (after %llu bytes sent): %s\n",
+            (unsigned long)replay->next + 1, (unsigned long)replay->count, (unsigned long long)replay->out_total, problem);
+    replay->failed = 1;
+    return 0;
+}
+
+static int replay_send(struct replay * replay, const unsigned char * data, uint32_t length, int32_t * status) {
+    *status = 0;
+    if (replay->failed) {
+        return 0;
+    }
+
+    while (length > 0) {
+        if (replay->next == replay->count) {
+            return replay_mismatch(replay, "more data was sent than the capture holds.");
+        }
+        struct replay_transfer * transfer = &replay->transfers[replay->next];
+        if (transfer->in) {
+            return replay_mismatch(replay, "more data was sent than was recorded before the console's reply.");
+        }
+
+        uint32_t remaining = transfer->length - replay->out_offset;
+        uint32_t compare = (length < remaining) ? length : remaining;
+        if (memcmp(transfer->data + replay->out_offset, data, compare) != 0) {
+            uint32_t i = 0;
+            while (transfer->data[replay->out_offset + i] == data[i]) {
+                i++;
+            }
+            replay->out_total += i;
+            return replay_mismatch(replay, "the data sent differs from the capture.");
+        }
+        replay->out_offset += compare;
+        replay->out_total += compare;
+        data += compare;
+        length -= compare;
+
+        if (replay->out_offset == transfer->length) {
+            *status = transfer->status;
+            replay->out_offset = 0;
+            replay->next++;
+        }
+    }
+    return 1;
+}
+
+static int replay_receive(struct replay * replay, unsigned char * data, uint32_t length, uint32_t * actual_length, int32_t * status) {
+    *actual_length = 0;
+    *status = 0;
+    if (replay->failed) {
+        return 0;
+    }
+
+    // Skip OUT transfers that sent nothing
+    while (replay->next < replay->count && !replay->transfers[replay->next].in &&
+           replay->transfers[replay->next].length == 0 && replay->out_offset == 0) {
+        replay->next++;
+    }
+    if (replay->next == replay->count) {
+        return replay_mismatch(replay, "the capture ended before the console's next reply.");
+    }
+    struct replay_transfer * transfer = &replay->transfers[replay->next];
+    if (!transfer->in) {
+        return replay_mismatch(replay, "less data was sent than was recorded before the console's reply.");
+    }
+    if (transfer->length > length) {
+        return replay_mismatch(replay, "the recorded reply is longer than the host asked for.");
+    }
+
+    memcpy(data, transfer->data, transfer->length);
+    *actual_length = transfer->length;
+    *status = transfer->status;
+    replay->next++;
+    return 1;
+}
+
+
+/*
+    The capture as a transport. Timeouts don't apply, as every transfer
+    completes immediately, and there is nothing to reconnect to: the
+    capture carries on with whatever the recorded session did after it
+    reconnected.
+*/
+static void * replay_transport_open(void) {
+    return replay_open(replay_path);
+}
+
+static void replay_transport_close(void * state) {
+    replay_close(state);
+}
+
+static int replay_transport_max_packet_size(void * state) {
+    return ((struct replay *)state)->max_packet_size;
+}
+
+static int replay_transport_send(void * state, const unsigned char * data, uint32_t length, unsigned int timeout, int32_t * status) {
+    (void)timeout;
+    return replay_send(state, data, length, status);
+}
+
+static int replay_transport_receive(void * state, unsigned char * data, uint32_t length, unsigned int timeout,
+                                    uint32_t * actual_length, int32_t * status) {
+    (void)timeout;
+    return replay_receive(state, data, length, actual_length, status);
+}
+
+const struct transport replay_transport = {
+    "replay",
+    replay_transport_open,
+    replay_transport_close,
+    replay_transport_max_packet_size,
+    replay_transport_send,
+    NULL,
+    replay_transport_receive,
+    NULL
+};
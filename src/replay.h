@@ -0,0 +1,37 @@
+/*
+    replay.h
+    replaying a USB capture in place of a console
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_REPLAY_H
+#define AULON_REPLAY_H
+
+#include "transport.h"
+
+/*
+    A capture written with -l (at the full log level), played back in place
+    of a console: IN transfers are answered from the capture in the order
+    they were recorded, and OUT transfers are checked against it. A mismatch
+    fails the transfer as a lost connection would.
+*/
+void replay_set_path(char * path);
+const char * replay_get_path(void);
+
+extern const struct transport replay_transport;
+
+#endif
@@ -0,0 +1,234 @@
+/*
+    replay_test.c
+    records a dump against the console emulator and replays the capture
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "io.h"
+#include "codec.h"
+#include "commands.h"
+#include "emulator.h"
+#include "menu_func.h"
+#include "replay.h"
+#include "session.h"
+#include "usb.h"
+#include "usb_log.h"
+
+/*
+    A sparse dump of a small console image is recorded at the full log
+    level through the emulator, with a maximum packet size other than the
+    default, then the capture is replayed into a second directory. The
+    replay must report the recorded packet size, send exactly what the
+    recording sent, and leave the same dump behind.
+
+    The emulator is limited to a bandwidth the log writer can keep up
+    with, as a capture that dropped transfers can't be replayed.
+
+    Run with "make replay-test" in build/linux/, or as
+    replay_test [work directory].
+*/
+static const int TEST_PACKET_SIZE = 0x200;
+static const char * const EMULATOR_OPTIONS = "bandwidth=8192,packet=0x200";
+static const uint32_t FS_BLOCK = 0xFF0;
+static const uint32_t RESERVED_BLOCKS = 0x40;   // system area, which a sparse dump reads
+
+static char console_dir[FILENAME_MAX];
+static char record_dir[FILENAME_MAX];
+static char replay_dir[FILENAME_MAX];
+static char capture_path[FILENAME_MAX];
+
+
+static int join_path(char * path, const char * directory, const char * filename) {
+    int length = snprintf(path, FILENAME_MAX, "%s/%s", directory, filename);
+    if (length < 0 || length >= FILENAME_MAX) {
+        printf("The path %s/%s is too long.\n", directory, filename);
+        return 0;
+    }
+    return 1;
+}
+
+static int write_image_file(const char * directory, const char * filename, const unsigned char * data, size_t length) {
+    char path[FILENAME_MAX];
+    FILE * file = NULL;
+    if (!join_path(path, directory, filename) || !open_file(&file, path, "wb")) {
+        return 0;
+    }
+    int success = (fwrite(data, 1, length, file) == length);
+    if (fclose(file) != 0) {
+        success = 0;
+    }
+    if (!success) {
+        printf("Could not write %s.\n", path);
+    }
+    return success;
+}
+
+static void put_fat_entry(unsigned char * fs, uint32_t block, int16_t value) {
+    fs[block * 2]     = (unsigned char)(((uint16_t)value >> 8) & 0xFF);
+    fs[block * 2 + 1] = (unsigned char)((uint16_t)value & 0xFF);
+}
+
+/*
+    Random NAND contents with one valid FS block: the system area and the
+    FS blocks reserved in the FAT, everything else free, and sequence
+    number 1. The other FS blocks have sequence number 0, so they are
+    passed over. The spare area is all 0xFF, as on a block with no errors.
+*/
+static int make_console_image(void) {
+    size_t nand_size = (size_t)NUM_BLOCKS * BLOCK_SIZE;
+    size_t spare_size = (size_t)NUM_BLOCKS * SPARE_SIZE;
+    unsigned char * nand = malloc(nand_size);
+    unsigned char * spare = malloc(spare_size);
+    if (nand == NULL || spare == NULL) {
+        printf("Could not allocate the console image.\n");
+        free(nand);
+        free(spare);
+        return 0;
+    }
+
+    uint32_t state = 0x2545F491;
+    size_t i;
+    for (i = 0; i < nand_size; ++i) {
+        // xorshift32
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        nand[i] = (unsigned char)state;
+    }
+    memset(spare, 0xFF, spare_size);
+
+    uint32_t block;
+    for (block = FS_BLOCK; block < NUM_BLOCKS; ++block) {
+        memset(&nand[(size_t)block * BLOCK_SIZE], 0, BLOCK_SIZE);
+    }
+    unsigned char * fs = &nand[(size_t)FS_BLOCK * BLOCK_SIZE];
+    for (block = 0; block < RESERVED_BLOCKS; ++block) {
+        put_fat_entry(fs, block, -3);
+    }
+    for (block = FS_BLOCK; block < NUM_BLOCKS; ++block) {
+        put_fat_entry(fs, block, -3);
+    }
+    fs[0x3FFB] = 1;
+
+    int success = make_directory(console_dir) &&
+                  write_image_file(console_dir, "nand.bin", nand, nand_size) &&
+                  write_image_file(console_dir, "spare.bin", spare, spare_size);
+    free(nand);
+    free(spare);
+    return success;
+}
+
+
+/*
+    Connect, make a sparse dump into the directory, and disconnect. The
+    packet size is checked before anything is sent.
+*/
+static int dump(const char * directory, int expected_packet_size) {
+    struct session * session = session_create();
+    if (session == NULL) {
+        printf("Could not create a session.\n");
+        return 0;
+    }
+    session->quiet = 1;
+
+    char line[] = "1 sparse";
+    int success = session_set_directory(session, directory) && Init(session);
+    if (success && usb_get_max_packet_size(session) != expected_packet_size) {
+        printf("Maximum packet size is 0x%x, expected 0x%x.\n", usb_get_max_packet_size(session), expected_packet_size);
+        success = 0;
+    }
+    if (success) {
+        success = DumpNand(session, line);
+    }
+    if (!Close(session)) {
+        success = 0;
+    }
+    session_destroy(session);
+    return success;
+}
+
+static int files_match(const char * filename) {
+    char record_path[FILENAME_MAX];
+    char replay_path[FILENAME_MAX];
+    FILE * recorded = NULL;
+    FILE * replayed = NULL;
+    if (!join_path(record_path, record_dir, filename) || !join_path(replay_path, replay_dir, filename) ||
+        !open_file(&recorded, record_path, "rb") || !open_file(&replayed, replay_path, "rb")) {
+        if (recorded != NULL) {
+            fclose(recorded);
+        }
+        return 0;
+    }
+
+    unsigned char recorded_buffer[BLOCK_SIZE];
+    unsigned char replayed_buffer[BLOCK_SIZE];
+    int match = 1;
+    while (match) {
+        size_t recorded_length = fread(recorded_buffer, 1, sizeof(recorded_buffer), recorded);
+        size_t replayed_length = fread(replayed_buffer, 1, sizeof(replayed_buffer), replayed);
+        match = (recorded_length == replayed_length &&
+                 memcmp(recorded_buffer, replayed_buffer, recorded_length) == 0);
+        if (recorded_length < sizeof(recorded_buffer)) {
+            break;
+        }
+    }
+    fclose(recorded);
+    fclose(replayed);
+    if (!match) {
+        printf("The replayed %s differs from the recorded one.\n", filename);
+    }
+    return match;
+}
+
+
+int main(int argc, char * argv[]) {
+    const char * work_dir = (argc > 1) ? argv[1] : "replay_test_work";
+    printf("replay test: working in %s\n", work_dir);
+    if (!join_path(console_dir, work_dir, "console") || !join_path(record_dir, work_dir, "record") ||
+        !join_path(replay_dir, work_dir, "replay") || !join_path(capture_path, work_dir, "capture.pcap")) {
+        return EXIT_FAILURE;
+    }
+
+    codec_init();
+    if (!make_directory(work_dir) || !make_console_image()) {
+        return EXIT_FAILURE;
+    }
+
+    emulator_set_directory(console_dir);
+    if (!emulator_parse_options(EMULATOR_OPTIONS)) {
+        return EXIT_FAILURE;
+    }
+    usb_log_set_path(capture_path);
+    usb_log_set_level(USB_LOG_FULL);
+    int recorded = dump(record_dir, TEST_PACKET_SIZE);
+    printf("  record  %s\n", recorded ? "ok" : "FAILED");
+    if (!recorded) {
+        return EXIT_FAILURE;
+    }
+
+    usb_log_set_path(NULL);
+    emulator_set_directory(NULL);
+    replay_set_path(capture_path);
+    int replayed = dump(replay_dir, TEST_PACKET_SIZE) && files_match("nand.bin") && files_match("spare.bin");
+    printf("  replay  %s\n", replayed ? "ok" : "FAILED");
+    return replayed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,96 @@
+/*
+    session.c
+    per-console connection state
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "io.h"
+#include "session.h"
+
+
+/*
+    A new session starts out disconnected, with no protocol state and
+    default transfer timeouts. It is allocated on the heap since its
+    buffers are far too large for the stack.
+*/
+struct session * session_create(void) {
+    struct session * session = calloc(1, sizeof(struct session));
+    if (session == NULL) {
+        fprintf(stderr, "Could not allocate memory for a new session.\n");
+    }
+    return session;
+}
+
+/*
+    Close the session's connection, if it has one, and free it.
+*/
+void session_destroy(struct session * session) {
+    if (session == NULL) {
+        return;
+    }
+    usb_close_connection(session);
+    free(session);
+}
+
+
+/*
+    Files named by the session's commands (nand.bin, block_XXXX, and so on)
+    are read from and written to the session's directory, which is created
+    if it doesn't exist yet.
+*/
+int session_set_directory(struct session * session, const char * directory) {
+    if (strlen(directory) >= SESSION_DIRECTORY_LENGTH) {
+        fprintf(stderr, "The directory name %s is too long.\n", directory);
+        return 0;
+    }
+    if (!make_directory(directory)) {
+        return 0;
+    }
+    strcpy(session->directory, directory);
+    return 1;
+}
+
+/*
+    Build the path of one of the session's files, in its directory if it
+    has one. path must hold FILENAME_MAX characters.
+*/
+int session_file_path(struct session * session, char * path, const char * filename) {
+    int length;
+    if (session->directory[0] == '\0') {
+        length = snprintf(path, FILENAME_MAX, "%s", filename);
+    }
+    else {
+        length = snprintf(path, FILENAME_MAX, "%s/%s", session->directory, filename);
+    }
+    if (length < 0 || length >= FILENAME_MAX) {
+        fprintf(stderr, "ERROR: Filename is too long. Opening file aborted.\n");
+        return 0;
+    }
+    return 1;
+}
+
+int session_open_file(struct session * session, FILE ** file, const char * filename, const char * mode) {
+    char path[FILENAME_MAX];
+    if (!session_file_path(session, path, filename)) {
+        return 0;
+    }
+    return open_file(file, path, mode);
+}
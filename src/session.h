@@ -0,0 +1,59 @@
+/*
+    session.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_SESSION_H
+#define AULON_SESSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+#include "usb.h"
+#include "player_comms.h"
+#include "fs.h"
+#include "policy.h"
+#include "stats.h"
+
+/*
+    Everything aulon knows about one connected console. Nothing below the
+    menu keeps state of its own, so any number of sessions can be open at
+    once, each driven by its own thread.
+*/
+#define SESSION_DIRECTORY_LENGTH 64
+
+struct session {
+    struct usb_state usb;
+    struct comms_state comms;
+    struct fs_state fs;
+    struct policy_state policy;
+    struct session_stats stats;
+
+    char directory[SESSION_DIRECTORY_LENGTH]; // where the session's files are read and written; empty for the current directory
+    int quiet;                                // don't print progress, e.g. when several sessions share the terminal
+    uint32_t bbid;                            // the connected console's BBID, once get_bbid has read it
+    int bbid_known;                           // cleared by Init, since the next console may be a different one
+};
+
+struct session * session_create(void);
+void session_destroy(struct session * session);
+int session_set_directory(struct session * session, const char * directory);
+int session_file_path(struct session * session, char * path, const char * filename);
+int session_open_file(struct session * session, FILE ** file, const char * filename, const char * mode);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+    stats.c
+    per-connection transfer counters
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "policy.h"
+#include "timer.h"
+#include "stats.h"
+
+static const char * OPERATION_NAMES[STATS_OPERATIONS] = {
+    "read block",
+    "read block+spare",
+    "write block",
+    "write block+spare"
+};
+
+
+void stats_reset(struct session_stats * stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->start_us = timer_now_us();
+}
+
+void stats_record_transfer(struct session_stats * stats, int in, int actual_length, uint64_t latency_us, int timed_out, int failed) {
+    if (in) {
+        stats->transfers_in++;
+        stats->bytes_in += actual_length;
+    }
+    else {
+        stats->transfers_out++;
+        stats->bytes_out += actual_length;
+    }
+    if (timed_out) {
+        stats->timeouts++;
+    }
+    else if (failed) {
+        stats->errors++;
+    }
+    latency_record(&stats->transfer_latency, latency_us);
+}
+
+/*
+    attempts is the number of times the operation was tried, so every
+    attempt after the first is a retry.
+*/
+void stats_record_operation(struct session_stats * stats, enum stats_operation operation, unsigned int attempts, int success) {
+    struct stats_operation_counts * counts = &stats->operations[operation];
+    counts->calls++;
+    if (attempts > 1) {
+        counts->retries += attempts - 1;
+    }
+    if (!success) {
+        counts->failures++;
+    }
+}
+
+void stats_record_disk(struct session_stats * stats, uint64_t start_us) {
+    stats->disk_us += timer_now_us() - start_us;
+}
+
+
+static double percent_of(uint64_t part, uint64_t whole) {
+    return whole ? (part * 100.0) / whole : 0.0;
+}
+
+void stats_print(const struct session_stats * stats, FILE * stream) {
+    uint64_t elapsed_us = timer_now_us() - stats->start_us;
+    double seconds = elapsed_us / 1000000.0;
+    uint64_t transfers = stats->transfers_in + stats->transfers_out;
+    uint64_t other_us = elapsed_us;
+    other_us -= (stats->usb_us < other_us) ? stats->usb_us : other_us;
+    other_us -= (stats->disk_us < other_us) ? stats->disk_us : other_us;
+
+    fprintf(stream, "Connection statistics (%.1f s):\n", seconds);
+    fprintf(stream, "  IN:  %llu transfers, %llu bytes (%.1f KiB/s)\n",
+            (unsigned long long)stats->transfers_in, (unsigned long long)stats->bytes_in,
+            seconds > 0 ? (stats->bytes_in / 1024.0) / seconds : 0.0);
+    fprintf(stream, "  OUT: %llu transfers, %llu bytes (%.1f KiB/s)\n",
+            (unsigned long long)stats->transfers_out, (unsigned long long)stats->bytes_out,
+            seconds > 0 ? (stats->bytes_out / 1024.0) / seconds : 0.0);
+    fprintf(stream, "  Errors: %llu timeouts, %llu pipe clears, %llu other\n",
+            (unsigned long long)stats->timeouts, (unsigned long long)stats->pipe_clears,
+            (unsigned long long)stats->errors);
+    if (transfers) {
+        const struct latency_histogram * latency = &stats->transfer_latency;
+        fprintf(stream, "  Transfer latency: min %llu us, avg %llu us, p99 %llu us, max %llu us\n",
+                (unsigned long long)latency->min_us, (unsigned long long)(latency->total_us / latency->count),
+                (unsigned long long)latency_percentile(latency, 99.0), (unsigned long long)latency->max_us);
+    }
+    fprintf(stream, "  READY polls: %llu (%.2f s waiting for READY)\n",
+            (unsigned long long)stats->ready_polls, stats->ready_wait_us / 1000000.0);
+    fprintf(stream, "  Time: %.1f%% in libusb, %.1f%% on host files, %.1f%% elsewhere\n",
+            percent_of(stats->usb_us, elapsed_us), percent_of(stats->disk_us, elapsed_us),
+            percent_of(other_us, elapsed_us));
+
+    int i;
+    for (i = 0; i < STATS_OPERATIONS; ++i) {
+        const struct stats_operation_counts * counts = &stats->operations[i];
+        if (counts->calls) {
+            fprintf(stream, "  %s: %llu calls, %llu retries, %llu failed\n", OPERATION_NAMES[i],
+                    (unsigned long long)counts->calls, (unsigned long long)counts->retries,
+                    (unsigned long long)counts->failures);
+        }
+    }
+}
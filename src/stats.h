@@ -0,0 +1,76 @@
+/*
+    stats.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_STATS_H
+#define AULON_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "policy.h"
+
+struct session;
+
+/*
+    Block operations that are retried, and counted, separately.
+*/
+enum stats_operation {
+    STATS_READ_BLOCK,
+    STATS_READ_BLOCK_SPARE,
+    STATS_WRITE_BLOCK,
+    STATS_WRITE_BLOCK_SPARE,
+    STATS_OPERATIONS
+};
+
+struct stats_operation_counts {
+    uint64_t calls;
+    uint64_t retries;
+    uint64_t failures;    // calls that gave up
+};
+
+/*
+    Counters for one connection, kept whether or not anyone asks for them.
+    Comparing the time spent in libusb, polling for READY and on host files
+    with the time the connection has been open shows whether a slow operation
+    is bound by the bus, the protocol, or the disk.
+*/
+struct session_stats {
+    uint64_t start_us;
+    uint64_t transfers_in;
+    uint64_t transfers_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t usb_us;           // submitting transfers and waiting for them to complete
+    uint64_t timeouts;
+    uint64_t pipe_clears;
+    uint64_t errors;           // failed transfers other than timeouts
+    uint64_t ready_polls;
+    uint64_t ready_wait_us;    // waiting for the console to become ready, including polls
+    uint64_t disk_us;          // reading and writing host files
+    struct latency_histogram transfer_latency;
+    struct stats_operation_counts operations[STATS_OPERATIONS];
+};
+
+void stats_reset(struct session_stats * stats);
+void stats_record_transfer(struct session_stats * stats, int in, int actual_length, uint64_t latency_us, int timed_out, int failed);
+void stats_record_operation(struct session_stats * stats, enum stats_operation operation, unsigned int attempts, int success);
+void stats_record_disk(struct session_stats * stats, uint64_t start_us);
+void stats_print(const struct session_stats * stats, FILE * stream);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+    thread.c
+    minimal portable threads and mutexes
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "thread.h"
+
+
+/*
+    Neither pthreads nor Win32 threads call a function with aulon's
+    signature, so the function and its argument are passed to a small
+    trampoline that calls it.
+*/
+struct thread_start {
+    thread_function function;
+    void * argument;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI thread_trampoline(LPVOID data) {
+#else
+static void * thread_trampoline(void * data) {
+#endif
+    struct thread_start start = *(struct thread_start *)data;
+    free(data);
+    start.function(start.argument);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+int thread_create(aulon_thread * thread, thread_function function, void * argument) {
+    struct thread_start * start = malloc(sizeof(struct thread_start));
+    if (start == NULL) {
+        fprintf(stderr, "Could not allocate memory to start a thread.\n");
+        return 0;
+    }
+    start->function = function;
+    start->argument = argument;
+
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (*thread == NULL) {
+#else
+    if (pthread_create(thread, NULL, thread_trampoline, start) != 0) {
+#endif
+        fprintf(stderr, "Could not start a thread.\n");
+        free(start);
+        return 0;
+    }
+    return 1;
+}
+
+void thread_join(aulon_thread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+
+void mutex_init(aulon_mutex * mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(aulon_mutex * mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(aulon_mutex * mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void mutex_destroy(aulon_mutex * mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+
+void cond_init(aulon_cond * cond) {
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_wait(aulon_cond * cond, aulon_mutex * mutex) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void cond_broadcast(aulon_cond * cond) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_destroy(aulon_cond * cond) {
+#ifdef _WIN32
+    (void)cond; // Win32 condition variables need no cleanup
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
+
+uint32_t atomic_load_u32(const volatile uint32_t * value) {
+#ifdef _WIN32
+    return (uint32_t)InterlockedCompareExchange((volatile LONG *)value, 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void atomic_store_u32(volatile uint32_t * value, uint32_t new_value) {
+#ifdef _WIN32
+    InterlockedExchange((volatile LONG *)value, (LONG)new_value);
+#else
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#endif
+}
@@ -0,0 +1,68 @@
+/*
+    thread.h
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_THREAD_H
+#define AULON_THREAD_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE aulon_thread;
+typedef CRITICAL_SECTION aulon_mutex;
+typedef CONDITION_VARIABLE aulon_cond;
+#else
+#include <pthread.h>
+typedef pthread_t aulon_thread;
+typedef pthread_mutex_t aulon_mutex;
+typedef pthread_cond_t aulon_cond;
+#endif
+
+typedef void (*thread_function)(void * argument);
+
+/*
+    thread_create returns 1 for success and 0 for failure.
+*/
+int thread_create(aulon_thread * thread, thread_function function, void * argument);
+void thread_join(aulon_thread thread);
+
+void mutex_init(aulon_mutex * mutex);
+void mutex_lock(aulon_mutex * mutex);
+void mutex_unlock(aulon_mutex * mutex);
+void mutex_destroy(aulon_mutex * mutex);
+
+/*
+    cond_wait must be called with the mutex locked, and may return without
+    the condition having been signalled, so it is always called in a loop
+    that checks what it is waiting for.
+*/
+void cond_init(aulon_cond * cond);
+void cond_wait(aulon_cond * cond, aulon_mutex * mutex);
+void cond_broadcast(aulon_cond * cond);
+void cond_destroy(aulon_cond * cond);
+
+/*
+    For a value shared between two threads without a lock: a store
+    releases everything the storing thread wrote before it, and a load
+    acquires everything the other thread wrote before its store.
+*/
+uint32_t atomic_load_u32(const volatile uint32_t * value);
+void atomic_store_u32(volatile uint32_t * value, uint32_t new_value);
+
+#endif
@@ -0,0 +1,54 @@
+/*
+    transport.h
+    carrying a console's bulk transfers by something other than libusb
+
+    Copyright (c) 2021 Jbop (https://github.com/jbop1626)
+    This file is a part of aulon.
+
+    aulon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    aulon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AULON_TRANSPORT_H
+#define AULON_TRANSPORT_H
+
+#include <stdint.h>
+
+/*
+    A transport stands in for the console's USB connection, so the same
+    protocol code can run over a replayed capture, an emulated console, or
+    a bridge to a console plugged into another machine. usb.c drives a
+    real console through libusb directly when no transport is selected.
+
+    open returns the transport's state, or NULL on failure. The other
+    functions return 1 for success and 0 for failure, and report each
+    transfer's result in status as a usbmon status would: 0, or the
+    negative errno value it failed with.
+
+    send may only queue its data, as long as any failure is reported by
+    the next flush or receive. flush and reconnect may be NULL if there is
+    nothing for them to do, and max_packet_size if the console's usual
+    packet size applies.
+*/
+struct transport {
+    const char * name;
+    void * (*open)(void);
+    void (*close)(void * state);
+    int (*max_packet_size)(void * state);
+    int (*send)(void * state, const unsigned char * data, uint32_t length, unsigned int timeout, int32_t * status);
+    int (*flush)(void * state, int32_t * status);
+    int (*receive)(void * state, unsigned char * data, uint32_t length, unsigned int timeout,
+                   uint32_t * actual_length, int32_t * status);
+    int (*reconnect)(void * state);
+};
+
+#endif
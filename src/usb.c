@@ -2,7 +2,7 @@
     usb.c
     low-level USB communications and transfers
 
-    Copyright (c) 2018,2019,2020 Jbop (https://github.com/jbop1626)
+    Copyright (c) 2018,2019,2020,2021 Jbop (https://github.com/jbop1626)
     Copyright (c) 2012-2018 Mike Ryan
 
     This file is a part of aulon.
@@ -27,68 +27,266 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libusb-1.0/libusb.h>
 
 #include "defs.h"
 #include "usb.h"
 #include "usb_log.h"
+#include "transport.h"
+#include "replay.h"
+#include "emulator.h"
+#include "bridge.h"
+#include "policy.h"
+#include "session.h"
+#include "stats.h"
+#include "timer.h"
 
 
 static const uint16_t IQUE_VID = 0x1527; // 0xBB3D for old test SAs that support USB
 static const uint16_t IQUE_PID = 0xBBDB;
 static const unsigned char IQUE_BULK_EP_OUT = 0x02;
 static const unsigned char IQUE_BULK_EP_IN  = 0x82;
+static const int DEFAULT_MAX_PACKET_SIZE = 0x80;
+static const unsigned int RECONNECT_DEADLINE_MS = 15000;
 
-static struct libusb_device_handle * device_handle = NULL;
-static int cleanup_required  = 0;
-static int kernel_detached   = 0;
-static int interface_claimed = 0;
-static int usb_initialized   = 0;
+static int32_t usb_error_to_usbmon_status(int error_code);
+static void usb_log_configuration(struct session * session);
 
 
-static void usb_cleanup_close(void) {
-    usb_close_connection();
+static int usb_init(struct usb_state * usb) {
+    if (!usb->usb_initialized) {
+        if (libusb_init(&usb->context) < 0) {
+            fprintf(stderr, "libusb could not be initialized.\n");
+            return 0;
+        }
+        usb->usb_initialized = 1;
+    }
+    return 1;
+}
+
+
+static int usb_device_is_ique(libusb_device * device) {
+    struct libusb_device_descriptor descriptor;
+    if (libusb_get_device_descriptor(device, &descriptor) < 0) {
+        return 0;
+    }
+    return (descriptor.idVendor == IQUE_VID && descriptor.idProduct == IQUE_PID);
+}
+
+static void usb_get_device_location(libusb_device * device, struct usb_device_location * location) {
+    location->bus = libusb_get_bus_number(device);
+    location->depth = libusb_get_port_numbers(device, location->ports, USB_MAX_PORT_DEPTH);
+    if (location->depth < 0) {
+        location->depth = 0;
+    }
+}
+
+static int usb_location_equal(const struct usb_device_location * a, const struct usb_device_location * b) {
+    return (a->bus == b->bus && a->depth == b->depth &&
+            memcmp(a->ports, b->ports, (size_t)a->depth) == 0);
+}
+
+/*
+    Find every attached console. Enumeration uses a context of its own, so
+    it can be done before any session exists.
+*/
+int usb_find_devices(struct usb_device_location * locations, int max_locations) {
+    libusb_context * context = NULL;
+    if (libusb_init(&context) < 0) {
+        fprintf(stderr, "libusb could not be initialized.\n");
+        return -1;
+    }
+
+    libusb_device ** list = NULL;
+    ssize_t count = libusb_get_device_list(context, &list);
+    if (count < 0) {
+        fprintf(stderr, "libusb_get_device_list error: %s\n", libusb_error_name((int)count));
+        libusb_exit(context);
+        return -1;
+    }
+
+    int found = 0;
+    ssize_t i;
+    for (i = 0; i < count; ++i) {
+        if (usb_device_is_ique(list[i])) {
+            if (found == max_locations) {
+                fprintf(stderr, "More than %d consoles are attached; only the first %d will be used.\n", max_locations, max_locations);
+                break;
+            }
+            usb_get_device_location(list[i], &locations[found]);
+            found++;
+        }
+    }
+
+    libusb_free_device_list(list, 1);
+    libusb_exit(context);
+    return found;
+}
+
+/*
+    Format a location as e.g. "1-4.2" (bus 1, port 4, then port 2 of the hub there),
+    as Linux names USB devices.
+*/
+void usb_format_location(const struct usb_device_location * location, char * buffer, size_t buffer_length) {
+    int written = snprintf(buffer, buffer_length, "%u", location->bus);
+    int i;
+    for (i = 0; i < location->depth && written > 0 && (size_t)written < buffer_length; ++i) {
+        written += snprintf(buffer + written, buffer_length - written, "%c%u", (i == 0 ? '-' : '.'), location->ports[i]);
+    }
 }
 
+void usb_set_device_location(struct session * session, const struct usb_device_location * location) {
+    session->usb.location = *location;
+    session->usb.location_set = 1;
+}
 
-static void usb_init(void) {
-    if (libusb_init(NULL) < 0) {
-        fprintf(stderr, "libusb could not be initialized; exiting...\n");
-        exit(EXIT_FAILURE);
+/*
+    Hotplug monitor
+    Consoles being plugged in and unplugged are reported through a libusb
+    context of the monitor's own. libusb calls usb_hotplug_callback from
+    within libusb_handle_events, i.e. on the thread that called
+    usb_hotplug_wait, so the events can simply be queued here and handed
+    back once event handling returns. Consoles that are already plugged in
+    when the monitor starts are reported as arriving.
+*/
+#define HOTPLUG_QUEUE_LENGTH 64
+
+static libusb_context * hotplug_context = NULL;
+static libusb_hotplug_callback_handle hotplug_handle;
+static struct usb_hotplug_event hotplug_queue[HOTPLUG_QUEUE_LENGTH];
+static int hotplug_queued = 0;
+
+static int LIBUSB_CALL usb_hotplug_callback(libusb_context * context, libusb_device * device,
+                                            libusb_hotplug_event event, void * user_data) {
+    (void)context;
+    (void)user_data;
+    if (hotplug_queued == HOTPLUG_QUEUE_LENGTH) {
+        fprintf(stderr, "Too many consoles were plugged in or unplugged at once; some were missed.\n");
+        return 0;
     }
-    usb_initialized = 1;
+    struct usb_hotplug_event * queued = &hotplug_queue[hotplug_queued++];
+    queued->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    usb_get_device_location(device, &queued->location);
+    return 0; // stay registered
 }
 
+int usb_hotplug_start(void) {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "Hotplug events are not supported by libusb on this platform.\n");
+        return 0;
+    }
+    if (libusb_init(&hotplug_context) < 0) {
+        fprintf(stderr, "libusb could not be initialized.\n");
+        return 0;
+    }
 
-static int usb_get_device_handle(uint16_t vendor_id, uint16_t product_id) {
-    device_handle = libusb_open_device_with_vid_pid(NULL, vendor_id, product_id);
-    return usb_handle_exists();
+    hotplug_queued = 0;
+    int r = libusb_hotplug_register_callback(hotplug_context,
+                                             LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                             LIBUSB_HOTPLUG_ENUMERATE, IQUE_VID, IQUE_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+                                             usb_hotplug_callback, NULL, &hotplug_handle);
+    if (r < 0) {
+        fprintf(stderr, "libusb_hotplug_register_callback error: %s\n", libusb_error_name(r));
+        libusb_exit(hotplug_context);
+        hotplug_context = NULL;
+        return 0;
+    }
+    return 1;
 }
 
+/*
+    Wait up to timeout_ms for consoles to be plugged in or unplugged, and
+    copy out the events seen (including any queued while starting).
+*/
+int usb_hotplug_wait(struct usb_hotplug_event * events, int max_events, unsigned int timeout_ms) {
+    if (hotplug_queued == 0) {
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        int r = libusb_handle_events_timeout_completed(hotplug_context, &timeout, NULL);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "libusb_handle_events error: %s\n", libusb_error_name(r));
+            return -1;
+        }
+    }
+
+    int count = (hotplug_queued < max_events) ? hotplug_queued : max_events;
+    memcpy(events, hotplug_queue, count * sizeof(struct usb_hotplug_event));
+    memmove(hotplug_queue, hotplug_queue + count, (hotplug_queued - count) * sizeof(struct usb_hotplug_event));
+    hotplug_queued -= count;
+    return count;
+}
+
+void usb_hotplug_stop(void) {
+    if (hotplug_context) {
+        libusb_hotplug_deregister_callback(hotplug_context, hotplug_handle);
+        libusb_exit(hotplug_context);
+        hotplug_context = NULL;
+    }
+}
+
+
+static libusb_device_handle * usb_open_device_at_location(struct usb_state * usb) {
+    libusb_device ** list = NULL;
+    ssize_t count = libusb_get_device_list(usb->context, &list);
+    if (count < 0) {
+        return NULL;
+    }
 
-static int usb_detach_kernel_driver(void) {
+    libusb_device_handle * handle = NULL;
+    ssize_t i;
+    for (i = 0; i < count; ++i) {
+        struct usb_device_location location;
+        usb_get_device_location(list[i], &location);
+        if (usb_location_equal(&location, &usb->location) && usb_device_is_ique(list[i])) {
+            if (libusb_open(list[i], &handle) < 0) {
+                handle = NULL;
+            }
+            break;
+        }
+    }
+
+    libusb_free_device_list(list, 1);
+    return handle;
+}
+
+static int usb_get_device_handle(struct usb_state * usb, uint16_t vendor_id, uint16_t product_id) {
+    if (usb->location_set) {
+        usb->device_handle = usb_open_device_at_location(usb);
+    }
+    else {
+        usb->device_handle = libusb_open_device_with_vid_pid(usb->context, vendor_id, product_id);
+    }
+    return (usb->device_handle != NULL);
+}
+
+
+static int usb_detach_kernel_driver(struct usb_state * usb) {
 #ifdef __linux__ // Only need the following on Linux
-    int r = libusb_kernel_driver_active(device_handle, 0);
+    int r = libusb_kernel_driver_active(usb->device_handle, 0);
     if (r == 1) {
-        if (libusb_detach_kernel_driver(device_handle, 0) < 0) {
+        if (libusb_detach_kernel_driver(usb->device_handle, 0) < 0) {
             fprintf(stderr, "libusb_detach_kernel_driver error: %s\n", libusb_error_name(r));
             return 0;
         }
-        kernel_detached = 1;
+        usb->kernel_detached = 1;
     }
     else if (r < 0) {
         fprintf(stderr, "libusb_kernel_driver_active error: %s\n", libusb_error_name(r));
         return 0;
     }
+#else
+    (void)usb;
 #endif
     return 1;
 }
 
 
-static int usb_check_and_set_device_configuration(int desired_config) {
+static int usb_check_and_set_device_configuration(struct usb_state * usb, int desired_config) {
     int active_config = -1;
     
-    int r = libusb_get_configuration(device_handle, &active_config);
+    int r = libusb_get_configuration(usb->device_handle, &active_config);
     if (r < 0) {
         fprintf(stderr, "libusb_get_configuration error: %s\n", libusb_error_name(r));
         return 0;
@@ -96,13 +294,13 @@ static int usb_check_and_set_device_configuration(int desired_config) {
     
     if (active_config != desired_config) {
 #ifdef __linux__ // Only need the following on Linux
-//      r = libusb_reset_device(device_handle);
+//      r = libusb_reset_device(usb->device_handle);
 //      if (r < 0) {
 //            fprintf(stderr, "libusb_reset_device error: %s, exiting...\n", libusb_error_name(r));
 //            exit(EXIT_FAILURE);
 //      }
 #endif
-        r = libusb_set_configuration(device_handle, desired_config);
+        r = libusb_set_configuration(usb->device_handle, desired_config);
         if (r < 0) {
             fprintf(stderr, "libusb_set_configuration error: %s\n", libusb_error_name(r));
             return 0;
@@ -113,23 +311,23 @@ static int usb_check_and_set_device_configuration(int desired_config) {
 }
 
 
-static int usb_claim_device_interface(void) {
+static int usb_claim_device_interface(struct usb_state * usb) {
     // Make sure the device is not in an unconfigured state before claiming interface
-    int r = usb_check_and_set_device_configuration(1);
+    int r = usb_check_and_set_device_configuration(usb, 1);
     if (r < 0) {
         fprintf(stderr, "libusb_claim_interface error: %s\n", libusb_error_name(r));
         return 0;
     }
     
-    r = libusb_claim_interface(device_handle, 0);
+    r = libusb_claim_interface(usb->device_handle, 0);
     if (r < 0) {
         fprintf(stderr, "libusb_claim_interface error: %s\n", libusb_error_name(r));
         return 0;
     }
-    interface_claimed = 1;
+    usb->interface_claimed = 1;
     
     // Check (and possibly set) again to be sure the configuration wasn't changed in the meantime
-    r = usb_check_and_set_device_configuration(1);
+    r = usb_check_and_set_device_configuration(usb, 1);
     if (r < 0) {
         fprintf(stderr, "libusb_claim_interface error: %s\n", libusb_error_name(r));
         return 0;
@@ -139,96 +337,244 @@ static int usb_claim_device_interface(void) {
 }
 
 
-static int usb_connect_to_device(void) {
-    if (!cleanup_required) {
-        cleanup_required = 1;
-        atexit(usb_cleanup_close);
-    }
-
-    if (!usb_get_device_handle(IQUE_VID, IQUE_PID)) {
+static int usb_connect_to_device(struct usb_state * usb) {
+    if (!usb_get_device_handle(usb, IQUE_VID, IQUE_PID)) {
         fprintf(stderr, "The device could not be opened. Make sure it is plugged in!\n");
         return 0;
     }
     
-    if (!usb_detach_kernel_driver()) {
+    if (!usb_detach_kernel_driver(usb)) {
         fprintf(stderr, "Could not detach kernel driver.\n");
         return 0;
     }
 
-    if (!usb_claim_device_interface()) {
+    if (!usb_claim_device_interface(usb)) {
         fprintf(stderr, "Error configuring device connection.\n");
         return 0;
     }
-#if defined(AULON_LOGGING_ENABLED) && (AULON_LOGGING_ENABLED == 1)
-    usb_log_start();
-#endif
+
+    usb->max_packet_size = libusb_get_max_packet_size(libusb_get_device(usb->device_handle), IQUE_BULK_EP_IN);
+    if (usb->max_packet_size <= 0) {
+        fprintf(stderr, "Could not read the endpoint's maximum packet size; assuming 0x%x.\n", DEFAULT_MAX_PACKET_SIZE);
+        usb->max_packet_size = DEFAULT_MAX_PACKET_SIZE;
+    }
+    usb->out_transferred = 0;
+    usb->out_failed = 0;
     return 1;
 }
 
 
-int usb_init_connection(void) {
-    usb_init();
-    return usb_connect_to_device();
+/*
+    A transport takes the place of libusb when a capture is replayed, a
+    console is emulated, or a console is reached through a bridge.
+*/
+static const struct transport * usb_select_transport(void) {
+    if (replay_get_path() != NULL) {
+        return &replay_transport;
+    }
+    if (emulator_get_directory() != NULL) {
+        return &emulator_transport;
+    }
+    if (bridge_get_address() != NULL) {
+        return &bridge_transport;
+    }
+    return NULL;
+}
+
+static int usb_open_transport(struct session * session, const struct transport * transport) {
+    struct usb_state * usb = &session->usb;
+    usb->transport_state = transport->open();
+    if (usb->transport_state == NULL) {
+        return 0;
+    }
+    usb->transport = transport;
+    usb->max_packet_size = transport->max_packet_size ? transport->max_packet_size(usb->transport_state) : 0;
+    return 1;
+}
+
+static void usb_stop_log(struct usb_state * usb) {
+    if (usb->log_ring) {
+        usb_log_stop(usb->log_ring);
+        usb->log_ring = NULL;
+    }
+}
+
+/*
+    The log is started before the transport is chosen, so a connection
+    through a transport is logged the same way as one through libusb.
+*/
+int usb_init_connection(struct session * session) {
+    session->usb.log_ring = usb_log_start();
+    const struct transport * transport = usb_select_transport();
+    int success;
+    if (transport != NULL) {
+        success = usb_open_transport(session, transport);
+    }
+    else {
+        success = usb_init(&session->usb) && usb_connect_to_device(&session->usb);
+    }
+    if (!success) {
+        usb_stop_log(&session->usb);
+        return 0;
+    }
+    stats_reset(&session->stats);
+    usb_log_configuration(session);
+    return 1;
+}
+
+
+/*
+    Reconnecting
+    After the console is reset or drops off the bus, the old handle is useless,
+    so it is released without regard for errors (the device is probably gone)
+    and the connection sequence is run again until the console re-enumerates
+    or the deadline passes.
+*/
+static void usb_release_lost_device(struct session * session) {
+    struct usb_state * usb = &session->usb;
+    usb->out_failed = 0;
+    if (usb->interface_claimed) {
+        libusb_release_interface(usb->device_handle, 0);
+        usb->interface_claimed = 0;
+    }
+    usb->kernel_detached = 0;
+    if (usb->device_handle) {
+        libusb_close(usb->device_handle);
+        usb->device_handle = NULL;
+    }
+}
+
+int usb_reconnect(struct session * session) {
+    struct usb_state * usb = &session->usb;
+    if (usb->transport) {
+        usb->last_error = 0;
+        usb->out_failed = 0;
+        return usb->transport->reconnect ? usb->transport->reconnect(usb->transport_state) : 1;
+    }
+    usb_release_lost_device(session);
+    usb->last_error = 0;
+
+    struct policy_deadline deadline;
+    policy_deadline_start(&deadline, RECONNECT_DEADLINE_MS);
+    unsigned int attempt = 1;
+    while (!policy_deadline_expired(&deadline)) {
+        policy_backoff(attempt++);
+        if (usb_get_device_handle(usb, IQUE_VID, IQUE_PID)) {
+            usb_release_lost_device(session);
+            // Give it a moment to settle after re-enumerating, then connect properly
+            timer_sleep_ms(100);
+            if (usb_connect_to_device(usb)) {
+                return 1;
+            }
+            usb_release_lost_device(session);
+        }
+    }
+
+    fprintf(stderr, "The console did not reappear within %u seconds.\n", RECONNECT_DEADLINE_MS / 1000);
+    return 0;
+}
+
+/*
+    Whether the last transfer failed in a way that means the connection itself is gone
+    (as opposed to a timeout, stall, or interrupted transfer, which can simply be retried).
+*/
+int usb_connection_lost(struct session * session) {
+    switch (session->usb.last_error) {
+        case 0:
+        case LIBUSB_ERROR_TIMEOUT:
+        case LIBUSB_ERROR_PIPE:
+        case LIBUSB_ERROR_INTERRUPTED:
+        case LIBUSB_ERROR_OVERFLOW:      return 0;
+        default:
+            return 1;
+    }
+}
+
+int usb_get_last_error(struct session * session) {
+    return session->usb.last_error;
+}
+
+int32_t usb_get_last_status(struct session * session) {
+    return usb_error_to_usbmon_status(session->usb.last_error);
 }
 
 
-int usb_close_connection(void) {
-    if (interface_claimed) {
-        int r = libusb_release_interface(device_handle, 0);
+int usb_close_connection(struct session * session) {
+    struct usb_state * usb = &session->usb;
+    if (usb->transport) {
+        usb->transport->close(usb->transport_state);
+        usb->transport = NULL;
+        usb->transport_state = NULL;
+        usb->out_failed = 0;
+        usb_stop_log(usb);
+        return 1;
+    }
+    usb->out_failed = 0;
+    if (usb->interface_claimed) {
+        int r = libusb_release_interface(usb->device_handle, 0);
         if (r < 0) {
             fprintf(stderr, "libusb_release_interface error: %s\n", libusb_error_name(r));
             return 0;
         }
-        interface_claimed = 0;
+        usb->interface_claimed = 0;
     }
-    if (kernel_detached) {
-        int r = libusb_attach_kernel_driver(device_handle, 0);
+    if (usb->kernel_detached) {
+        int r = libusb_attach_kernel_driver(usb->device_handle, 0);
         if (r < 0) {
             fprintf(stderr, "libusb_attach_kernel_driver error: %s\n", libusb_error_name(r));
             return 0;
         }
-        kernel_detached = 0;
+        usb->kernel_detached = 0;
     }
-    if (device_handle) {
-        libusb_close(device_handle);
-        device_handle = NULL;
+    if (usb->device_handle) {
+        libusb_close(usb->device_handle);
+        usb->device_handle = NULL;
     }
-    if (usb_initialized) {
-        libusb_exit(NULL);
-        usb_initialized = 0;
+    if (usb->usb_initialized) {
+        libusb_exit(usb->context);
+        usb->context = NULL;
+        usb->usb_initialized = 0;
     }
-#if defined(AULON_LOGGING_ENABLED) && (AULON_LOGGING_ENABLED == 1)
-    usb_log_stop();
-#endif
+    usb_stop_log(usb);
     return 1;
 }
 
 
-int usb_handle_exists(void) {
-    return (device_handle != NULL);
+int usb_handle_exists(struct session * session) {
+    return (session->usb.device_handle != NULL) || (session->usb.transport != NULL);
 }
 
 
-static int handle_usb_error(int error_code, unsigned char endpoint, int length, int * actual_length, unsigned int timeout) {
+/*
+    wMaxPacketSize of the bulk IN endpoint, as given by its descriptor.
+*/
+int usb_get_max_packet_size(struct session * session) {
+    return session->usb.max_packet_size ? session->usb.max_packet_size : DEFAULT_MAX_PACKET_SIZE;
+}
+
+
+static int handle_usb_error(struct session * session, int error_code, unsigned char endpoint, int length, int * actual_length, unsigned int timeout) {
+    struct usb_state * usb = &session->usb;
     int success = 0; 
     const char * direction = (endpoint == IQUE_BULK_EP_IN ? "RECEIVE" : "SEND");
     
+    usb->last_error = error_code;
     switch(error_code) {
         case LIBUSB_ERROR_TIMEOUT:
             // fprintf(stderr, "\nUSB connection timed out; %u bytes of data were transferred.\n", *actual_length);
             return (*actual_length != 0);
         case LIBUSB_ERROR_PIPE:
-            libusb_clear_halt(device_handle, endpoint);
+            libusb_clear_halt(usb->device_handle, endpoint);
+            session->stats.pipe_clears++;
             break;
         case LIBUSB_ERROR_INTERRUPTED:
             break;
-        default: // Unrecoverable error
+        default: // The connection itself has failed; the caller decides whether to reconnect
             fprintf(stderr, "\n%s - libusb_bulk_transfer FATAL error: %s\n%s\n\n", direction, libusb_error_name(error_code), libusb_strerror(error_code));
             fprintf(stderr, "If this error occurred while WRITING blocks or files to the player,\nDO NOT POWER OFF OR RESET YOUR CONSOLE!\n");
-            fprintf(stderr, "Instead, simply attempt the write operation again.\n");
+            fprintf(stderr, "If the operation can't be continued, attempt the write operation again.\n");
             fprintf(stderr, "Alternatively, restart aulon, or use ique_diag.exe, in order to continue or restart the writing operation.\n");
-            exit(EXIT_FAILURE);
-            break;
+            return 0;
     }
     
     fprintf(stderr, "%s - libusb_bulk_transfer error: %s (length: %d, actual_length: %d, timeout: %u)\n",
@@ -236,37 +582,293 @@ static int handle_usb_error(int error_code, unsigned char endpoint, int length,
     return success;
 }
 
-int usb_bulk_transfer_send(unsigned char * data, int length, int * actual_length, unsigned int timeout) {
+/*
+    The status usbmon would have reported for a transfer that ended with
+    the given libusb error code (a negative Linux errno value).
+*/
+static int32_t usb_error_to_usbmon_status(int error_code) {
+    switch (error_code) {
+        case 0:                          return 0;
+        case LIBUSB_ERROR_TIMEOUT:       return -110; // ETIMEDOUT
+        case LIBUSB_ERROR_PIPE:          return -32;  // EPIPE
+        case LIBUSB_ERROR_NO_DEVICE:     return -19;  // ENODEV
+        case LIBUSB_ERROR_OVERFLOW:      return -75;  // EOVERFLOW
+        case LIBUSB_ERROR_INTERRUPTED:   return -2;   // ENOENT, as for a cancelled URB
+        default:                         return -71;  // EPROTO
+    }
+}
+
+/*
+    A transport has no place on a bus, so its transfers are logged as bus 0,
+    device 0.
+*/
+static void usb_log_address(struct usb_state * usb, struct usb_log_transfer * transfer) {
+    transfer->bus    = 0;
+    transfer->device = 0;
+    if (usb->device_handle != NULL) {
+        libusb_device * device = libusb_get_device(usb->device_handle);
+        transfer->bus    = libusb_get_bus_number(device);
+        transfer->device = libusb_get_device_address(device);
+    }
+}
+
+static void usb_log_completed_transfer(struct usb_state * usb, unsigned char endpoint, const unsigned char * data, int length,
+                                       int actual_length, int error_code, uint64_t submit_us, uint64_t complete_us) {
+    struct usb_log_transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.type             = USB_LOG_BULK;
+    usb_log_address(usb, &transfer);
+    transfer.endpoint         = endpoint;
+    transfer.data             = data;
+    transfer.requested_length = (uint32_t)length;
+    transfer.actual_length    = (uint32_t)actual_length;
+    transfer.status           = usb_error_to_usbmon_status(error_code);
+    transfer.submit_us        = submit_us;
+    transfer.complete_us      = complete_us;
+    usb_log_transfer(usb->log_ring, &transfer);
+}
+
+/*
+    A replay has no endpoint to ask for its maximum packet size, so each
+    capture starts with the configuration descriptor the connection was made
+    with, logged as the control transfer that would have read it (bmRequestType
+    0x80, GET_DESCRIPTOR, configuration 0, wLength 32): one vendor-specific
+    interface with the two bulk endpoints.
+*/
+static void usb_log_configuration(struct session * session) {
+    struct usb_state * usb = &session->usb;
+    if (usb->log_ring == NULL || usb_log_get_level() == USB_LOG_OFF) {
+        return;
+    }
+    static const unsigned char setup[8] = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0x20, 0x00 };
+    int max_packet_size = usb_get_max_packet_size(session);
+    unsigned char size_low = (unsigned char)(max_packet_size & 0xFF);
+    unsigned char size_high = (unsigned char)((max_packet_size >> 8) & 0xFF);
+    unsigned char descriptor[32] = {
+        0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,                   // configuration
+        0x09, 0x04, 0x00, 0x00, 0x02, 0xFF, 0x00, 0x00, 0x00,                   // interface
+        0x07, 0x05, IQUE_BULK_EP_IN,  0x02, size_low, size_high, 0x00,          // endpoints
+        0x07, 0x05, IQUE_BULK_EP_OUT, 0x02, size_low, size_high, 0x00
+    };
+
+    struct usb_log_transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.type             = USB_LOG_CONTROL;
+    usb_log_address(usb, &transfer);
+    transfer.endpoint         = 0x80;
+    transfer.data             = descriptor;
+    transfer.requested_length = sizeof(descriptor);
+    transfer.actual_length    = sizeof(descriptor);
+    transfer.status           = 0;
+    transfer.submit_us        = timer_now_us();
+    transfer.complete_us      = transfer.submit_us;
+    memcpy(transfer.setup, setup, sizeof(setup));
+    usb_log_transfer(usb->log_ring, &transfer);
+}
+
+/*
+    The libusb error code for a usbmon status, as a transport reports a
+    transfer's result.
+*/
+static int usbmon_status_to_usb_error(int32_t status) {
+    switch (status) {
+        case 0:     return 0;
+        case -110:  return LIBUSB_ERROR_TIMEOUT;
+        case -32:   return LIBUSB_ERROR_PIPE;
+        case -19:   return LIBUSB_ERROR_NO_DEVICE;
+        case -75:   return LIBUSB_ERROR_OVERFLOW;
+        case -2:    return LIBUSB_ERROR_INTERRUPTED;
+        default:    return LIBUSB_ERROR_IO;
+    }
+}
+
+/*
+    Every completed transfer feeds the adaptive timeouts and the session's
+    statistics, and is captured to the log.
+*/
+static void usb_record_transfer(struct session * session, unsigned char endpoint, const unsigned char * data, int length,
+                                int actual_length, int error_code, int success, uint64_t submit_us, uint64_t complete_us) {
+    uint64_t latency_us = complete_us - submit_us;
+    int timed_out = (error_code == LIBUSB_ERROR_TIMEOUT);
+    session->stats.usb_us += latency_us;
+    policy_record_transfer(&session->policy, latency_us, success, timed_out);
+    stats_record_transfer(&session->stats, endpoint == IQUE_BULK_EP_IN, actual_length, latency_us, timed_out, error_code < 0);
+    if (session->usb.log_ring && usb_log_get_level() != USB_LOG_OFF) {
+        usb_log_completed_transfer(&session->usb, endpoint, data, length, actual_length, error_code, submit_us, complete_us);
+    }
+}
+
+
+/*
+    A transfer made through libusb, which waits for it to complete. Sends
+    are made at once rather than queued: the console only answers what it
+    has received, so every send is either flushed straight away or followed
+    by a receive that would have to wait for it anyway, and there is
+    nothing for a queue of transfers to overlap.
+*/
+static int usb_libusb_transfer(struct session * session, unsigned char endpoint, unsigned char * data, int length,
+                               int * actual_length, unsigned int timeout) {
+    struct usb_state * usb = &session->usb;
+    *actual_length = 0;
+    uint64_t submit_us = timer_now_us();
+    int r = libusb_bulk_transfer(usb->device_handle, endpoint, data, length, actual_length, timeout);
+    uint64_t complete_us = timer_now_us();
+
     int success = 1;
-    int r = libusb_bulk_transfer(device_handle, IQUE_BULK_EP_OUT, data, length, actual_length, timeout);
+    usb->last_error = r;
     if (r < 0) {
-        success = handle_usb_error(r, IQUE_BULK_EP_OUT, length, actual_length, timeout);
+        success = handle_usb_error(session, r, endpoint, length, actual_length, timeout);
     }
-#if defined(AULON_LOGGING_ENABLED) && (AULON_LOGGING_ENABLED == 1)
-    if (success) {
-        usb_log_comms(data, *actual_length, 1);
+    usb_record_transfer(session, endpoint, data, length, *actual_length, r, success, submit_us, complete_us);
+    return success;
+}
+
+
+/*
+    Transports
+    A transfer that fails over a transport fails the same way a real one
+    would (a timed-out IN transfer that still received data counting as a
+    success). One that fails without saying why is treated as a protocol
+    error, which usb_connection_lost takes to mean the connection is gone.
+
+    Sends are handed straight to the transport, which may batch them, so
+    there is nothing to flush before a receive: the transport delivers any
+    batched data ahead of it, and reports a failure to send it as the
+    receive's.
+*/
+static int usb_transport_result(int success, int32_t status) {
+    if (!success && status == 0) {
+        return LIBUSB_ERROR_IO;
     }
-    else {
-        usb_log_error(libusb_error_name(r));
+    return usbmon_status_to_usb_error(status);
+}
+
+static int usb_transport_send(struct session * session, unsigned char * data, int length, unsigned int timeout) {
+    struct usb_state * usb = &session->usb;
+    int32_t status = 0;
+    uint64_t submit_us = timer_now_us();
+    int success = usb->transport->send(usb->transport_state, data, (uint32_t)length, timeout, &status);
+    uint64_t complete_us = timer_now_us();
+    int r = usb_transport_result(success, status);
+
+    usb->last_error = r;
+    usb_record_transfer(session, IQUE_BULK_EP_OUT, data, length, (r == 0) ? length : 0, r, r == 0, submit_us, complete_us);
+    if (r < 0) {
+        usb->out_failed = 1;
+        return 0;
     }
-#endif
+    usb->out_transferred += length;
+    return 1;
+}
+
+static int usb_transport_flush(struct session * session) {
+    struct usb_state * usb = &session->usb;
+    if (usb->transport->flush && !usb->out_failed) {
+        int32_t status = 0;
+        uint64_t start_time = timer_now_us();
+        int success = usb->transport->flush(usb->transport_state, &status);
+        session->stats.usb_us += timer_now_us() - start_time;
+        usb->last_error = usb_transport_result(success, status);
+        if (usb->last_error < 0) {
+            usb->out_failed = 1;
+        }
+    }
+
+    int success = !usb->out_failed;
+    usb->out_failed = 0;
     return success;
 }
 
+static int usb_transport_receive(struct session * session, unsigned char * data, int length, int * actual_length, unsigned int timeout) {
+    struct usb_state * usb = &session->usb;
+    if (usb->out_failed) {
+        usb->out_failed = 0;
+        return 0;
+    }
 
-int usb_bulk_transfer_receive(unsigned char * data, int length, int * actual_length, unsigned int timeout) {
-    int success = 1;
-    int r = libusb_bulk_transfer(device_handle, IQUE_BULK_EP_IN, data, length, actual_length, timeout);
-    if (r < 0) {
-        success = handle_usb_error(r, IQUE_BULK_EP_IN, length, actual_length, timeout);
+    uint32_t received = 0;
+    int32_t status = 0;
+    uint64_t submit_us = timer_now_us();
+    int transport_success = usb->transport->receive(usb->transport_state, data, (uint32_t)length, timeout, &received, &status);
+    uint64_t complete_us = timer_now_us();
+    int r = usb_transport_result(transport_success, status);
+    int success = (r == 0) || (r == LIBUSB_ERROR_TIMEOUT && received != 0);
+
+    *actual_length = (int)received;
+    usb->last_error = r;
+    if (r == LIBUSB_ERROR_PIPE) {
+        session->stats.pipe_clears++;
     }
-#if defined(AULON_LOGGING_ENABLED) && (AULON_LOGGING_ENABLED == 1)
-    if (success) {
-        usb_log_comms(data, *actual_length, 0);
+    usb_record_transfer(session, IQUE_BULK_EP_IN, data, length, *actual_length, r, success, submit_us, complete_us);
+    return success;
+}
+
+
+/*
+    Send data, which a transport may only queue; the caller may reuse its
+    buffer immediately. Once a send has failed, later ones fail at once, and
+    the failure is reported by the next call to usb_bulk_transfer_flush (or
+    by the next send or receive, which both flush first).
+*/
+int usb_bulk_transfer_send_async(struct session * session, unsigned char * data, int length, unsigned int timeout) {
+    struct usb_state * usb = &session->usb;
+    if (usb->transport) {
+        return usb_transport_send(session, data, length, timeout);
     }
-    else {
-        usb_log_error(libusb_error_name(r));
+    int actual_length = 0;
+    if (usb->out_failed || !usb_libusb_transfer(session, IQUE_BULK_EP_OUT, data, length, &actual_length, timeout)) {
+        usb->out_failed = 1;
+        return 0;
     }
-#endif
+    usb->out_transferred += actual_length;
+    return 1;
+}
+
+
+/*
+    Wait for any queued sends to reach the console, and report whether
+    everything sent since the last flush succeeded.
+*/
+int usb_bulk_transfer_flush(struct session * session) {
+    struct usb_state * usb = &session->usb;
+    if (usb->transport) {
+        return usb_transport_flush(session);
+    }
+    int success = !usb->out_failed;
+    usb->out_failed = 0;
+    return success;
+}
+
+
+int usb_bulk_transfer_send(struct session * session, unsigned char * data, int length, int * actual_length, unsigned int timeout) {
+    if (!usb_bulk_transfer_flush(session)) {
+        *actual_length = 0;
+        return 0;
+    }
+
+    session->usb.out_transferred = 0;
+    int success = usb_bulk_transfer_send_async(session, data, length, timeout);
+    if (!usb_bulk_transfer_flush(session)) {
+        success = 0;
+    }
+    *actual_length = session->usb.out_transferred;
     return success;
 }
+
+
+/*
+    The console only answers once it has received everything sent to it, so any
+    queued sends are flushed first. On Linux, libusb itself splits a large IN
+    transfer into several URBs and keeps them all in flight.
+*/
+int usb_bulk_transfer_receive(struct session * session, unsigned char * data, int length, int * actual_length, unsigned int timeout) {
+    struct usb_state * usb = &session->usb;
+    *actual_length = 0;
+    if (usb->transport) {
+        return usb_transport_receive(session, data, length, actual_length, timeout);
+    }
+    if (!usb_bulk_transfer_flush(session)) {
+        return 0;
+    }
+    return usb_libusb_transfer(session, IQUE_BULK_EP_IN, data, length, actual_length, timeout);
+}
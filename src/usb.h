@@ -20,14 +20,83 @@
 #ifndef AULON_USB_H
 #define AULON_USB_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct session;
+struct libusb_context;
+struct libusb_device_handle;
+struct usb_log_ring;
+struct transport;
+
 /*
-    All functions return 1 for success and 0 for failure.
+    Where a console is plugged in: its bus, and the chain of hub ports
+    leading to it. Unlike the device address, this stays the same when the
+    console is reset and re-enumerates, so it identifies one console of many.
 */
-int usb_init_connection(void);
-int usb_close_connection(void);
-int usb_handle_exists(void);
-int usb_bulk_transfer_send(unsigned char * data, int length, int * actual_length, unsigned int timeout);
-int usb_bulk_transfer_receive(unsigned char * data, int length, int * actual_length, unsigned int timeout);
+#define USB_MAX_PORT_DEPTH 7
 
-#endif
+struct usb_device_location {
+    uint8_t bus;
+    uint8_t ports[USB_MAX_PORT_DEPTH];
+    int depth;
+};
+
+/*
+    A console being plugged in or unplugged, as seen by the hotplug monitor.
+*/
+struct usb_hotplug_event {
+    int arrived;    // 1 if the console was plugged in, 0 if it was unplugged
+    struct usb_device_location location;
+};
+
+/*
+    The USB connection to one console. Each has its own libusb context,
+    so that several consoles can be driven from separate threads.
+*/
+struct usb_state {
+    struct libusb_context * context;
+    struct libusb_device_handle * device_handle;
+    int kernel_detached;
+    int interface_claimed;
+    int usb_initialized;
+    int max_packet_size;
+    int last_error;                 // libusb error code of the last transfer, or 0 if it succeeded
+    struct usb_device_location location;
+    int location_set;               // open the console at location, rather than the first one found
+    struct usb_log_ring * log_ring; // where this connection's transfers are queued for the log, if there is one
+    const struct transport * transport; // what carries the transfers in place of libusb, if anything
+    void * transport_state;
 
+    int out_transferred;            // bytes sent since the last flush
+    int out_failed;                 // a send failed since the last flush
+};
+
+/*
+    All functions return 1 for success and 0 for failure, except
+    usb_get_max_packet_size, usb_get_last_error (which returns the
+    libusb error code of the last transfer, or 0), usb_get_last_status
+    (the same as a usbmon status: 0, or a negative errno), and usb_find_devices
+    and usb_hotplug_wait (which return the number of consoles or events
+    found, or -1 on error).
+*/
+int usb_find_devices(struct usb_device_location * locations, int max_locations);
+void usb_format_location(const struct usb_device_location * location, char * buffer, size_t buffer_length);
+void usb_set_device_location(struct session * session, const struct usb_device_location * location);
+int usb_hotplug_start(void);
+int usb_hotplug_wait(struct usb_hotplug_event * events, int max_events, unsigned int timeout_ms);
+void usb_hotplug_stop(void);
+int usb_init_connection(struct session * session);
+int usb_close_connection(struct session * session);
+int usb_reconnect(struct session * session);
+int usb_connection_lost(struct session * session);
+int usb_get_last_error(struct session * session);
+int32_t usb_get_last_status(struct session * session);
+int usb_handle_exists(struct session * session);
+int usb_get_max_packet_size(struct session * session);
+int usb_bulk_transfer_send(struct session * session, unsigned char * data, int length, int * actual_length, unsigned int timeout);
+int usb_bulk_transfer_send_async(struct session * session, unsigned char * data, int length, unsigned int timeout);
+int usb_bulk_transfer_flush(struct session * session);
+int usb_bulk_transfer_receive(struct session * session, unsigned char * data, int length, int * actual_length, unsigned int timeout);
+
+#endif
@@ -1,6 +1,6 @@
 /*
     usb_log.c
-    functions for writing USB communications to a log file
+    functions for capturing USB communications to a pcap file
 
     Copyright (c) 2018,2020 Jbop (https://github.com/jbop1626)
     This file is a part of aulon.
@@ -18,54 +18,401 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include "usb_log.h"
 #include "io.h"
+#include "thread.h"
+#include "timer.h"
 
 
-static int log_open = 0;
+/*
+    The log is a pcap capture with the same link type as Linux's usbmon
+    (LINKTYPE_USB_LINUX_MMAPPED), so it can be opened in Wireshark or read
+    with tcpdump and friends. Each transfer is recorded as a submission and a
+    completion, each with usbmon's 64-byte header; OUT data goes with the
+    submission and IN data with the completion, as usbmon captures them.
+    Records are written in host byte order, which the pcap magic number
+    tells readers about.
+*/
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_VERSION_MAJOR  2
+#define PCAP_VERSION_MINOR  4
+#define PCAP_SNAPLEN        0x40000
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED 220
+
+#define USBMON_HEADER_SIZE   64
+#define USBMON_EVENT_SUBMIT   'S'
+#define USBMON_EVENT_COMPLETE 'C'
+#define USBMON_EINPROGRESS    (-115)
+
+#define LOG_BUFFER_SIZE     (1024 * 1024)
+#define LOG_MAX_CAPTURE     (PCAP_SNAPLEN - USBMON_HEADER_SIZE)
+
+/*
+    Logging a transfer only copies it into its connection's ring; a writer
+    thread drains the rings and writes the capture through a large stdio
+    buffer, which is only flushed when the log is closed. Each ring has one
+    producer (the thread driving the connection) and one consumer (whoever
+    holds log_lock: the writer thread, or usb_log_stop draining the ring one
+    last time), so the producer never waits for a lock or for the disk. If
+    a ring is full, the transfer is dropped from the log rather than
+    holding up the connection, and the drops are reported when it stops.
+
+    head and tail count bytes ever written and read, wrapping at 2^32; the
+    ring's size is a power of two, so they index it modulo its size. Records
+    may wrap around the end of the ring.
+*/
+#define LOG_RING_SIZE       (1024 * 1024)
+#define LOG_WRITER_IDLE_MS  2
+
+struct usb_log_ring {
+    unsigned char * buffer;
+    volatile uint32_t head;     // written only by the producer
+    volatile uint32_t tail;     // written only by the consumer
+    unsigned long dropped;      // producer only
+    struct usb_log_ring * next;
+};
+
+struct usb_log_record {
+    uint32_t size;              // of the record and its data, rounded up to 8 bytes
+    uint32_t captured_length;
+    struct usb_log_transfer transfer;
+};
+
+#define LOG_RECORD_SIZE(captured) ((uint32_t)((sizeof(struct usb_log_record) + (captured) + 7) & ~(size_t)7))
+
+
+/*
+    One log is shared by every open connection, so it (and the writer
+    thread) is started by the first connection and stopped by the last.
+    log_lock guards the file and the list of rings; start_stop_lock keeps
+    a connection from starting the log while another is stopping it. Both
+    locks are set up along with the path, before any connection can exist.
+    The capture is started afresh the first time the log is opened, and
+    appended to by later connections in the same run.
+*/
 static char * log_path = NULL;
+static volatile uint32_t log_level = USB_LOG_FULL;
+static int log_users = 0;
+static aulon_mutex start_stop_lock;
+
+static aulon_mutex log_lock;
 static FILE * log_file = NULL;
+static struct usb_log_ring * log_rings = NULL;
+static unsigned char * log_scratch = NULL;   // a record's data, copied out of its ring
+static int log_header_written = 0;
+static uint64_t log_urb_id = 0;
+static uint64_t log_epoch_us = 0;    // wall-clock time, in us, at timer_now_us() == 0
+
+static aulon_thread writer_thread;
+static int writer_stop = 0;
+
+static const char * LEVEL_NAMES[] = { "off", "errors", "headers", "full" };
+
+
+static void put_u16(unsigned char * out, uint16_t value) { memcpy(out, &value, sizeof(value)); }
+static void put_u32(unsigned char * out, uint32_t value) { memcpy(out, &value, sizeof(value)); }
+static void put_u64(unsigned char * out, uint64_t value) { memcpy(out, &value, sizeof(value)); }
+
+static void write_pcap_header(void) {
+    unsigned char header[24] = { 0 };
+    put_u32(&header[0],  PCAP_MAGIC);
+    put_u16(&header[4],  PCAP_VERSION_MAJOR);
+    put_u16(&header[6],  PCAP_VERSION_MINOR);
+    put_u32(&header[16], PCAP_SNAPLEN);
+    put_u32(&header[20], PCAP_LINKTYPE_USB_LINUX_MMAPPED);
+    fwrite(header, 1, sizeof(header), log_file);
+}
+
+/*
+    Write one usbmon event, with data_length bytes of data if data is not NULL.
+*/
+static void write_usbmon_record(const struct usb_log_transfer * transfer, uint64_t id, char event,
+                                uint64_t time_us, int32_t status, const unsigned char * data, uint32_t data_length) {
+    uint64_t wall_us = log_epoch_us + time_us;
+    uint32_t captured = (data == NULL) ? 0 : data_length;
+    if (captured > PCAP_SNAPLEN - USBMON_HEADER_SIZE) {
+        captured = PCAP_SNAPLEN - USBMON_HEADER_SIZE;
+    }
+
+    unsigned char record[16] = { 0 };
+    put_u32(&record[0],  (uint32_t)(wall_us / 1000000));
+    put_u32(&record[4],  (uint32_t)(wall_us % 1000000));
+    put_u32(&record[8],  USBMON_HEADER_SIZE + captured);
+    put_u32(&record[12], USBMON_HEADER_SIZE + captured);
+    fwrite(record, 1, sizeof(record), log_file);
+
+    unsigned char header[USBMON_HEADER_SIZE] = { 0 };
+    put_u64(&header[0], id);
+    header[8]  = (unsigned char)event;
+    header[9]  = transfer->type;
+    header[10] = transfer->endpoint;
+    header[11] = transfer->device;
+    put_u16(&header[12], transfer->bus);
+    header[14] = '-';                                   // no setup packet
+    header[15] = (data != NULL) ? 0 : ((transfer->endpoint & 0x80) ? '<' : '>');
+    if (transfer->type == USB_LOG_CONTROL && event == USBMON_EVENT_SUBMIT) {
+        header[14] = 0;
+        memcpy(&header[40], transfer->setup, sizeof(transfer->setup));
+    }
+    put_u64(&header[16], wall_us / 1000000);
+    put_u32(&header[24], (uint32_t)(wall_us % 1000000));
+    put_u32(&header[28], (uint32_t)status);
+    put_u32(&header[32], data_length);
+    put_u32(&header[36], captured);
+    fwrite(header, 1, sizeof(header), log_file);
+
+    if (captured) {
+        fwrite(data, 1, captured, log_file);
+    }
+}
+
+
+
+/*
+    Copy to and from a ring, wrapping around its end.
+*/
+static void ring_write(struct usb_log_ring * ring, uint32_t position, const void * data, uint32_t length) {
+    uint32_t offset = position & (LOG_RING_SIZE - 1);
+    uint32_t first = (length < LOG_RING_SIZE - offset) ? length : LOG_RING_SIZE - offset;
+    memcpy(ring->buffer + offset, data, first);
+    memcpy(ring->buffer, (const unsigned char *)data + first, length - first);
+}
+
+static void ring_read(const struct usb_log_ring * ring, uint32_t position, void * data, uint32_t length) {
+    uint32_t offset = position & (LOG_RING_SIZE - 1);
+    uint32_t first = (length < LOG_RING_SIZE - offset) ? length : LOG_RING_SIZE - offset;
+    memcpy(data, ring->buffer + offset, first);
+    memcpy((unsigned char *)data + first, ring->buffer, length - first);
+}
+
+/*
+    Write out every record in the ring. Called with log_lock held.
+    Returns the number of records written.
+*/
+static int drain_ring(struct usb_log_ring * ring) {
+    int records = 0;
+    uint32_t tail = ring->tail;
+    uint32_t head = atomic_load_u32(&ring->head);
+    while (tail != head) {
+        struct usb_log_record record;
+        ring_read(ring, tail, &record, sizeof(record));
+        ring_read(ring, tail + sizeof(record), log_scratch, record.captured_length);
+        atomic_store_u32(&ring->tail, tail + record.size);
+        tail += record.size;
+
+        if (log_file) {
+            const struct usb_log_transfer * transfer = &record.transfer;
+            int in = (transfer->endpoint & 0x80) != 0;
+            const unsigned char * data = record.captured_length ? log_scratch : NULL;
+            uint64_t id = ++log_urb_id;
+            write_usbmon_record(transfer, id, USBMON_EVENT_SUBMIT, transfer->submit_us, USBMON_EINPROGRESS,
+                                in ? NULL : data, transfer->requested_length);
+            write_usbmon_record(transfer, id, USBMON_EVENT_COMPLETE, transfer->complete_us, transfer->status,
+                                in ? data : NULL, transfer->actual_length);
+        }
+        records++;
+    }
+    return records;
+}
+
+static void log_writer_run(void * argument) {
+    (void)argument;
+    for (;;) {
+        mutex_lock(&log_lock);
+        int records = 0;
+        struct usb_log_ring * ring;
+        for (ring = log_rings; ring != NULL; ring = ring->next) {
+            records += drain_ring(ring);
+        }
+        int stopping = writer_stop;
+        mutex_unlock(&log_lock);
+
+        if (stopping) {
+            return;
+        }
+        if (records == 0) {
+            timer_sleep_ms(LOG_WRITER_IDLE_MS);
+        }
+    }
+}
 
 
+int usb_log_parse_level(const char * name, enum usb_log_level * level) {
+    unsigned int i;
+    for (i = 0; i < sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]); ++i) {
+        if (strcmp(name, LEVEL_NAMES[i]) == 0) {
+            *level = (enum usb_log_level)i;
+            return 1;
+        }
+    }
+    fprintf(stderr, "Unknown log level '%s'; use off, errors, headers, or full.\n", name);
+    return 0;
+}
+
+void usb_log_set_level(enum usb_log_level level) {
+    atomic_store_u32(&log_level, (uint32_t)level);
+}
+
+enum usb_log_level usb_log_get_level(void) {
+    return (enum usb_log_level)atomic_load_u32(&log_level);
+}
+
 void usb_log_set_path(char * path) {
+    if (!log_path) {
+        mutex_init(&start_stop_lock);
+        mutex_init(&log_lock);
+    }
     log_path = path;
 }
 
-void usb_log_start(void) {
+int usb_log_has_path(void) {
+    return log_path != NULL;
+}
+
+
+static int open_log(void) {
+    if (!open_file(&log_file, log_path, log_header_written ? "ab" : "wb")) {
+        fprintf(stderr, "Log file could not be opened. Logging aborted.\n");
+        log_file = NULL;
+        return 0;
+    }
+    log_scratch = malloc(LOG_MAX_CAPTURE);
+    if (log_scratch == NULL) {
+        fprintf(stderr, "Could not allocate memory for logging. Logging aborted.\n");
+        fclose(log_file);
+        log_file = NULL;
+        return 0;
+    }
+    setvbuf(log_file, NULL, _IOFBF, LOG_BUFFER_SIZE);
+    if (!log_header_written) {
+        write_pcap_header();
+        log_header_written = 1;
+    }
+    log_epoch_us = (uint64_t)time(NULL) * 1000000 - timer_now_us();
+
+    writer_stop = 0;
+    if (!thread_create(&writer_thread, log_writer_run, NULL)) {
+        fprintf(stderr, "Could not start the log writer. Logging aborted.\n");
+        free(log_scratch);
+        log_scratch = NULL;
+        fclose(log_file);
+        log_file = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void close_log(void) {
+    mutex_lock(&log_lock);
+    writer_stop = 1;
+    mutex_unlock(&log_lock);
+    thread_join(writer_thread);
+
+    fclose(log_file);
+    log_file = NULL;
+    free(log_scratch);
+    log_scratch = NULL;
+}
+
+struct usb_log_ring * usb_log_start(void) {
     if (!log_path) {
         // Log file path wasn't specified, so just exit.
-        return;
+        return NULL;
     }
-    if (!open_file(&log_file, log_path, "a")) {
-        fprintf(stderr, "Log file could not be opened. Logging aborted.\n");
-        return;
+
+    struct usb_log_ring * ring = calloc(1, sizeof(struct usb_log_ring));
+    if (ring != NULL) {
+        ring->buffer = malloc(LOG_RING_SIZE);
+    }
+    if (ring == NULL || ring->buffer == NULL) {
+        fprintf(stderr, "Could not allocate memory for logging. This connection will not be logged.\n");
+        free(ring);
+        return NULL;
     }
-    fprintf(log_file, "\nLogging session started:\n");
-    log_open = 1;
-}
 
-void usb_log_stop(void) {
-    if(log_open) {
-        fprintf(log_file, "Logging session ended.\n");
-        fclose(log_file);
-        log_open = 0;
+    mutex_lock(&start_stop_lock);
+    if (log_users == 0 && !open_log()) {
+        mutex_unlock(&start_stop_lock);
+        free(ring->buffer);
+        free(ring);
+        return NULL;
     }
+    log_users++;
+    mutex_lock(&log_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    mutex_unlock(&log_lock);
+    mutex_unlock(&start_stop_lock);
+    return ring;
 }
 
-void usb_log_comms(unsigned char * buffer, unsigned int length, int direction) {
-    if (log_open) {
-        char * direction_label = (direction ? "SEND >>>" : "RECEIVE <<<");
-        fprintf(log_file, "%s %d bytes:\n", direction_label, length);
-        print_buffer(buffer, length, log_file);
-        fflush(log_file);
+void usb_log_stop(struct usb_log_ring * ring) {
+    if (ring == NULL) {
+        return;
+    }
+
+    mutex_lock(&start_stop_lock);
+    mutex_lock(&log_lock);
+    drain_ring(ring);
+    struct usb_log_ring ** link = &log_rings;
+    while (*link != ring) {
+        link = &(*link)->next;
+    }
+    *link = ring->next;
+    mutex_unlock(&log_lock);
+
+    if (--log_users == 0) {
+        close_log();
     }
+    mutex_unlock(&start_stop_lock);
+
+    if (ring->dropped) {
+        fprintf(stderr, "%lu USB transfers were left out of the log because it could not keep up.\n", ring->dropped);
+    }
+    free(ring->buffer);
+    free(ring);
 }
 
-void usb_log_error(const char * error) {
-    if (log_open) {
-        fprintf(log_file, "\nERROR - %s\n\n", error);
-        fflush(log_file);
+
+/*
+    Queue a transfer to be logged, if the log level calls for it. This runs
+    on the transfer path, so it does no more than copy the transfer into
+    the connection's ring.
+*/
+void usb_log_transfer(struct usb_log_ring * ring, const struct usb_log_transfer * transfer) {
+    uint32_t level = atomic_load_u32(&log_level);
+    if (ring == NULL || level == USB_LOG_OFF || (level == USB_LOG_ERRORS && transfer->status == 0)) {
+        return;
+    }
+
+    struct usb_log_record record;
+    record.transfer = *transfer;
+    record.transfer.data = NULL;
+    record.captured_length = 0;
+    if (level == USB_LOG_FULL) {
+        int in = (transfer->endpoint & 0x80) != 0;
+        record.captured_length = in ? transfer->actual_length : transfer->requested_length;
+        if (record.captured_length > LOG_MAX_CAPTURE) {
+            record.captured_length = LOG_MAX_CAPTURE;
+        }
+    }
+    record.size = LOG_RECORD_SIZE(record.captured_length);
+
+    uint32_t head = ring->head;
+    uint32_t used = head - atomic_load_u32(&ring->tail);
+    if (record.size > LOG_RING_SIZE - used) {
+        ring->dropped++;
+        return;
+    }
+    ring_write(ring, head, &record, sizeof(record));
+    if (record.captured_length) {
+        ring_write(ring, head + sizeof(record), transfer->data, record.captured_length);
     }
+    atomic_store_u32(&ring->head, head + record.size);
 }
@@ -1,6 +1,6 @@
 /*
     usb_log.h
-    functions for writing USB communications to a log file
+    functions for capturing USB communications to a pcap file
 
     Copyright (c) 2018 Jbop (https://github.com/jbop1626)
     This file is a part of aulon.
@@ -21,10 +21,64 @@
 #ifndef AULON_USB_LOG_H
 #define AULON_USB_LOG_H
 
+#include <stdint.h>
+
+/*
+    How much of each transfer is captured: nothing, only transfers that
+    failed, the usbmon headers of every transfer, or every transfer's data
+    as well.
+*/
+enum usb_log_level {
+    USB_LOG_OFF,
+    USB_LOG_ERRORS,
+    USB_LOG_HEADERS,
+    USB_LOG_FULL
+};
+
+/*
+    Transfer types, numbered as usbmon numbers them.
+*/
+enum usb_log_transfer_type {
+    USB_LOG_CONTROL = 2,
+    USB_LOG_BULK    = 3
+};
+
+/*
+    One completed transfer, as seen by usb.c. status is 0 for success
+    or a negative errno value, as usbmon reports it (e.g. -ETIMEDOUT).
+    Apart from bulk transfers, the only transfer logged is a control
+    transfer reading the configuration descriptor, which records the
+    endpoints' packet size for a replay of the capture.
+*/
+struct usb_log_transfer {
+    uint8_t type;               // an enum usb_log_transfer_type
+    uint8_t bus;
+    uint8_t device;
+    uint8_t endpoint;           // including the direction bit (0x80 for IN)
+    const unsigned char * data; // OUT: the data sent; IN: the data received
+    uint32_t requested_length;
+    uint32_t actual_length;
+    int32_t status;
+    uint64_t submit_us;         // timer_now_us() when submitted and completed
+    uint64_t complete_us;
+    unsigned char setup[8];     // the setup packet of a control transfer
+};
+
+// Each connection queues its transfers in a ring of its own
+struct usb_log_ring;
+
+/*
+    usb_log_parse_level returns 1 for success and 0 for failure.
+    usb_log_start returns NULL if there is no log to write to.
+*/
+int usb_log_parse_level(const char * name, enum usb_log_level * level);
+void usb_log_set_level(enum usb_log_level level);
+enum usb_log_level usb_log_get_level(void);
 void usb_log_set_path(char * path);
-void usb_log_start(void);
-void usb_log_stop(void);
-void usb_log_comms(unsigned char * buffer, unsigned int length, int direction);
-void usb_log_error(const char * error);
+int usb_log_has_path(void);
+
+struct usb_log_ring * usb_log_start(void);
+void usb_log_stop(struct usb_log_ring * ring);
+void usb_log_transfer(struct usb_log_ring * ring, const struct usb_log_transfer * transfer);
 
 #endif